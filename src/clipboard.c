@@ -4,6 +4,10 @@
 #include "clipboard.h"
 #include "halen.h"
 #include "history.h"
+#include "overflow.h"
+#include "content_cache.h"
+#include "thumbnail.h"
+#include "owner.h"
 #include "xdg.h"
 #include "text.h"
 
@@ -21,131 +25,1358 @@
 #include <sys/syslog.h>
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+// polling is only used when the X server has no XFixes, the interval
+// doubles while the owners stay the same
+#define POLL_MIN_INTERVAL_MS 250
+#define POLL_MAX_INTERVAL_MS 8000
+// a transfer is abandoned if the owner doesn't answer within this time
+#define TRANSFER_TIMEOUT_MS 500
+// amount of a property requested per XGetWindowProperty (in 32-bit units)
+#define PROPERTY_CHUNK_LONGS 16384
+// how long clipboard_set_entry waits for the clipboard thread to own the selection
+#define OWNERSHIP_TIMEOUT_MS 1000
+#define MAX_CAPTURE_TARGETS 8
+#define MAX_OUTGOING_TRANSFERS 8
+#define TEXT_TARGET_COUNT 5
+// owner changes are collected for this long before the selection is read,
+// a burst that keeps going is still read after DEBOUNCE_MAX_DELAY_MS
+#define DEBOUNCE_MS 100
+#define DEBOUNCE_MAX_DELAY_MS 500
+// token bucket per selection (tokens are in thousandths)
+#define RATE_LIMIT_BURST 4
+#define RATE_LIMIT_REFILL_MS 1000
+// PRIMARY captures of the same owner that extend the previous one within
+// this time replace it, a drag selection only keeps its final extent
+#define PRIMARY_COALESCE_MS 3000
+// text marked as sensitive is read into memory, never into the overflow directory
+#define SENSITIVE_MAX_LENGTH 65536
+// the text of the last CLIPBOARD capture is kept in memory up to this size,
+// to serve it once its owner exits
+#define PERSIST_MAX_LENGTH (1024 * 1024)
+
+typedef enum {
+    TRANSFER_IDLE = 0,
+    TRANSFER_WAITING,   // XConvertSelection sent, waiting for SelectionNotify
+    TRANSFER_INCR       // receiving chunks through PropertyNotify
+} transfer_state_t;
+
+typedef struct {
+    Atom atom;
+    char *mime_type;
+} capture_target_t;
+
+// a selection is read in steps: TARGETS, the text and then every
+// configured target the owner offers, one conversion at a time
+typedef struct {
+    const char *name;
+    Atom selection;
+    Atom property;
+    Atom target;
+    transfer_state_t state;
+    overflow_writer_t writer;
+    long long deadline;
+    Time timestamp;
+    int has_target_list;
+    int current_target;        // index in pending_targets, -1 while reading the text
+    int pending_targets[MAX_CAPTURE_TARGETS];
+    int pending_target_count;
+    char *storage_content;
+    char *overflow_hash;
+    history_target_t targets[MAX_CAPTURE_TARGETS];
+    int target_count;
+    int image_width;           // set once an image/png target has a thumbnail
+    int image_height;
+    uint64_t content_hash;     // of the target being read, updated as it streams in
+    size_t content_length;
+    uint64_t trimmed_hash;     // the same without trailing line breaks, as the history keeps text
+    size_t trimmed_length;
+    uint64_t captured_hash;    // of the text (or the image of image entries)
+    size_t captured_length;
+    uint64_t last_hash;        // of the last content saved to the history
+    size_t last_length;
+    int has_last;
+    int change_pending;
+    Time change_timestamp;
+    Window change_owner;
+    char change_application[OWNER_NAME_LENGTH];
+    Window owner;              // of the selection being read
+    char application[OWNER_NAME_LENGTH];
+    Window last_owner;
+    long long last_saved;
+    char *last_storage_content; // PRIMARY only, to detect a growing selection
+    int sensitive;             // the owner offers x-kde-passwordManagerHint
+    char *sensitive_text;
+    char *retained_text;       // CLIPBOARD text, NULL once it exceeds PERSIST_MAX_LENGTH
+    size_t retained_capacity;
+    int retained_incomplete;
+    long long change_first_seen;
+    long long change_deadline;
+    long long tokens;
+    long long tokens_updated;
+    unsigned long change_events;
+    unsigned long coalesced_events;
+    unsigned long rate_limited_events;
+    unsigned long excluded_events;
+    unsigned long sensitive_events;
+    unsigned long fetches;
+} selection_transfer_t;
+
+// content we own the CLIPBOARD with
+typedef struct {
+    history_entry_t *entry;
+    char *text;
+    size_t text_length;
+    long long expires;         // sensitive entries are only served until then
+    Atom target_atoms[MAX_CAPTURE_TARGETS];    // of entry->targets, interned once it is served
+    int target_atom_count;
+    char *blobs[MAX_CAPTURE_TARGETS];          // of a persisted capture, other content reads them per request
+    size_t blob_lengths[MAX_CAPTURE_TARGETS];
+} served_content_t;
+
+// a reply too large for a single property, sent with the INCR protocol
+typedef struct {
+    Window requestor;
+    Atom property;
+    Atom type;
+    char *data;
+    size_t length;
+    size_t offset;
+    long long deadline;
+} outgoing_transfer_t;
 
 static pthread_t clipboard_thread;
-static int clipboard_thread_running = 0;
+static volatile int clipboard_thread_running = 0;
+static reactor_t *clipboard_reactor = NULL;
+static int xfixes_available = 0;
+static int xfixes_event_base = 0;
+static Atom primary_atom = None;
+static long long poll_interval = POLL_MIN_INTERVAL_MS;
+static long long next_poll = LLONG_MAX;
 static Display *clipboard_display = NULL;
-static char *last_clipboard_content = NULL;
-static char *last_primary_content = NULL;
-static size_t clipboard_content_buffer_size = 0;
+static Window requestor_window = None;
+static Window owner_window = None;
+static Atom clipboard_atom = None;
+static Atom utf8_string_atom = None;
+static Atom incr_atom = None;
+static Atom targets_atom = None;
+static Atom timestamp_atom = None;
+static Atom multiple_atom = None;
+static Atom ownership_property_atom = None;
+// in order of preference: UTF8_STRING, text/plain;charset=utf-8, STRING, TEXT, text/plain
+static Atom text_target_atoms[TEXT_TARGET_COUNT];
+static capture_target_t capture_targets[MAX_CAPTURE_TARGETS];
+static int capture_target_count = 0;
+static Atom png_atom = None;
+static Atom password_hint_atom = None;
+static selection_transfer_t clipboard_transfer;
+static selection_transfer_t primary_transfer;
+static XErrorHandler previous_error_handler = NULL;
+
+static served_content_t *served_content = NULL;
+// what was captured from the current CLIPBOARD owner
+static served_content_t *last_capture = NULL;
+static Window last_capture_owner = None;
+static uint64_t last_capture_hash = 0;
+static size_t last_capture_length = 0;
+static unsigned long persisted_count = 0;
+static Time ownership_timestamp = CurrentTime;
+static outgoing_transfer_t outgoing_transfers[MAX_OUTGOING_TRANSFERS];
+static size_t outgoing_chunk_size = 0;
+
+// handover of a new entry from the main thread
+static pthread_mutex_t ownership_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ownership_condition = PTHREAD_COND_INITIALIZER;
+static served_content_t *requested_content = NULL;
+static int ownership_request_pending = 0;
+static int ownership_result = 0;
+static int wake_fd = -1;    // eventfd, ownership requests and stopping wake the thread
+static pthread_mutex_t startup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_condition = PTHREAD_COND_INITIALIZER;
+static int startup_state = 0;  // 1 once the thread runs, -1 if it failed
 
 static void* clipboard_monitor_thread(void* arg);
-static void handle_clipboard_change_threaded(Atom selection, Atom clipboard_atom_local, Atom primary_atom_local);
+static void report_startup(int started);
+static void dispatch_clipboard_events(int fd, void *data);
+static void read_wake_events(int fd, void *data);
+static long long prepare_clipboard_loop(void *data);
+static void handle_clipboard_change_threaded(Atom selection, Atom clipboard_atom_local, Atom primary_atom_local,
+                                             Window owner, Time timestamp);
+
+static int poll_clipboard_changes(Display *display, Atom clipboard_atom_local, Atom primary_atom_local);
+static long long monotonic_milliseconds(void);
+static int clipboard_error_handler(Display *display, XErrorEvent *error_event);
+static void intern_capture_targets(void);
+static selection_transfer_t* find_transfer(Atom selection, Atom property);
+static void request_selection(selection_transfer_t *transfer, Atom target, Time timestamp);
+static void start_transfer(selection_transfer_t *transfer, Time timestamp);
+static void abort_transfer(selection_transfer_t *transfer);
+static void end_transfer(selection_transfer_t *transfer);
+static void request_next_target(selection_transfer_t *transfer);
+static void finish_current_target(selection_transfer_t *transfer);
+static void commit_transfer(selection_transfer_t *transfer);
+static void commit_sensitive_transfer(selection_transfer_t *transfer);
+static int append_sensitive_text(selection_transfer_t *transfer, const char *data, size_t length);
+static void retain_text(selection_transfer_t *transfer, const char *data, size_t length);
+static size_t retained_text_length(const selection_transfer_t *transfer);
+static void keep_last_capture(const selection_transfer_t *transfer, const history_entry_t *entry);
+static void persist_clipboard(Time timestamp);
+static int extends_last_selection(const selection_transfer_t *transfer, long long now);
+static void hash_content(selection_transfer_t *transfer, const char *data, size_t length);
+static int is_content_unchanged(selection_transfer_t *transfer);
+static int read_target_list(selection_transfer_t *transfer);
+static int has_pending_image(const selection_transfer_t *transfer);
+static int read_transfer_property(selection_transfer_t *transfer, Atom *type_return, size_t *length_return);
+static void handle_selection_notify(XSelectionEvent *selection_event);
+static void handle_property_notify(XPropertyEvent *property_event);
+static void expire_transfers(long long now);
+static int take_token(selection_transfer_t *transfer, long long now);
+static void process_pending_changes(long long now);
+static void log_change_statistics(const selection_transfer_t *transfer, int priority);
+static void served_content_free(served_content_t *content);
+static void intern_target_atoms(served_content_t *content);
+static long long expire_served_content(long long now);
+static void handle_ownership_request(void);
+static void take_ownership(Time timestamp);
+static void finish_ownership_request(int result);
+static int is_text_target(Atom target);
+static int send_property(Window requestor, Atom property, Atom type, const char *data, size_t length);
+static int serve_target(Window requestor, Atom property, Atom target);
+static void handle_selection_request(XSelectionRequestEvent *request_event);
+static void handle_outgoing_property(XPropertyEvent *property_event);
+static void end_outgoing_transfer(outgoing_transfer_t *outgoing);
+
+static long long monotonic_milliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// requestors may go away while we answer them, which must not take
+// halen down with it. Errors on other displays keep the default behaviour.
+static int clipboard_error_handler(Display *display, XErrorEvent *error_event) {
+    if (display == clipboard_display) {
+        char error_text[128];
+        XGetErrorText(display, error_event->error_code, error_text, sizeof(error_text));
+        msg(LOG_DEBUG, "Clipboard thread: X error ignored: %s (request %d)",
+            error_text, error_event->request_code);
+        return 0;
+    }
+    
+    return previous_error_handler ? previous_error_handler(display, error_event) : 0;
+}
+
+static void intern_capture_targets(void) {
+    capture_target_count = 0;
+    if (!config.capture_targets) return;
+    
+    char *targets_copy = strdup(config.capture_targets);
+    if (!targets_copy) return;
+    
+    char *save_pointer = NULL;
+    for (char *mime_type = strtok_r(targets_copy, " \t,", &save_pointer);
+         mime_type && capture_target_count < MAX_CAPTURE_TARGETS;
+         mime_type = strtok_r(NULL, " \t,", &save_pointer)) {
+        capture_target_t *capture_target = &capture_targets[capture_target_count];
+        capture_target->mime_type = strdup(mime_type);
+        if (!capture_target->mime_type) break;
+        capture_target->atom = XInternAtom(clipboard_display, mime_type, False);
+        capture_target_count++;
+        msg(LOG_DEBUG, "Capturing target: %s", mime_type);
+    }
+    
+    free(targets_copy);
+}
+
+static selection_transfer_t* find_transfer(Atom selection, Atom property) {
+    if (selection == clipboard_transfer.selection || property == clipboard_transfer.property) {
+        return &clipboard_transfer;
+    }
+    if (selection == primary_transfer.selection || property == primary_transfer.property) {
+        return &primary_transfer;
+    }
+    return NULL;
+}
+
+static void request_selection(selection_transfer_t *transfer, Atom target, Time timestamp) {
+    transfer->target = target;
+    transfer->state = TRANSFER_WAITING;
+    transfer->deadline = monotonic_milliseconds() + TRANSFER_TIMEOUT_MS;
+    transfer->content_hash = TEXT_HASH64_SEED;
+    transfer->content_length = 0;
+    transfer->trimmed_hash = TEXT_HASH64_SEED;
+    transfer->trimmed_length = 0;
+    
+    XDeleteProperty(clipboard_display, requestor_window, transfer->property);
+    XConvertSelection(clipboard_display, transfer->selection, target, transfer->property,
+                      requestor_window, timestamp);
+    XFlush(clipboard_display);
+}
 
-static void poll_clipboard_changes(Display *display, Atom clipboard_atom_local, Atom primary_atom_local);
+static void start_transfer(selection_transfer_t *transfer, Time timestamp) {
+    if (transfer->state != TRANSFER_IDLE) {
+        msg(LOG_DEBUG, "%s changed during transfer, restarting", transfer->name);
+        end_transfer(transfer);
+    }
+    
+    transfer->timestamp = timestamp;
+    transfer->has_target_list = 0;
+    transfer->current_target = -1;
+    transfer->pending_target_count = 0;
+    transfer->sensitive = 0;
+    transfer->retained_incomplete = 0;
+    
+    request_selection(transfer, targets_atom, timestamp);
+}
 
-static int ensure_content_buffer_capacity(void) {
-    size_t required_capacity = (config.max_lines * config.max_line_length) + 1024;
+static void abort_transfer(selection_transfer_t *transfer) {
+    overflow_writer_discard(&transfer->writer);
+    transfer->state = TRANSFER_IDLE;
+    
+    free(transfer->storage_content);
+    transfer->storage_content = NULL;
+    free(transfer->overflow_hash);
+    transfer->overflow_hash = NULL;
+    
+    for (int i = 0; i < transfer->target_count; i++) {
+        free(transfer->targets[i].mime_type);
+        free(transfer->targets[i].hash);
+    }
+    transfer->target_count = 0;
+    transfer->image_width = 0;
+    transfer->image_height = 0;
     
-    if (clipboard_content_buffer_size < required_capacity) {
-        char *new_clipboard_buffer = realloc(last_clipboard_content, required_capacity);
-        char *new_primary_buffer = realloc(last_primary_content, required_capacity);
+    if (transfer->sensitive_text) {
+        explicit_bzero(transfer->sensitive_text, SENSITIVE_MAX_LENGTH + 1);
+        free(transfer->sensitive_text);
+        transfer->sensitive_text = NULL;
+    }
+    
+    free(transfer->retained_text);
+    transfer->retained_text = NULL;
+    transfer->retained_capacity = 0;
+}
+
+// keeps what was received if the text is already complete
+static void end_transfer(selection_transfer_t *transfer) {
+    if (transfer->storage_content || transfer->image_width > 0) {
+        overflow_writer_discard(&transfer->writer);
+        commit_transfer(transfer);
+    } else {
+        abort_transfer(transfer);
+    }
+}
+
+static void request_next_target(selection_transfer_t *transfer) {
+    size_t maximum_length = (size_t)config.max_target_size * 1024;
+    
+    while (++transfer->current_target < transfer->pending_target_count) {
+        const capture_target_t *capture_target =
+            &capture_targets[transfer->pending_targets[transfer->current_target]];
         
-        if (!new_clipboard_buffer || !new_primary_buffer) {
-            msg(LOG_ERR, "Failed to allocate clipboard content buffers");
-            return 0;
+        if (overflow_writer_init_blob(&transfer->writer, maximum_length)) {
+            msg(LOG_DEBUG, "Requesting %s from %s", capture_target->mime_type, transfer->name);
+            request_selection(transfer, capture_target->atom, transfer->timestamp);
+            return;
+        }
+    }
+    
+    commit_transfer(transfer);
+}
+
+static void finish_current_target(selection_transfer_t *transfer) {
+    transfer->state = TRANSFER_IDLE;
+    
+    if (transfer->current_target < 0) {
+        if (transfer->sensitive) {
+            commit_sensitive_transfer(transfer);
+            return;
         }
         
-        last_clipboard_content = new_clipboard_buffer;
-        last_primary_content = new_primary_buffer;
-        clipboard_content_buffer_size = required_capacity;
+        // decided before the overflow file is stored or a target is requested
+        if (is_content_unchanged(transfer)) {
+            abort_transfer(transfer);
+            return;
+        }
         
-        if (clipboard_content_buffer_size == required_capacity) {
-            last_clipboard_content[0] = '\0';
-            last_primary_content[0] = '\0';
+        transfer->storage_content = overflow_writer_finish(&transfer->writer, &transfer->overflow_hash);
+        if (!transfer->storage_content) {
+            msg(LOG_DEBUG, "Failed to get clipboard content for %s", transfer->name);
+            abort_transfer(transfer);
+            return;
+        }
+    } else {
+        const capture_target_t *capture_target =
+            &capture_targets[transfer->pending_targets[transfer->current_target]];
+        
+        if (capture_target->atom == png_atom && !transfer->storage_content &&
+            transfer->image_width == 0 && is_content_unchanged(transfer)) {
+            abort_transfer(transfer);
+            return;
+        }
+        
+        char *blob_hash = overflow_writer_finish_blob(&transfer->writer);
+        if (blob_hash) {
+            history_target_t *target = &transfer->targets[transfer->target_count];
+            target->mime_type = strdup(capture_target->mime_type);
+            target->hash = blob_hash;
+            if (target->mime_type) {
+                transfer->target_count++;
+                msg(LOG_DEBUG, "Stored %s of %s as %s", capture_target->mime_type,
+                    transfer->name, blob_hash);
+                
+                // image entries (no text) get a thumbnail. Decoding happens once,
+                // here, the popup only loads the thumbnail
+                if (capture_target->atom == png_atom && !transfer->storage_content &&
+                    transfer->image_width == 0) {
+                    thumbnail_create(blob_hash, &transfer->image_width, &transfer->image_height);
+                }
+            } else {
+                free(blob_hash);
+            }
         }
     }
     
-    return 1;
+    request_next_target(transfer);
 }
 
-static int set_clipboard_content(const char* content) {
-    if (!content || strlen(content) == 0) {
-        msg(LOG_WARNING, "Cannot set clipboard - content is empty");
-        return 0;
+static void commit_transfer(selection_transfer_t *transfer) {
+    transfer->state = TRANSFER_IDLE;
+    
+    // entries without text are only kept if they are an image
+    if (!transfer->storage_content) {
+        if (transfer->image_width <= 0) {
+            msg(LOG_DEBUG, "%s has neither text nor an image, ignoring it", transfer->name);
+            abort_transfer(transfer);
+            return;
+        }
+        if (asprintf(&transfer->storage_content, "image/png %dx%d",
+                     transfer->image_width, transfer->image_height) == -1) {
+            transfer->storage_content = NULL;
+            abort_transfer(transfer);
+            return;
+        }
+    }
+    
+    msg(LOG_DEBUG, "Content changed, saving to history");
+    history_entry_t entry = {
+        .content = transfer->storage_content,
+        .source = (char *)transfer->name,
+        .hash = transfer->overflow_hash,
+        .targets = transfer->targets,
+        .target_count = transfer->target_count,
+        .image_width = transfer->image_width,
+        .image_height = transfer->image_height,
+        .application = transfer->application[0] ? transfer->application : NULL
+    };
+    // the history reload warms the content cache, the content it would
+    // read back from the overflow directory is still in memory here
+    if (transfer->overflow_hash && transfer->retained_text && !transfer->retained_incomplete) {
+        content_cache_put(transfer->overflow_hash, transfer->retained_text, retained_text_length(transfer));
+    }
+    
+    long long now = monotonic_milliseconds();
+    int saved;
+    if (extends_last_selection(transfer, now)) {
+        msg(LOG_DEBUG, "%s selection grew, replacing the previous capture", transfer->name);
+        saved = history_replace_newest_entry(&entry);
+    } else {
+        saved = history_add_truncated_entry(&entry);
+    }
+    
+    if (saved && transfer == &clipboard_transfer) {
+        keep_last_capture(transfer, &entry);
+    }
+    
+    if (saved) {
+        transfer->last_hash = transfer->captured_hash;
+        transfer->last_length = transfer->captured_length;
+        transfer->has_last = 1;
+        transfer->last_owner = transfer->owner;
+        transfer->last_saved = now;
+        
+        if (transfer->selection == XA_PRIMARY) {
+            free(transfer->last_storage_content);
+            transfer->last_storage_content = !transfer->overflow_hash && transfer->image_width <= 0 ?
+                                             strdup(transfer->storage_content) : NULL;
+        }
+    }
+    
+    abort_transfer(transfer);
+}
+
+// selecting by dragging sets PRIMARY for every step of the drag, each
+// capture then starts or ends with the previous one
+static int extends_last_selection(const selection_transfer_t *transfer, long long now) {
+    if (!transfer->last_storage_content || transfer->overflow_hash || transfer->image_width > 0) return 0;
+    if (transfer->owner != transfer->last_owner || now - transfer->last_saved > PRIMARY_COALESCE_MS) return 0;
+    
+    const char *previous = transfer->last_storage_content;
+    const char *current = transfer->storage_content;
+    size_t previous_length = strlen(previous);
+    size_t current_length = strlen(current);
+    
+    const char *longer = current_length >= previous_length ? current : previous;
+    const char *shorter = current_length >= previous_length ? previous : current;
+    size_t longer_length = current_length >= previous_length ? current_length : previous_length;
+    size_t shorter_length = current_length >= previous_length ? previous_length : current_length;
+    
+    return strncmp(longer, shorter, shorter_length) == 0 ||
+           strcmp(longer + longer_length - shorter_length, shorter) == 0;
+}
+
+static void retain_text(selection_transfer_t *transfer, const char *data, size_t length) {
+    if (transfer->retained_incomplete) return;
+    
+    size_t required_capacity = transfer->content_length + length + 1;
+    if (required_capacity > PERSIST_MAX_LENGTH) {
+        free(transfer->retained_text);
+        transfer->retained_text = NULL;
+        transfer->retained_capacity = 0;
+        transfer->retained_incomplete = 1;
+        return;
+    }
+    
+    if (required_capacity > transfer->retained_capacity) {
+        size_t new_capacity = transfer->retained_capacity ? transfer->retained_capacity : 4096;
+        while (new_capacity < required_capacity) new_capacity *= 2;
+        
+        char *new_text = realloc(transfer->retained_text, new_capacity);
+        if (!new_text) {
+            free(transfer->retained_text);
+            transfer->retained_text = NULL;
+            transfer->retained_capacity = 0;
+            transfer->retained_incomplete = 1;
+            return;
+        }
+        transfer->retained_text = new_text;
+        transfer->retained_capacity = new_capacity;
+    }
+    
+    memcpy(transfer->retained_text + transfer->content_length, data, length);
+}
+
+// the overflow file doesn't have the trailing line breaks either
+static size_t retained_text_length(const selection_transfer_t *transfer) {
+    size_t length = transfer->captured_length;
+    while (length > 0 && (transfer->retained_text[length - 1] == '\n' ||
+                          transfer->retained_text[length - 1] == '\r')) {
+        length--;
+    }
+    return length;
+}
+
+// content that isn't truncated is the storage content itself, longer
+// text is taken from what was retained while it streamed in
+static void keep_last_capture(const selection_transfer_t *transfer, const history_entry_t *entry) {
+    served_content_t *capture = calloc(1, sizeof(served_content_t));
+    if (!capture) return;
+    
+    capture->entry = history_duplicate_entry(entry);
+    if (!transfer->overflow_hash) {
+        capture->text = strdup(transfer->storage_content);
+        capture->text_length = capture->text ? strlen(capture->text) : 0;
+    } else if (transfer->retained_text && !transfer->retained_incomplete) {
+        size_t length = retained_text_length(transfer);
+        capture->text = strndup(transfer->retained_text, length);
+        capture->text_length = length;
+    }
+    
+    if (!capture->entry) {
+        served_content_free(capture);
+        return;
+    }
+    
+    served_content_free(last_capture);
+    last_capture = capture;
+    last_capture_owner = transfer->owner;
+    last_capture_hash = transfer->captured_hash;
+    last_capture_length = transfer->captured_length;
+}
+
+// the CLIPBOARD owner went away without handing its content over, its
+// last capture is served from memory instead
+static void persist_clipboard(Time timestamp) {
+    if (!last_capture || served_content) return;
+    
+    if (clipboard_transfer.change_owner != last_capture_owner || clipboard_transfer.change_pending ||
+        clipboard_transfer.state != TRANSFER_IDLE) {
+        msg(LOG_DEBUG, "No capture of the CLIPBOARD owner that went away");
+        return;
+    }
+    
+    if (!last_capture->text) {
+        // too large to keep in memory
+        last_capture->text = overflow_read_file(last_capture->entry->hash, &last_capture->text_length);
+        if (!last_capture->text) return;
     }
     
-    char command[] = "xclip -selection clipboard -i 2>/dev/null";
+    // read once, the blobs are no larger than max_target_size
+    const history_entry_t *entry = last_capture->entry;
+    for (int i = 0; i < entry->target_count && i < MAX_CAPTURE_TARGETS; i++) {
+        if (!last_capture->blobs[i]) {
+            last_capture->blobs[i] = overflow_read_file(entry->targets[i].hash, &last_capture->blob_lengths[i]);
+        }
+    }
     
-    FILE *fp = popen(command, "w");
-    if (!fp) {
-        msg(LOG_ERR, "Failed to open xclip for writing");
+    XSetSelectionOwner(clipboard_display, clipboard_atom, owner_window, timestamp);
+    if (XGetSelectionOwner(clipboard_display, clipboard_atom) != owner_window) {
+        msg(LOG_WARNING, "Failed to take over the CLIPBOARD");
+        return;
+    }
+    
+    served_content = last_capture;
+    last_capture = NULL;
+    intern_target_atoms(served_content);
+    ownership_timestamp = timestamp;
+    persisted_count++;
+    msg(LOG_NOTICE, "CLIPBOARD owner went away, serving its content: %.50s%s",
+        served_content->text, served_content->text_length > 50 ? "..." : "");
+}
+
+// a secret is kept in memory until it expires, the popup only shows
+// where it came from
+static void commit_sensitive_transfer(selection_transfer_t *transfer) {
+    transfer->state = TRANSFER_IDLE;
+    
+    size_t length = transfer->content_length < SENSITIVE_MAX_LENGTH ?
+                    transfer->content_length : SENSITIVE_MAX_LENGTH;
+    if (!transfer->sensitive_text || length == 0) {
+        abort_transfer(transfer);
+        return;
+    }
+    
+    transfer->sensitive_text[length] = '\0';
+    while (length > 0 && (transfer->sensitive_text[length - 1] == '\n' ||
+                          transfer->sensitive_text[length - 1] == '\r')) {
+        transfer->sensitive_text[--length] = '\0';
+    }
+    
+    char description[32 + OWNER_NAME_LENGTH];
+    snprintf(description, sizeof(description), "sensitive entry%s%s",
+             transfer->application[0] ? " from " : "", transfer->application);
+    
+    history_entry_t entry = {
+        .content = description,
+        .source = (char *)transfer->name,
+        .application = transfer->application[0] ? transfer->application : NULL,
+        .sensitive = 1
+    };
+    history_add_sensitive_entry(&entry, transfer->sensitive_text,
+                                monotonic_milliseconds() + (long long)config.sensitive_timeout * 1000);
+    
+    // copying the same secret again after it expired has to be captured
+    transfer->has_last = 0;
+    abort_transfer(transfer);
+}
+
+static int append_sensitive_text(selection_transfer_t *transfer, const char *data, size_t length) {
+    if (transfer->content_length + length > SENSITIVE_MAX_LENGTH) {
+        msg(LOG_NOTICE, "Sensitive %s content is too large, ignoring it", transfer->name);
         return 0;
     }
     
-    size_t content_length = strlen(content);
-    size_t bytes_written = fwrite(content, 1, content_length, fp);
+    // allocated once, reallocating would leave copies of the secret behind
+    if (!transfer->sensitive_text) {
+        transfer->sensitive_text = calloc(1, SENSITIVE_MAX_LENGTH + 1);
+        if (!transfer->sensitive_text) return 0;
+    }
+    
+    memcpy(transfer->sensitive_text + transfer->content_length, data, length);
+    return 1;
+}
+
+// the trimmed hash covers everything up to the last byte that isn't a
+// line break, so it matches the hash of the text served from the history
+static void hash_content(selection_transfer_t *transfer, const char *data, size_t length) {
+    size_t text_end = length;
+    while (text_end > 0 && (data[text_end - 1] == '\n' || data[text_end - 1] == '\r')) {
+        text_end--;
+    }
+    
+    if (text_end > 0) {
+        transfer->trimmed_hash = text_hash64_update(transfer->content_hash, data, text_end);
+        transfer->trimmed_length = transfer->content_length + text_end;
+        transfer->content_hash = text_hash64_update(transfer->trimmed_hash, data + text_end, length - text_end);
+    } else {
+        transfer->content_hash = text_hash64_update(transfer->content_hash, data, length);
+    }
+    transfer->content_length += length;
+}
+
+// compares the target that was just read with the last saved content,
+// only a hash and the length of it are kept
+static int is_content_unchanged(selection_transfer_t *transfer) {
+    transfer->captured_hash = transfer->trimmed_hash;
+    transfer->captured_length = transfer->trimmed_length;
     
-    if (bytes_written != content_length) {
-        msg(LOG_WARNING, "Failed to write all content to xclip: %zu/%zu bytes", 
-            bytes_written, content_length);
-        pclose(fp);
+    if (transfer->has_last && transfer->last_length == transfer->captured_length &&
+        transfer->last_hash == transfer->captured_hash) {
+        msg(LOG_DEBUG, "%s content unchanged (%zu bytes), skipping save", transfer->name,
+            transfer->captured_length);
+        if (transfer == &clipboard_transfer && last_capture &&
+            last_capture_length == transfer->captured_length && last_capture_hash == transfer->captured_hash) {
+            last_capture_owner = transfer->owner;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// picks the text target and queues the configured targets the owner offers
+static int read_target_list(selection_transfer_t *transfer) {
+    Atom type = None;
+    int format = 0;
+    unsigned long item_count = 0, bytes_after = 0;
+    unsigned char *data = NULL;
+    
+    int result = XGetWindowProperty(clipboard_display, requestor_window, transfer->property,
+                                    0, 1024, True, XA_ATOM, &type, &format,
+                                    &item_count, &bytes_after, &data);
+    if (result != Success || type != XA_ATOM || format != 32) {
+        if (data) XFree(data);
         return 0;
     }
     
-    int exit_code = pclose(fp);
-    if (exit_code != 0) {
-        msg(LOG_ERR, "xclip failed with exit code: %d", exit_code);
+    Atom *offered_targets = (Atom *)data;
+    Atom text_target = None;
+    int text_priority = TEXT_TARGET_COUNT;
+    
+    for (unsigned long i = 0; i < item_count; i++) {
+        if (offered_targets[i] == password_hint_atom) {
+            transfer->sensitive = 1;
+        }
+        
+        for (int priority = 0; priority < text_priority; priority++) {
+            if (offered_targets[i] == text_target_atoms[priority]) {
+                text_target = offered_targets[i];
+                text_priority = priority;
+                break;
+            }
+        }
+        
+        for (int j = 0; j < capture_target_count; j++) {
+            if (offered_targets[i] == capture_targets[j].atom &&
+                transfer->pending_target_count < MAX_CAPTURE_TARGETS) {
+                transfer->pending_targets[transfer->pending_target_count++] = j;
+            }
+        }
+    }
+    
+    XFree(data);
+    transfer->has_target_list = 1;
+    transfer->target = text_target;
+    
+    // nothing but the text of a secret is read
+    if (transfer->sensitive) {
+        transfer->pending_target_count = 0;
+    }
+    return 1;
+}
+
+static int has_pending_image(const selection_transfer_t *transfer) {
+    for (int i = 0; i < transfer->pending_target_count; i++) {
+        if (capture_targets[transfer->pending_targets[i]].atom == png_atom) return 1;
+    }
+    return 0;
+}
+
+// reads the property in chunks straight into the overflow writer, so large
+// selections are never held in memory as a whole. Deleting the property
+// afterwards also asks an INCR owner for the next chunk.
+static int read_transfer_property(selection_transfer_t *transfer, Atom *type_return, size_t *length_return) {
+    long offset = 0;
+    unsigned long bytes_after = 0;
+    size_t total_length = 0;
+    Atom type = None;
+    
+    do {
+        int format = 0;
+        unsigned long item_count = 0;
+        unsigned char *data = NULL;
+        
+        if (XGetWindowProperty(clipboard_display, requestor_window, transfer->property,
+                               offset, PROPERTY_CHUNK_LONGS, False, AnyPropertyType,
+                               &type, &format, &item_count, &bytes_after, &data) != Success) {
+            msg(LOG_WARNING, "Failed to read %s selection property", transfer->name);
+            return 0;
+        }
+        
+        if (type == incr_atom) {
+            if (data) XFree(data);
+            break;
+        }
+        
+        if (item_count > 0 && format != 8) {
+            msg(LOG_WARNING, "Unexpected %d-bit data for %s selection", format, transfer->name);
+            XFree(data);
+            XDeleteProperty(clipboard_display, requestor_window, transfer->property);
+            return 0;
+        }
+        
+        if (item_count > 0 && transfer->sensitive) {
+            if (!append_sensitive_text(transfer, (const char *)data, item_count)) {
+                XFree(data);
+                XDeleteProperty(clipboard_display, requestor_window, transfer->property);
+                return 0;
+            }
+            transfer->content_length += item_count;
+        } else if (item_count > 0) {
+            overflow_writer_append(&transfer->writer, (const char *)data, item_count);
+            if (transfer == &clipboard_transfer && transfer->current_target < 0) {
+                retain_text(transfer, (const char *)data, item_count);
+            }
+            hash_content(transfer, (const char *)data, item_count);
+        }
+        
+        total_length += item_count;
+        offset += item_count / 4;
+        
+        if (data) XFree(data);
+        
+        // an oversized target is dropped, no need to read the rest of it
+        if (transfer->writer.exceeded_maximum && transfer->writer.is_blob) break;
+    } while (bytes_after > 0);
+    
+    XDeleteProperty(clipboard_display, requestor_window, transfer->property);
+    XFlush(clipboard_display);
+    
+    *type_return = type;
+    *length_return = total_length;
+    return 1;
+}
+
+static void handle_selection_notify(XSelectionEvent *selection_event) {
+    if (selection_event->requestor != requestor_window) return;
+    
+    selection_transfer_t *transfer = find_transfer(selection_event->selection, None);
+    if (!transfer || transfer->state != TRANSFER_WAITING) return;
+    
+    if (transfer->target == targets_atom) {
+        transfer->state = TRANSFER_IDLE;
+        
+        if (selection_event->property == None || !read_target_list(transfer)) {
+            // owners that don't answer TARGETS usually still have the text
+            msg(LOG_DEBUG, "%s owner has no TARGETS, requesting UTF8_STRING", transfer->name);
+            transfer->target = utf8_string_atom;
+        } else if (transfer->target == None) {
+            if (has_pending_image(transfer)) {
+                msg(LOG_DEBUG, "%s owner offers an image without text", transfer->name);
+                request_next_target(transfer);
+                return;
+            }
+            msg(LOG_DEBUG, "%s owner offers no text target, ignoring it", transfer->name);
+            return;
+        }
+        
+        if (transfer->sensitive) {
+            transfer->sensitive_events++;
+            if (config.sensitive_timeout == 0) {
+                msg(LOG_NOTICE, "%s content is marked as sensitive, not capturing it", transfer->name);
+                abort_transfer(transfer);
+                return;
+            }
+            msg(LOG_DEBUG, "%s content is marked as sensitive, keeping it in memory", transfer->name);
+            request_selection(transfer, transfer->target, transfer->timestamp);
+            return;
+        }
+        
+        if (overflow_writer_init(&transfer->writer)) {
+            request_selection(transfer, transfer->target, transfer->timestamp);
+        }
+        return;
+    }
+    
+    if (selection_event->property == None) {
+        if (transfer->current_target >= 0) {
+            msg(LOG_DEBUG, "%s owner refused a target, skipping it", transfer->name);
+            overflow_writer_discard(&transfer->writer);
+            transfer->state = TRANSFER_IDLE;
+            request_next_target(transfer);
+            return;
+        }
+        if (transfer->target == utf8_string_atom && !transfer->has_target_list) {
+            msg(LOG_DEBUG, "%s owner refused UTF8_STRING, trying STRING", transfer->name);
+            request_selection(transfer, XA_STRING, selection_event->time);
+            return;
+        }
+        msg(LOG_DEBUG, "%s owner refused the conversion", transfer->name);
+        abort_transfer(transfer);
+        return;
+    }
+    
+    Atom type;
+    size_t length;
+    if (!read_transfer_property(transfer, &type, &length)) {
+        end_transfer(transfer);
+        return;
+    }
+    
+    if (type == incr_atom) {
+        msg(LOG_DEBUG, "Receiving %s through INCR", transfer->name);
+        transfer->state = TRANSFER_INCR;
+        transfer->deadline = monotonic_milliseconds() + TRANSFER_TIMEOUT_MS;
+        return;
+    }
+    
+    finish_current_target(transfer);
+}
+
+static void handle_property_notify(XPropertyEvent *property_event) {
+    if (property_event->window != requestor_window) {
+        handle_outgoing_property(property_event);
+        return;
+    }
+    
+    if (property_event->state != PropertyNewValue) return;
+    
+    selection_transfer_t *transfer = find_transfer(None, property_event->atom);
+    if (!transfer || transfer->state != TRANSFER_INCR) return;
+    
+    Atom type;
+    size_t length;
+    if (!read_transfer_property(transfer, &type, &length)) {
+        end_transfer(transfer);
+        return;
+    }
+    
+    // a zero length chunk ends the INCR transfer
+    if (length == 0) {
+        msg(LOG_DEBUG, "INCR transfer of %s complete: %zu bytes", transfer->name, transfer->writer.length);
+        finish_current_target(transfer);
+    } else {
+        transfer->deadline = monotonic_milliseconds() + TRANSFER_TIMEOUT_MS;
+    }
+}
+
+static void expire_transfers(long long now) {
+    selection_transfer_t *transfers[] = { &clipboard_transfer, &primary_transfer };
+    
+    for (int i = 0; i < 2; i++) {
+        if (transfers[i]->state != TRANSFER_IDLE && now >= transfers[i]->deadline) {
+            msg(LOG_WARNING, "Timed out reading %s selection", transfers[i]->name);
+            end_transfer(transfers[i]);
+        }
+    }
+    
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        if (outgoing_transfers[i].data && now >= outgoing_transfers[i].deadline) {
+            msg(LOG_WARNING, "Requestor stopped reading the clipboard, aborting INCR transfer");
+            end_outgoing_transfer(&outgoing_transfers[i]);
+        }
+    }
+}
+
+// gives up the CLIPBOARD once a sensitive entry we serve expires,
+// returns when that happens
+static long long expire_served_content(long long now) {
+    if (!served_content || served_content->expires == 0) return LLONG_MAX;
+    if (now < served_content->expires) return served_content->expires;
+    
+    msg(LOG_NOTICE, "Sensitive clipboard content expired, clearing the CLIPBOARD");
+    XSetSelectionOwner(clipboard_display, clipboard_atom, None, ownership_timestamp);
+    XFlush(clipboard_display);
+    served_content_free(served_content);
+    served_content = NULL;
+    return LLONG_MAX;
+}
+
+static void served_content_free(served_content_t *content) {
+    if (!content) return;
+    
+    if (content->entry && content->entry->sensitive && content->text) {
+        explicit_bzero(content->text, content->text_length);
+    }
+    history_free_entry(content->entry);
+    free(content->entry);
+    free(content->text);
+    for (int i = 0; i < MAX_CAPTURE_TARGETS; i++) {
+        free(content->blobs[i]);
+    }
+    free(content);
+}
+
+// requestors ask for the stored targets on every TARGETS and conversion,
+// the atoms are looked up only once
+static void intern_target_atoms(served_content_t *content) {
+    const history_entry_t *entry = content->entry;
+    
+    content->target_atom_count = 0;
+    for (int i = 0; i < entry->target_count && i < MAX_CAPTURE_TARGETS; i++) {
+        content->target_atoms[content->target_atom_count++] =
+            XInternAtom(clipboard_display, entry->targets[i].mime_type, False);
+    }
+}
+
+// ICCCM wants a real timestamp for the ownership, a zero length
+// append to one of our properties gets us one from the server
+static void handle_ownership_request(void) {
+    pthread_mutex_lock(&ownership_mutex);
+    int pending = ownership_request_pending;
+    pthread_mutex_unlock(&ownership_mutex);
+    
+    if (pending) {
+        XChangeProperty(clipboard_display, owner_window, ownership_property_atom, XA_STRING, 8,
+                        PropModeAppend, NULL, 0);
+        XFlush(clipboard_display);
+    }
+}
+
+static void take_ownership(Time timestamp) {
+    pthread_mutex_lock(&ownership_mutex);
+    served_content_t *content = requested_content;
+    requested_content = NULL;
+    pthread_mutex_unlock(&ownership_mutex);
+    
+    if (!content) return;
+    
+    XSetSelectionOwner(clipboard_display, clipboard_atom, owner_window, timestamp);
+    if (XGetSelectionOwner(clipboard_display, clipboard_atom) != owner_window) {
+        msg(LOG_WARNING, "Failed to take ownership of CLIPBOARD");
+        served_content_free(content);
+        finish_ownership_request(0);
+        return;
+    }
+    
+    served_content_free(served_content);
+    served_content = content;
+    ownership_timestamp = timestamp;
+    intern_target_atoms(content);
+    
+    // selecting an entry makes it the newest one, like a regular copy would,
+    // sensitive entries never go to the history file
+    const history_entry_t *entry = content->entry;
+    if (entry->sensitive) {
+        content->expires = monotonic_milliseconds() + (long long)config.sensitive_timeout * 1000;
+        clipboard_transfer.has_last = 0;
+        msg(LOG_DEBUG, "Owning CLIPBOARD: %s", entry->content);
+        finish_ownership_request(1);
+        return;
+    }
+    
+    history_entry_t promoted_entry = *entry;
+    promoted_entry.source = "CLIPBOARD";
+    history_add_truncated_entry(&promoted_entry);
+    
+    // so the same text copied again from elsewhere is recognised, the text
+    // has no trailing line breaks like the trimmed hash of a capture
+    clipboard_transfer.has_last = entry->image_width <= 0;
+    clipboard_transfer.last_hash = text_hash64_update(TEXT_HASH64_SEED, content->text, content->text_length);
+    clipboard_transfer.last_length = content->text_length;
+    
+    msg(LOG_DEBUG, "Owning CLIPBOARD: %.50s%s", content->text, content->text_length > 50 ? "..." : "");
+    finish_ownership_request(1);
+}
+
+static void finish_ownership_request(int result) {
+    pthread_mutex_lock(&ownership_mutex);
+    ownership_request_pending = 0;
+    ownership_result = result;
+    pthread_cond_broadcast(&ownership_condition);
+    pthread_mutex_unlock(&ownership_mutex);
+}
+
+static int is_text_target(Atom target) {
+    for (int i = 0; i < TEXT_TARGET_COUNT; i++) {
+        if (target == text_target_atoms[i]) return 1;
+    }
+    return 0;
+}
+
+static int send_property(Window requestor, Atom property, Atom type, const char *data, size_t length) {
+    if (length <= outgoing_chunk_size) {
+        XChangeProperty(clipboard_display, requestor, property, type, 8, PropModeReplace,
+                        (const unsigned char *)data, (int)length);
+        return 1;
+    }
+    
+    outgoing_transfer_t *outgoing = NULL;
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        if (!outgoing_transfers[i].data) {
+            outgoing = &outgoing_transfers[i];
+            break;
+        }
+    }
+    if (!outgoing) {
+        msg(LOG_WARNING, "Too many INCR transfers in progress, refusing request");
         return 0;
     }
     
-    msg(LOG_DEBUG, "Successfully set clipboard content: %.50s%s", 
-        content, strlen(content) > 50 ? "..." : "");
+    outgoing->data = malloc(length);
+    if (!outgoing->data) return 0;
+    memcpy(outgoing->data, data, length);
+    outgoing->requestor = requestor;
+    outgoing->property = property;
+    outgoing->type = type;
+    outgoing->length = length;
+    outgoing->offset = 0;
+    outgoing->deadline = monotonic_milliseconds() + TRANSFER_TIMEOUT_MS;
     
+    long incr_size = (long)length;
+    XSelectInput(clipboard_display, requestor, PropertyChangeMask);
+    XChangeProperty(clipboard_display, requestor, property, incr_atom, 32, PropModeReplace,
+                    (const unsigned char *)&incr_size, 1);
+    
+    msg(LOG_DEBUG, "Sending %zu bytes to %lu through INCR", length, requestor);
     return 1;
 }
 
-static void handle_clipboard_change_threaded(Atom selection, Atom clipboard_atom_local, Atom primary_atom_local) {
-    (void)primary_atom_local; 
+static int serve_target(Window requestor, Atom property, Atom target) {
+    const history_entry_t *entry = served_content->entry;
+    
+    if (target == targets_atom) {
+        Atom offered_targets[2 + TEXT_TARGET_COUNT + MAX_CAPTURE_TARGETS];
+        int offered_count = 0;
+        
+        offered_targets[offered_count++] = targets_atom;
+        offered_targets[offered_count++] = timestamp_atom;
+        // image entries have no text, only a description of the image
+        for (int i = 0; i < TEXT_TARGET_COUNT && entry->image_width <= 0; i++) {
+            offered_targets[offered_count++] = text_target_atoms[i];
+        }
+        for (int i = 0; i < served_content->target_atom_count; i++) {
+            offered_targets[offered_count++] = served_content->target_atoms[i];
+        }
+        
+        XChangeProperty(clipboard_display, requestor, property, XA_ATOM, 32, PropModeReplace,
+                        (const unsigned char *)offered_targets, offered_count);
+        return 1;
+    }
+    
+    if (target == timestamp_atom) {
+        long timestamp = (long)ownership_timestamp;
+        XChangeProperty(clipboard_display, requestor, property, XA_INTEGER, 32, PropModeReplace,
+                        (const unsigned char *)&timestamp, 1);
+        return 1;
+    }
+    
+    if (is_text_target(target) && entry->image_width <= 0) {
+        Atom type = (target == text_target_atoms[3]) ? utf8_string_atom : target;
+        return send_property(requestor, property, type, served_content->text, served_content->text_length);
+    }
+    
+    for (int i = 0; i < served_content->target_atom_count; i++) {
+        if (served_content->target_atoms[i] != target) continue;
+        
+        if (served_content->blobs[i]) {
+            return send_property(requestor, property, target, served_content->blobs[i],
+                                 served_content->blob_lengths[i]);
+        }
+        
+        size_t blob_length = 0;
+        char *blob = overflow_read_file(entry->targets[i].hash, &blob_length);
+        if (!blob) return 0;
+        
+        int result = send_property(requestor, property, target, blob, blob_length);
+        free(blob);
+        return result;
+    }
+    
+    return 0;
+}
+
+static void handle_selection_request(XSelectionRequestEvent *request_event) {
+    XSelectionEvent reply = {
+        .type = SelectionNotify,
+        .display = request_event->display,
+        .requestor = request_event->requestor,
+        .selection = request_event->selection,
+        .target = request_event->target,
+        .property = None,
+        .time = request_event->time
+    };
+    
+    // obsolete clients leave the property empty
+    Atom property = request_event->property != None ? request_event->property : request_event->target;
+    
+    int is_current = request_event->time == CurrentTime || ownership_timestamp == CurrentTime ||
+                     request_event->time >= ownership_timestamp;
+    
+    if (served_content && request_event->owner == owner_window &&
+        request_event->selection == clipboard_atom && is_current &&
+        request_event->target != multiple_atom) {
+        if (serve_target(request_event->requestor, property, request_event->target)) {
+            reply.property = property;
+        }
+    }
+    
+    if (reply.property == None) {
+        char *target_name = XGetAtomName(clipboard_display, request_event->target);
+        msg(LOG_DEBUG, "Refusing clipboard request for %s", target_name ? target_name : "(unknown)");
+        if (target_name) XFree(target_name);
+    }
+    
+    XSendEvent(clipboard_display, request_event->requestor, False, NoEventMask, (XEvent *)&reply);
+    XFlush(clipboard_display);
+}
 
+// the requestor deletes the property when it has read a chunk
+static void handle_outgoing_property(XPropertyEvent *property_event) {
+    if (property_event->state != PropertyDelete) return;
+    
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        outgoing_transfer_t *outgoing = &outgoing_transfers[i];
+        if (!outgoing->data || outgoing->requestor != property_event->window ||
+            outgoing->property != property_event->atom) {
+            continue;
+        }
+        
+        size_t chunk_length = outgoing->length - outgoing->offset;
+        if (chunk_length > outgoing_chunk_size) {
+            chunk_length = outgoing_chunk_size;
+        }
+        
+        XChangeProperty(clipboard_display, outgoing->requestor, outgoing->property, outgoing->type, 8,
+                        PropModeReplace, (const unsigned char *)outgoing->data + outgoing->offset,
+                        (int)chunk_length);
+        outgoing->offset += chunk_length;
+        outgoing->deadline = monotonic_milliseconds() + TRANSFER_TIMEOUT_MS;
+        
+        // the zero length chunk that ends the transfer has been written
+        if (chunk_length == 0) {
+            msg(LOG_DEBUG, "INCR transfer to %lu complete", outgoing->requestor);
+            end_outgoing_transfer(outgoing);
+        }
+        
+        XFlush(clipboard_display);
+        return;
+    }
+}
+
+static void end_outgoing_transfer(outgoing_transfer_t *outgoing) {
+    int requestor_still_used = 0;
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        if (&outgoing_transfers[i] != outgoing && outgoing_transfers[i].data &&
+            outgoing_transfers[i].requestor == outgoing->requestor) {
+            requestor_still_used = 1;
+        }
+    }
+    if (!requestor_still_used) {
+        XSelectInput(clipboard_display, outgoing->requestor, NoEventMask);
+    }
+    
+    free(outgoing->data);
+    memset(outgoing, 0, sizeof(*outgoing));
+}
+
+static void handle_clipboard_change_threaded(Atom selection, Atom clipboard_atom_local, Atom primary_atom_local,
+                                             Window owner, Time timestamp) {
+    (void)primary_atom_local; 
+    
     const char *selection_name = (selection == clipboard_atom_local) ? "CLIPBOARD" : "PRIMARY";
-    const char *xclip_name = (selection == clipboard_atom_local) ? "clipboard" : "primary";
     
-    if (strcmp(selection_name, "CLIPBOARD") != 0) {
-        msg(LOG_ERR, "ignoreing selection: %s", selection_name);
+    if (strcmp(selection_name, "CLIPBOARD") != 0 && !config.primary_history) {
+        msg(LOG_DEBUG, "ignoring selection: %s", selection_name);
         return;
     }
     
     msg(LOG_DEBUG, "handle_clipboard_change_threaded called for %s", selection_name);
     
-    char *content = clipboard_get_content(xclip_name);
-    if (content) {
-        if (!ensure_content_buffer_capacity()) {
-            free(content);
-            return;
+    selection_transfer_t *transfer = (selection == clipboard_atom_local) ? &clipboard_transfer : &primary_transfer;
+    long long now = monotonic_milliseconds();
+    
+    // the rules are applied before anything is read from the owner
+    const owner_info_t *owner_info = owner_lookup(owner);
+    const char *application = owner_name(owner_info);
+    if (!owner_is_capture_allowed(owner_info)) {
+        msg(LOG_DEBUG, "%s owner %s is excluded from capture", selection_name,
+            application ? application : "(unknown)");
+        transfer->change_events++;
+        transfer->excluded_events++;
+        transfer->change_owner = owner;
+        // what a previous owner of the burst had set is gone as well
+        transfer->change_pending = 0;
+        if (transfer->state != TRANSFER_IDLE) {
+            abort_transfer(transfer);
         }
+        return;
+    }
+    
+    transfer->change_events++;
+    if (transfer->change_pending) {
+        transfer->coalesced_events++;
+    } else {
+        transfer->change_pending = 1;
+        transfer->change_first_seen = now;
+    }
+    
+    // only the last owner of a burst is read
+    transfer->change_timestamp = timestamp;
+    transfer->change_owner = owner;
+    snprintf(transfer->change_application, sizeof(transfer->change_application), "%s",
+             application ? application : "");
+    transfer->change_deadline = now + DEBOUNCE_MS;
+    if (transfer->change_deadline > transfer->change_first_seen + DEBOUNCE_MAX_DELAY_MS) {
+        transfer->change_deadline = transfer->change_first_seen + DEBOUNCE_MAX_DELAY_MS;
+    }
+}
+
+static int take_token(selection_transfer_t *transfer, long long now) {
+    transfer->tokens += (now - transfer->tokens_updated) * 1000 / RATE_LIMIT_REFILL_MS;
+    if (transfer->tokens > RATE_LIMIT_BURST * 1000) {
+        transfer->tokens = RATE_LIMIT_BURST * 1000;
+    }
+    transfer->tokens_updated = now;
+    
+    if (transfer->tokens < 1000) {
+        return 0;
+    }
+    
+    transfer->tokens -= 1000;
+    return 1;
+}
+
+static void process_pending_changes(long long now) {
+    selection_transfer_t *transfers[] = { &clipboard_transfer, &primary_transfer };
+    
+    for (int i = 0; i < 2; i++) {
+        selection_transfer_t *transfer = transfers[i];
+        if (!transfer->change_pending || now < transfer->change_deadline) continue;
         
-        char *last_content = (selection == clipboard_atom_local) ? 
-                           last_clipboard_content : last_primary_content;
-        
-        if (strcmp(content, last_content) != 0) {
-            msg(LOG_DEBUG, "Content changed, saving to history");
-            strncpy(last_content, content, clipboard_content_buffer_size - 1);
-            last_content[clipboard_content_buffer_size - 1] = '\0';
-            history_add_entry(content, selection_name);
-        } else {
-            msg(LOG_DEBUG, "Content unchanged, skipping save");
+        if (!take_token(transfer, now)) {
+            // try again when the next token is available
+            transfer->rate_limited_events++;
+            transfer->change_deadline = now + (1000 - transfer->tokens) * RATE_LIMIT_REFILL_MS / 1000 + 1;
+            msg(LOG_DEBUG, "%s changes too often, delaying the read", transfer->name);
+            continue;
         }
         
-        free(content);
-    } else {
-        msg(LOG_DEBUG, "Failed to get clipboard content for %s", selection_name);
+        transfer->change_pending = 0;
+        transfer->owner = transfer->change_owner;
+        memcpy(transfer->application, transfer->change_application, sizeof(transfer->application));
+        transfer->fetches++;
+        log_change_statistics(transfer, LOG_DEBUG);
+        start_transfer(transfer, transfer->change_timestamp);
     }
 }
 
-static void poll_clipboard_changes(Display *display, Atom clipboard_atom_local, Atom primary_atom_local) {
+static void log_change_statistics(const selection_transfer_t *transfer, int priority) {
+    msg(priority, "%s: %lu owner changes, %lu coalesced, %lu rate limited, %lu excluded, %lu sensitive, %lu reads",
+        transfer->name, transfer->change_events, transfer->coalesced_events,
+        transfer->rate_limited_events, transfer->excluded_events, transfer->sensitive_events,
+        transfer->fetches);
+}
+
+// returns 1 if an owner changed
+static int poll_clipboard_changes(Display *display, Atom clipboard_atom_local, Atom primary_atom_local) {
     static Window last_clipboard_owner = None;
     static Window last_primary_owner = None;
     
     Window clipboard_owner = XGetSelectionOwner(display, clipboard_atom_local);
     Window primary_owner = XGetSelectionOwner(display, primary_atom_local);
+    int changed = clipboard_owner != last_clipboard_owner || primary_owner != last_primary_owner;
     
     if (clipboard_owner != last_clipboard_owner) {
         msg(LOG_DEBUG, "CLIPBOARD owner changed: %lu -> %lu", last_clipboard_owner, clipboard_owner);
         last_clipboard_owner = clipboard_owner;
         
-        if (clipboard_owner != None) {
-            handle_clipboard_change_threaded(clipboard_atom_local, clipboard_atom_local, primary_atom_local);
+        if (clipboard_owner != None && clipboard_owner != owner_window) {
+            handle_clipboard_change_threaded(clipboard_atom_local, clipboard_atom_local, primary_atom_local,
+                                             clipboard_owner, CurrentTime);
         }
     }
     
@@ -153,12 +1384,147 @@ static void poll_clipboard_changes(Display *display, Atom clipboard_atom_local,
         msg(LOG_DEBUG, "PRIMARY owner changed: %lu -> %lu", last_primary_owner, primary_owner);
         last_primary_owner = primary_owner;
         
-        if (primary_owner != None) {
-            handle_clipboard_change_threaded(primary_atom_local, clipboard_atom_local, primary_atom_local);
+        if (primary_owner != None && config.primary_history) {
+            handle_clipboard_change_threaded(primary_atom_local, clipboard_atom_local, primary_atom_local,
+                                             primary_owner, CurrentTime);
+        }
+    }
+    
+    return changed;
+}
+
+static void report_startup(int started) {
+    pthread_mutex_lock(&startup_mutex);
+    startup_state = started ? 1 : -1;
+    pthread_cond_broadcast(&startup_condition);
+    pthread_mutex_unlock(&startup_mutex);
+}
+
+// property reads may have queued events already, they are drained before
+// every wait as well
+static void dispatch_clipboard_events(int fd, void *data) {
+    (void)fd;
+    (void)data;
+    
+    while (XPending(clipboard_display)) {
+        XEvent event;
+        XNextEvent(clipboard_display, &event);
+        
+        if (xfixes_available && event.type == xfixes_event_base + XFixesSelectionNotify) {
+            XFixesSelectionNotifyEvent *selection_notify_event = (XFixesSelectionNotifyEvent *)&event;
+            
+            const char *selection_name = (selection_notify_event->selection == clipboard_atom) ? "CLIPBOARD" : "PRIMARY";
+            
+            if (selection_notify_event->subtype != XFixesSetSelectionOwnerNotify) {
+                msg(LOG_DEBUG, "%s owner went away (%s)", selection_name,
+                    selection_notify_event->subtype == XFixesSelectionWindowDestroyNotify ?
+                    "window destroyed" : "client closed");
+                selection_transfer_t *transfer = find_transfer(selection_notify_event->selection, None);
+                if (transfer == &clipboard_transfer) {
+                    persist_clipboard(selection_notify_event->timestamp);
+                }
+                if (transfer) {
+                    owner_forget(transfer->change_owner);
+                }
+                continue;
+            }
+            
+            msg(LOG_DEBUG, "%s selection changed, owner: %lu", selection_name, selection_notify_event->owner);
+            
+            if (selection_notify_event->owner != None && selection_notify_event->owner != owner_window) {
+                handle_clipboard_change_threaded(selection_notify_event->selection, 
+                                                clipboard_atom, 
+                                                primary_atom,
+                                                selection_notify_event->owner,
+                                                selection_notify_event->selection_timestamp);
+            }
+        } else if (event.type == SelectionNotify) {
+            handle_selection_notify(&event.xselection);
+        } else if (event.type == PropertyNotify) {
+            if (event.xproperty.window == owner_window) {
+                if (event.xproperty.atom == ownership_property_atom) {
+                    take_ownership(event.xproperty.time);
+                }
+            } else {
+                handle_property_notify(&event.xproperty);
+            }
+        } else if (event.type == SelectionRequest) {
+            handle_selection_request(&event.xselectionrequest);
+        } else if (event.type == SelectionClear) {
+            if (event.xselectionclear.window == owner_window) {
+                msg(LOG_DEBUG, "Lost ownership of CLIPBOARD");
+                served_content_free(served_content);
+                served_content = NULL;
+            }
         }
     }
 }
 
+static void read_wake_events(int fd, void *data) {
+    (void)data;
+    
+    uint64_t wake_count;
+    if (read(fd, &wake_count, sizeof(wake_count)) == -1 && errno != EAGAIN) {
+        msg(LOG_WARNING, "Failed to read clipboard wake event: %s", strerror(errno));
+    }
+    
+    if (clipboard_thread_running) {
+        handle_ownership_request();
+    }
+}
+
+// runs before every wait, the earliest deadline of transfers, debounced
+// changes and expiring content is when the loop has to wake up again
+static long long prepare_clipboard_loop(void *data) {
+    dispatch_clipboard_events(ConnectionNumber(clipboard_display), data);
+    
+    long long now = monotonic_milliseconds();
+    if (!xfixes_available && now >= next_poll) {
+        if (poll_clipboard_changes(clipboard_display, clipboard_atom, primary_atom)) {
+            poll_interval = POLL_MIN_INTERVAL_MS;
+        } else if (poll_interval < POLL_MAX_INTERVAL_MS) {
+            poll_interval *= 2;
+        }
+        now = monotonic_milliseconds();
+        next_poll = now + poll_interval;
+    }
+    
+    expire_transfers(now);
+    process_pending_changes(now);
+    long long sensitive_expiry = history_expire_sensitive_entries(now);
+    long long served_expiry = expire_served_content(now);
+    
+    // requests of the housekeeping above still have to go out
+    XFlush(clipboard_display);
+    
+    long long deadline = next_poll;
+    if (sensitive_expiry < deadline) {
+        deadline = sensitive_expiry;
+    }
+    if (served_expiry < deadline) {
+        deadline = served_expiry;
+    }
+    if (clipboard_transfer.state != TRANSFER_IDLE && clipboard_transfer.deadline < deadline) {
+        deadline = clipboard_transfer.deadline;
+    }
+    if (primary_transfer.state != TRANSFER_IDLE && primary_transfer.deadline < deadline) {
+        deadline = primary_transfer.deadline;
+    }
+    if (clipboard_transfer.change_pending && clipboard_transfer.change_deadline < deadline) {
+        deadline = clipboard_transfer.change_deadline;
+    }
+    if (primary_transfer.change_pending && primary_transfer.change_deadline < deadline) {
+        deadline = primary_transfer.change_deadline;
+    }
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        if (outgoing_transfers[i].data && outgoing_transfers[i].deadline < deadline) {
+            deadline = outgoing_transfers[i].deadline;
+        }
+    }
+    
+    return deadline;
+}
+
 static void* clipboard_monitor_thread(void* arg) {
     (void)arg;
     
@@ -167,16 +1533,16 @@ static void* clipboard_monitor_thread(void* arg) {
     clipboard_display = XOpenDisplay(NULL);
     if (!clipboard_display) {
         msg(LOG_ERR, "Failed to open display in clipboard thread");
+        report_startup(0);
         return NULL;
     }
     
     Window root = DefaultRootWindow(clipboard_display);
     
-    int xfixes_event_base, xfixes_error_base;
-    if (!XFixesQueryExtension(clipboard_display, &xfixes_event_base, &xfixes_error_base)) {
-        msg(LOG_ERR, "XFixes not available in clipboard thread");
-        XCloseDisplay(clipboard_display);
-        return NULL;
+    int xfixes_error_base;
+    xfixes_available = XFixesQueryExtension(clipboard_display, &xfixes_event_base, &xfixes_error_base);
+    if (!xfixes_available) {
+        msg(LOG_WARNING, "XFixes not available, polling for clipboard changes");
     }
     
     Atom thread_clipboard_atom = XInternAtom(clipboard_display, "CLIPBOARD", False);
@@ -188,57 +1554,122 @@ static void* clipboard_monitor_thread(void* arg) {
     if (thread_clipboard_atom == None || thread_primary_atom == None) {
         msg(LOG_ERR, "Failed to get required atoms");
         XCloseDisplay(clipboard_display);
+        clipboard_display = NULL;
+        report_startup(0);
         return NULL;
     }
     
-    XFixesSelectSelectionInput(clipboard_display, root, thread_clipboard_atom,
-                              XFixesSetSelectionOwnerNotifyMask);
-    XFixesSelectSelectionInput(clipboard_display, root, thread_primary_atom,
-                              XFixesSetSelectionOwnerNotifyMask);
+    if (xfixes_available) {
+        unsigned long selection_event_mask = XFixesSetSelectionOwnerNotifyMask |
+                                             XFixesSelectionWindowDestroyNotifyMask |
+                                             XFixesSelectionClientCloseNotifyMask;
+        XFixesSelectSelectionInput(clipboard_display, root, thread_clipboard_atom, selection_event_mask);
+        if (config.primary_history) {
+            XFixesSelectSelectionInput(clipboard_display, root, thread_primary_atom, selection_event_mask);
+        }
+        
+        msg(LOG_NOTICE, "Clipboard thread: XFixes initialized, event base: %d", xfixes_event_base);
+    }
+    
+    // invisible window that receives the converted selections
+    requestor_window = XCreateSimpleWindow(clipboard_display, root, -10, -10, 1, 1, 0, 0, 0);
+    XSelectInput(clipboard_display, requestor_window, PropertyChangeMask);
+    
+    // and one that owns the CLIPBOARD when an entry is selected
+    owner_window = XCreateSimpleWindow(clipboard_display, root, -10, -10, 1, 1, 0, 0, 0);
+    XSelectInput(clipboard_display, owner_window, PropertyChangeMask);
+    
+    previous_error_handler = XSetErrorHandler(clipboard_error_handler);
     
-    msg(LOG_NOTICE, "Clipboard thread: XFixes initialized, event base: %d", xfixes_event_base);
+    clipboard_atom = thread_clipboard_atom;
+    primary_atom = thread_primary_atom;
+    utf8_string_atom = XInternAtom(clipboard_display, "UTF8_STRING", False);
+    incr_atom = XInternAtom(clipboard_display, "INCR", False);
+    targets_atom = XInternAtom(clipboard_display, "TARGETS", False);
+    timestamp_atom = XInternAtom(clipboard_display, "TIMESTAMP", False);
+    multiple_atom = XInternAtom(clipboard_display, "MULTIPLE", False);
+    ownership_property_atom = XInternAtom(clipboard_display, "HALEN_OWNERSHIP", False);
+    text_target_atoms[0] = utf8_string_atom;
+    text_target_atoms[1] = XInternAtom(clipboard_display, "text/plain;charset=utf-8", False);
+    text_target_atoms[2] = XA_STRING;
+    text_target_atoms[3] = XInternAtom(clipboard_display, "TEXT", False);
+    text_target_atoms[4] = XInternAtom(clipboard_display, "text/plain", False);
+    png_atom = XInternAtom(clipboard_display, "image/png", False);
+    password_hint_atom = XInternAtom(clipboard_display, "x-kde-passwordManagerHint", False);
+    intern_capture_targets();
+    owner_init(clipboard_display);
+    
+    // larger replies are sent with INCR
+    long maximum_request_bytes = XExtendedMaxRequestSize(clipboard_display) > 0 ?
+        XExtendedMaxRequestSize(clipboard_display) * 4 : XMaxRequestSize(clipboard_display) * 4;
+    outgoing_chunk_size = maximum_request_bytes - 1024 < 262144 ? maximum_request_bytes - 1024 : 262144;
+    
+    long long started = monotonic_milliseconds();
+    clipboard_transfer = (selection_transfer_t){ .name = "CLIPBOARD", .selection = thread_clipboard_atom,
+        .property = XInternAtom(clipboard_display, "HALEN_CLIPBOARD", False),
+        .tokens = RATE_LIMIT_BURST * 1000, .tokens_updated = started };
+    primary_transfer = (selection_transfer_t){ .name = "PRIMARY", .selection = thread_primary_atom,
+        .property = XInternAtom(clipboard_display, "HALEN_PRIMARY", False),
+        .tokens = RATE_LIMIT_BURST * 1000, .tokens_updated = started };
     
     clipboard_thread_running = 1;
     
-    // Event loop for clipboard monitoring
-    while (clipboard_thread_running) {
-        fd_set read_fds;
-        int x11_fd = ConnectionNumber(clipboard_display);
-        
-        FD_ZERO(&read_fds);
-        FD_SET(x11_fd, &read_fds);
-        
-        struct timeval timeout = {2, 0}; // 2 second timeout
-        
-        int select_result = select(x11_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (select_result > 0 && FD_ISSET(x11_fd, &read_fds)) {
-            while (XPending(clipboard_display)) {
-                XEvent event;
-                XNextEvent(clipboard_display, &event);
-                
-                if (event.type == xfixes_event_base + XFixesSelectionNotify) {
-                    XFixesSelectionNotifyEvent *selection_notify_event = (XFixesSelectionNotifyEvent *)&event;
-                    
-                    const char *selection_name = (selection_notify_event->selection == thread_clipboard_atom) ? "CLIPBOARD" : "PRIMARY";
-                    msg(LOG_DEBUG, "%s selection changed, owner: %lu", selection_name, selection_notify_event->owner);
-                    
-                    if (selection_notify_event->owner != None) {
-                        handle_clipboard_change_threaded(selection_notify_event->selection, 
-                                                        thread_clipboard_atom, 
-                                                        thread_primary_atom);
-                    }
-                }
-            }
-        } else if (select_result == 0) {
-            // Timeout - poll for clipboard changes
-            poll_clipboard_changes(clipboard_display, thread_clipboard_atom, thread_primary_atom);
-        }
-        
-        pthread_testcancel();
+    Window initial_owner = XGetSelectionOwner(clipboard_display, thread_clipboard_atom);
+    if (initial_owner != None) {
+        handle_clipboard_change_threaded(thread_clipboard_atom, thread_clipboard_atom,
+                                         thread_primary_atom, initial_owner, CurrentTime);
+    }
+    
+    poll_interval = POLL_MIN_INTERVAL_MS;
+    next_poll = xfixes_available ? LLONG_MAX : monotonic_milliseconds() + poll_interval;
+    
+    clipboard_reactor = reactor_create();
+    if (!clipboard_reactor ||
+        !reactor_add_fd(clipboard_reactor, ConnectionNumber(clipboard_display), dispatch_clipboard_events, NULL) ||
+        !reactor_add_fd(clipboard_reactor, wake_fd, read_wake_events, NULL)) {
+        msg(LOG_ERR, "Failed to set up the clipboard event loop");
+        clipboard_thread_running = 0;
     }
     
+    report_startup(clipboard_thread_running);
+    
+    if (clipboard_thread_running) {
+        reactor_set_prepare(clipboard_reactor, prepare_clipboard_loop, NULL);
+        reactor_run(clipboard_reactor, &clipboard_thread_running);
+    }
+    reactor_destroy(clipboard_reactor);
+    clipboard_reactor = NULL;
+    
     msg(LOG_NOTICE, "Clipboard thread: Cleaning up...");
+    log_change_statistics(&clipboard_transfer, LOG_NOTICE);
+    log_change_statistics(&primary_transfer, LOG_NOTICE);
+    abort_transfer(&clipboard_transfer);
+    abort_transfer(&primary_transfer);
+    free(primary_transfer.last_storage_content);
+    primary_transfer.last_storage_content = NULL;
+    for (int i = 0; i < MAX_OUTGOING_TRANSFERS; i++) {
+        if (outgoing_transfers[i].data) {
+            end_outgoing_transfer(&outgoing_transfers[i]);
+        }
+    }
+    served_content_free(served_content);
+    served_content = NULL;
+    served_content_free(last_capture);
+    last_capture = NULL;
+    if (persisted_count > 0) {
+        msg(LOG_NOTICE, "Served the CLIPBOARD of %lu exited owners", persisted_count);
+    }
+    for (int i = 0; i < capture_target_count; i++) {
+        free(capture_targets[i].mime_type);
+    }
+    capture_target_count = 0;
+    owner_cleanup();
+    finish_ownership_request(0);
+    XDestroyWindow(clipboard_display, requestor_window);
+    requestor_window = None;
+    XDestroyWindow(clipboard_display, owner_window);
+    owner_window = None;
+    XSetErrorHandler(previous_error_handler);
     XCloseDisplay(clipboard_display);
     clipboard_display = NULL;
     
@@ -249,11 +1680,10 @@ static void* clipboard_monitor_thread(void* arg) {
 int clipboard_init(void) {
     clipboard_thread_running = 0;
     clipboard_display = NULL;
-    last_clipboard_content = NULL;
-    last_primary_content = NULL;
-    clipboard_content_buffer_size = 0;
     
-    if (!ensure_content_buffer_capacity()) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        msg(LOG_ERR, "Failed to create clipboard wake eventfd: %s", strerror(errno));
         return 0;
     }
     
@@ -270,14 +1700,20 @@ int clipboard_start_monitoring_async(void) {
         return 0;
     }
     
-    // Give thread time to initialize
-    usleep(100000); // 100ms
+    // wait until the thread runs its event loop, or gave up
+    pthread_mutex_lock(&startup_mutex);
+    while (startup_state == 0) {
+        pthread_cond_wait(&startup_condition, &startup_mutex);
+    }
+    int started = startup_state > 0;
+    pthread_mutex_unlock(&startup_mutex);
     
-    if (clipboard_thread_running) {
+    if (started) {
         msg(LOG_NOTICE, "Clipboard monitoring started in background thread");
         return 1;
     } else {
         msg(LOG_ERR, "Clipboard thread failed to start");
+        pthread_join(clipboard_thread, NULL);
         return 0;
     }
 }
@@ -285,95 +1721,84 @@ int clipboard_start_monitoring_async(void) {
 void clipboard_stop_monitoring(void) {
     if (clipboard_thread_running) {
         msg(LOG_NOTICE, "Stopping clipboard monitoring thread...");
+        // the event loop checks the flag after every wakeup
         clipboard_thread_running = 0;
-        pthread_cancel(clipboard_thread);
+        uint64_t wake = 1;
+        if (write(wake_fd, &wake, sizeof(wake)) == -1) {
+            msg(LOG_WARNING, "Failed to wake clipboard thread: %s", strerror(errno));
+        }
         pthread_join(clipboard_thread, NULL);
         msg(LOG_NOTICE, "Clipboard monitoring thread stopped");
     }
     
-    if (last_clipboard_content) {
-        free(last_clipboard_content);
-        last_clipboard_content = NULL;
-    }
-    if (last_primary_content) {
-        free(last_primary_content);
-        last_primary_content = NULL;
+    pthread_mutex_lock(&ownership_mutex);
+    served_content_free(requested_content);
+    requested_content = NULL;
+    pthread_mutex_unlock(&ownership_mutex);
+    
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
     }
-    clipboard_content_buffer_size = 0;
 }
 
-// depends on xclip command. selection_name is either "clipboard" or "primary"
-char* clipboard_get_content(const char* selection_name) {
-    char command[256];
-    snprintf(command, sizeof(command), 
-             "timeout 0.5 xclip -selection %s -o 2>/dev/null", 
-             selection_name);
-    
-    FILE *fp = popen(command, "r");
-    if (!fp) return NULL;
-    
-    size_t initial_buffer_size = config.max_lines * config.max_line_length + 4096;
-    char *content = malloc(initial_buffer_size);
-    if (!content) {
-        pclose(fp);
-        return NULL;
+// hands the entry to the clipboard thread and waits until it owns the
+// CLIPBOARD, so a paste that follows gets the new content
+int clipboard_set_entry(int index) {
+    if (!clipboard_thread_running) {
+        msg(LOG_WARNING, "Cannot set clipboard - clipboard thread is not running");
+        return 0;
     }
     
-    size_t total = 0;
-    size_t capacity = initial_buffer_size;
-    char buffer[4096];
-    size_t bytes_read;
+    served_content_t *content = calloc(1, sizeof(served_content_t));
+    if (!content) return 0;
     
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        if (total + bytes_read >= capacity) {
-            size_t new_capacity = capacity * 2;
-            if (new_capacity > MAX_OVERFLOW_FILE_SIZE) {
-                new_capacity = MAX_OVERFLOW_FILE_SIZE;
-                if (total >= new_capacity - 1) {
-                    msg(LOG_NOTICE, "Clipboard content exceeds maximum size, will use overflow");
-                    break;
-                }
-                bytes_read = new_capacity - total - 1;
-            }
-            
-            char *new_content = realloc(content, new_capacity);
-            if (!new_content) {
-                msg(LOG_WARNING, "Failed to expand clipboard buffer");
-                break;
-            }
-            content = new_content;
-            capacity = new_capacity;
-        }
-        
-        memcpy(content + total, buffer, bytes_read);
-        total += bytes_read;
+    content->entry = history_copy_entry(index);
+    content->text = history_get_entry_full_content(index);
+    if (!content->entry || !content->text || content->text[0] == '\0') {
+        msg(LOG_WARNING, "Cannot set clipboard - entry %d is empty", index + 1);
+        served_content_free(content);
+        return 0;
     }
-    content[total] = '\0';
+    content->text_length = strlen(content->text);
     
-    int exit_code = pclose(fp);
-    if (exit_code != 0 || total == 0) {
-        free(content);
-        return NULL;
+    if (content->entry->sensitive) {
+        msg(LOG_NOTICE, "Setting clipboard content: %s", content->entry->content);
+    } else {
+        msg(LOG_NOTICE, "Setting clipboard content: %.50s%s", 
+            content->text, content->text_length > 50 ? "..." : "");
     }
     
-    while (total > 0 && (content[total-1] == '\n' || content[total-1] == '\r')) {
-        content[--total] = '\0';
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += OWNERSHIP_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (OWNERSHIP_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
     
-    text_trim_trailing_whitespace(content);
+    pthread_mutex_lock(&ownership_mutex);
+    served_content_free(requested_content);
+    requested_content = content;
+    ownership_request_pending = 1;
+    ownership_result = 0;
     
-    char *final_content = realloc(content, strlen(content) + 1);
-    return final_content ? final_content : content;
-}
-
-int clipboard_set_content(const char* content) {
-    if (!content) {
-        msg(LOG_WARNING, "clipboard_set_content: content is NULL");
-        return 0;
+    uint64_t wake = 1;
+    if (write(wake_fd, &wake, sizeof(wake)) == -1 && errno != EAGAIN) {
+        msg(LOG_WARNING, "Failed to wake clipboard thread: %s", strerror(errno));
     }
     
-    msg(LOG_NOTICE, "Setting clipboard content: %.50s%s", 
-        content, strlen(content) > 50 ? "..." : "");
+    int wait_result = 0;
+    while (ownership_request_pending && wait_result != ETIMEDOUT) {
+        wait_result = pthread_cond_timedwait(&ownership_condition, &ownership_mutex, &deadline);
+    }
+    int result = !ownership_request_pending && ownership_result;
+    pthread_mutex_unlock(&ownership_mutex);
+    
+    if (!result) {
+        msg(LOG_ERR, "Timed out waiting for clipboard ownership");
+    }
     
-    return set_clipboard_content(content);
+    return result;
 }
@@ -7,8 +7,7 @@
 int   clipboard_init(void);
 int   clipboard_start_monitoring_async(void);
 void  clipboard_stop_monitoring(void);
-char* clipboard_get_content(const char* selection_name);
-int   clipboard_set_content(const char* content);
+int   clipboard_set_entry(int index);
 char* clipboard_history_file_default_path(void);
 
 
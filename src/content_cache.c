@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "content_cache.h"
+#include "halen.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/syslog.h>
+
+#define CONTENT_CACHE_ENTRIES 32
+#define CONTENT_CACHE_BUDGET (16 * 1024 * 1024)
+// larger content would push out the entries the history keeps warm
+#define CONTENT_CACHE_MAX_CONTENT (CONTENT_CACHE_BUDGET / CONTENT_CACHE_WARM_ENTRIES)
+
+typedef struct {
+    char hash[24];
+    char *content;
+    size_t length;
+    unsigned long last_used;
+} cached_content_t;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cached_content_t cache[CONTENT_CACHE_ENTRIES];
+static size_t cached_bytes = 0;
+static unsigned long cache_clock = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+static cached_content_t* find_content(const char *hash);
+static void drop_content(cached_content_t *cached);
+
+static cached_content_t* find_content(const char *hash) {
+    for (int i = 0; i < CONTENT_CACHE_ENTRIES; i++) {
+        if (cache[i].content && strcmp(cache[i].hash, hash) == 0) {
+            return &cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_content(cached_content_t *cached) {
+    cached_bytes -= cached->length;
+    free(cached->content);
+    memset(cached, 0, sizeof(*cached));
+}
+
+void content_cache_put(const char *hash, const char *content, size_t length) {
+    if (!hash || !content || !content_cache_accepts(length)) return;
+    
+    char *content_copy = malloc(length + 1);
+    if (!content_copy) return;
+    memcpy(content_copy, content, length);
+    content_copy[length] = '\0';
+    
+    pthread_mutex_lock(&cache_mutex);
+    
+    cached_content_t *cached = find_content(hash);
+    if (cached) {
+        drop_content(cached);
+    }
+    
+    // make room, least recently used first
+    for (;;) {
+        cached_content_t *free_slot = NULL;
+        cached_content_t *least_recent = NULL;
+        for (int i = 0; i < CONTENT_CACHE_ENTRIES; i++) {
+            if (!cache[i].content) {
+                if (!free_slot) free_slot = &cache[i];
+            } else if (!least_recent || cache[i].last_used < least_recent->last_used) {
+                least_recent = &cache[i];
+            }
+        }
+        
+        if (free_slot && cached_bytes + length <= CONTENT_CACHE_BUDGET) {
+            cached = free_slot;
+            break;
+        }
+        drop_content(least_recent);
+    }
+    
+    snprintf(cached->hash, sizeof(cached->hash), "%s", hash);
+    cached->content = content_copy;
+    cached->length = length;
+    cached->last_used = ++cache_clock;
+    cached_bytes += length;
+    
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// returns a copy of the content, NULL if it isn't cached
+char* content_cache_get(const char *hash, size_t *length) {
+    if (!hash) return NULL;
+    
+    char *content = NULL;
+    pthread_mutex_lock(&cache_mutex);
+    
+    cached_content_t *cached = find_content(hash);
+    if (cached) {
+        content = malloc(cached->length + 1);
+        if (content) {
+            memcpy(content, cached->content, cached->length + 1);
+            if (length) *length = cached->length;
+        }
+        cached->last_used = ++cache_clock;
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    
+    pthread_mutex_unlock(&cache_mutex);
+    return content;
+}
+
+int content_cache_contains(const char *hash) {
+    if (!hash) return 0;
+    
+    pthread_mutex_lock(&cache_mutex);
+    int found = find_content(hash) != NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    
+    return found;
+}
+
+// content put into the cache is only kept when this is true
+int content_cache_accepts(size_t length) {
+    return length <= CONTENT_CACHE_MAX_CONTENT;
+}
+
+void content_cache_remove(const char *hash) {
+    if (!hash) return;
+    
+    pthread_mutex_lock(&cache_mutex);
+    cached_content_t *cached = find_content(hash);
+    if (cached) {
+        drop_content(cached);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void content_cache_clear(void) {
+    pthread_mutex_lock(&cache_mutex);
+    
+    if (cache_hits + cache_misses > 0) {
+        msg(LOG_DEBUG, "Content cache: %lu hits, %lu misses", cache_hits, cache_misses);
+    }
+    for (int i = 0; i < CONTENT_CACHE_ENTRIES; i++) {
+        if (cache[i].content) {
+            drop_content(&cache[i]);
+        }
+    }
+    
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,19 @@
+#ifndef CONTENT_CACHE_H
+#define CONTENT_CACHE_H
+
+#include <stddef.h>
+
+// the history keeps the content of this many of its newest entries
+#define CONTENT_CACHE_WARM_ENTRIES 8
+
+// Full content of overflow entries, keyed by overflow hash, so a paste
+// never has to read the overflow directory. Least recently used content
+// is dropped once the byte budget is exceeded. Used from both threads.
+void  content_cache_put(const char *hash, const char *content, size_t length);
+char* content_cache_get(const char *hash, size_t *length);
+int   content_cache_contains(const char *hash);
+int   content_cache_accepts(size_t length);
+void  content_cache_remove(const char *hash);
+void  content_cache_clear(void);
+
+#endif // CONTENT_CACHE_H
@@ -2,6 +2,7 @@
 #define CLIPOPUP_H
 
 #include "config.h"
+#include "reactor.h"
 #include <sys/syslog.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
@@ -35,6 +36,11 @@ typedef enum {
     POPUP_POSITION_ABSOLUTE
 } PopupPosition;
 
+typedef enum {
+    KEY_EVENTS_XINPUT2,
+    KEY_EVENTS_XRECORD
+} KeyEvents;
+
 typedef struct {
     int verbose;
     char *logfile;
@@ -56,7 +62,22 @@ typedef struct {
     PopupAnchor anchor;
     int margin_vertical;
     int margin_horizontal;
+    int list_rows;              // entries listed in the popup, 0 shows one entry
     char *overflow_directory;
+    char *capture_targets;      // space separated MIME types stored next to the text
+    int max_target_size;        // in KiB, larger targets are not stored
+    int primary_history;        // capture PRIMARY into a ring of its own
+    int primary_history_size;   // entries kept in the PRIMARY ring
+    char *capture_allow;        // space separated WM_CLASS or process names, only these are captured
+    char *capture_deny;         // never captured
+    int sensitive_timeout;      // seconds entries marked by a password manager are kept, 0 skips them
+    char *key_paste;            // keysym names of the keys pressed together with Control
+    char *key_previous;
+    char *key_cut;
+    char *key_cancel;
+    char *key_delete;
+    char *key_ring;
+    KeyEvents key_events;       // how Control releases are seen, XRecord if XInput 2.1 is missing
 } config_t;
 
 // Global verbose flag (defined in main.c)
@@ -67,6 +88,7 @@ extern config_t config;
 extern Display *g_display;
 extern Window g_root_window;
 extern volatile int g_running;
+extern reactor_t *g_reactor;    // event loop of the main thread
 
 // Global logging function (defined in main.c)
 void msg(int priority, const char* format, ...);
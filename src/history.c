@@ -1,7 +1,9 @@
 #define _GNU_SOURCE
 #include "history.h"
 #include "halen.h"
-#include "clipboard.h"
+#include "overflow.h"
+#include "content_cache.h"
+#include "thumbnail.h"
 #include "xdg.h"
 #include "text.h"
 
@@ -12,17 +14,51 @@
 #include <libgen.h>
 #include <sys/stat.h>
 #include <linux/limits.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define METADATA_PREFIX "# HALEN_METADATA: "
 #define MAX_CLIPBOARD_ENTRIES 50
+#define MAX_SENSITIVE_ENTRIES 8
+// the selected entry is only read once navigation pauses
+#define PREFETCH_DELAY_MS 150
 
+// an entry a password manager marked as sensitive, never written to disk
+typedef struct {
+    history_entry_t entry;
+    char *text;
+    size_t text_length;
+    long long expires;
+} sensitive_entry_t;
+
+// the clipboard thread adds entries while the main thread browses them.
+// recursive, public functions call each other
+static pthread_mutex_t history_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 static history_entry_t *entries = NULL;
 static int history_count = 0;
 static int current_index = -1;
+static history_ring_t current_ring = HISTORY_RING_CLIPBOARD;
+// the entries in current_ring, newest first. Indices into entries, or
+// -(n + 1) for sensitive_entries[n]
+static int *ring_entries = NULL;
+static int ring_count = 0;
+static sensitive_entry_t sensitive_entries[MAX_SENSITIVE_ENTRIES];
+static int sensitive_count = 0;
+static int prefetch_timer = 0;
+// overflow hashes to read into the content cache, queued while the mutex
+// is held and read once it is released
+static char *prefetch_hashes[CONTENT_CACHE_WARM_ENTRIES];
+static int prefetch_count = 0;
 
 static char* load_overflow_content_by_hash(const char* overflow_hash);
+static void prefetch_entry_content(const history_entry_t *entry);
+static void read_prefetched_content(void);
+static void prefetch_current_entry(void *data);
+static history_entry_t* copy_entry(int index);
+static int delete_entry(int index);
+static int add_sensitive_entry(const history_entry_t *new_entry, const char *text, long long expires);
 static int replace_file_atomically(const char* source_filename, const char* target_filename);
 static int create_history_file(const char *history_file);
 static char* extract_overflow_hash_from_line(const char* line);
@@ -34,33 +70,87 @@ static int count_history_entries_in_file(FILE* file);
 static int load_history_entries(void);
 static void get_timestamp(char *buffer, size_t size);
 static char* transform_content_escaping(const char* content, int should_escape);
-static char* extract_display_content(const char *raw_content);
+static const char* parse_entry_markers(const char *content_start, history_entry_t *entry);
+static void parse_targets_marker(const char *targets_start, const char *targets_end, history_entry_t *entry);
+static char* format_targets_marker(const history_target_t *targets, int target_count);
+static char* extract_marker(const char *line, const char *prefix);
+static int is_blob_referenced(const char *hash, int ignored_index);
+static history_ring_t entry_ring(const char *source);
+static void build_ring_view(void);
+static history_entry_t* ring_entry(int index);
+static void free_sensitive_entry(sensitive_entry_t *sensitive_entry);
+static void remove_sensitive_entry(int position);
+static int is_duplicate_entry(const history_entry_t *entry, const history_entry_t *new_entry);
+static void collect_entry_blobs(const history_entry_t *entry, char ***hashes, int *hash_count);
+static void delete_unreferenced_blobs(char **hashes, int hash_count);
+static int add_entry(const history_entry_t *new_entry, int replace_newest);
 static history_entry_t entry_parse(const char *line);
 
 static char* transform_content_escaping(const char* content, int should_escape) {
     return should_escape ? text_escape_content(content) : text_unescape_content(content);
 }
 
+// the content cache is tried first, content read from the overflow
+// directory is added to it
 static char* load_overflow_content_by_hash(const char* overflow_hash) {
     if (!config.overflow_directory || !overflow_hash) return NULL;
     
-    char overflow_file_path[PATH_MAX];
-    snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s", 
-            config.overflow_directory, overflow_hash);
-    
-    FILE *overflow_file = fopen(overflow_file_path, "r");
-    if (!overflow_file) return NULL;
+    size_t content_length = 0;
+    char *full_content = content_cache_get(overflow_hash, &content_length);
+    if (full_content) return full_content;
     
-    char *full_content = malloc(MAX_OVERFLOW_FILE_SIZE);
+    full_content = overflow_read_file(overflow_hash, &content_length);
     if (full_content) {
-        size_t content_size = fread(full_content, 1, MAX_OVERFLOW_FILE_SIZE - 1, overflow_file);
-        full_content[content_size] = '\0';
+        content_cache_put(overflow_hash, full_content, content_length);
     }
-    fclose(overflow_file);
     
     return full_content;
 }
 
+// queues the content of an entry to be read into the cache unless it is
+// there already, see read_prefetched_content
+static void prefetch_entry_content(const history_entry_t *entry) {
+    if (!entry->hash || prefetch_count == CONTENT_CACHE_WARM_ENTRIES) return;
+    if (content_cache_contains(entry->hash)) return;
+    
+    char *hash = strdup(entry->hash);
+    if (hash) prefetch_hashes[prefetch_count++] = hash;
+}
+
+// called by the public functions after releasing the mutex, so neither
+// thread waits for the other's disk reads. content too large for the
+// cache would be read from disk on every call
+static void read_prefetched_content(void) {
+    char *hashes[CONTENT_CACHE_WARM_ENTRIES];
+    
+    pthread_mutex_lock(&history_mutex);
+    int count = prefetch_count;
+    memcpy(hashes, prefetch_hashes, count * sizeof(char*));
+    prefetch_count = 0;
+    pthread_mutex_unlock(&history_mutex);
+    
+    for (int i = 0; i < count; i++) {
+        size_t file_size = overflow_file_size(hashes[i]);
+        if (file_size > 0 && content_cache_accepts(file_size) && !content_cache_contains(hashes[i])) {
+            free(load_overflow_content_by_hash(hashes[i]));
+        }
+        free(hashes[i]);
+    }
+}
+
+static void prefetch_current_entry(void *data) {
+    (void)data;
+    pthread_mutex_lock(&history_mutex);
+    prefetch_timer = 0;
+    
+    if (current_index >= 0 && current_index < ring_count &&
+        ring_entries[current_index] >= 0) {
+        prefetch_entry_content(&entries[ring_entries[current_index]]);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+}
+
 static int replace_file_atomically(const char* source_filename, const char* target_filename) {
     if (rename(source_filename, target_filename) != 0) {
         unlink(source_filename);
@@ -98,10 +188,10 @@ static char* extract_overflow_hash_from_line(const char* line) {
     char *overflow_marker = strstr(line, "[OVERFLOW:");
     if (!overflow_marker) return NULL;
     
-    char *overflow_hash = malloc(16);
+    char *overflow_hash = malloc(24);
     if (!overflow_hash) return NULL;
     
-    if (sscanf(overflow_marker, "[OVERFLOW:%15[^]]]", overflow_hash) != 1) {
+    if (sscanf(overflow_marker, "[OVERFLOW:%23[^]]]", overflow_hash) != 1) {
         free(overflow_hash);
         return NULL;
     }
@@ -158,8 +248,16 @@ static void regenerate_truncated_entries(void) {
                     if (escaped_regenerated) {
                         char timestamp[32], source[16];
                         if (sscanf(line, "[%31[^]]] [%15[^]]]", timestamp, source) == 2) {
-                            fprintf(temp_file, "[%s] [%s] [OVERFLOW:%s] %s\n", 
-                                    timestamp, source, overflow_hash, escaped_regenerated);
+                            char *application_marker = extract_marker(line, "[APP:");
+                            char *targets_marker = extract_marker(line, "[TARGETS:");
+                            fprintf(temp_file, "[%s] [%s] %s%s[OVERFLOW:%s] %s%s%s\n", 
+                                    timestamp, source,
+                                    application_marker ? application_marker : "", application_marker ? " " : "",
+                                    overflow_hash,
+                                    targets_marker ? targets_marker : "", targets_marker ? " " : "",
+                                    escaped_regenerated);
+                            free(application_marker);
+                            free(targets_marker);
                             entries_regenerated++;
                         } else {
                             msg(LOG_WARNING, "Failed to parse timestamp/source from line: %.50s", line);
@@ -242,39 +340,17 @@ static int count_history_entries_in_file(FILE* file) {
 static int load_history_entries(void) {
     if (entries) {
         for (int i = 0; i < history_count; i++) {
-            free(entries[i].content);
-            free(entries[i].timestamp);
-            free(entries[i].source);
-            free(entries[i].hash);
+            history_free_entry(&entries[i]);
         }
         free(entries);
         entries = NULL;
     }
+    ring_count = 0;
     
     if (access(config.history_file, F_OK) != 0) {
-        msg(LOG_DEBUG, "History file doesn't exist, creating with initial entry");
-        
-        char *current_clipboard = clipboard_get_content("clipboard");
-        const char *initial_content = current_clipboard ? current_clipboard : "Clipboard Empty";
-
+        // the clipboard monitor captures the current clipboard when it starts
+        msg(LOG_DEBUG, "History file doesn't exist, creating it");
         create_history_file(config.history_file);
-        
-        FILE *history_file = fopen(config.history_file, "a");
-        if (history_file) {
-            char timestamp[32];
-            get_timestamp(timestamp, sizeof(timestamp));
-            
-            char *escaped_content = transform_content_escaping(initial_content, 1);
-            if (escaped_content) {
-                fprintf(history_file, "[%s] [%s] %s\n", timestamp, "CLIPBOARD", escaped_content);
-                free(escaped_content);
-            }
-            fclose(history_file);
-        }
-        
-        if (current_clipboard) {
-            free(current_clipboard);
-        }
     }
     
     FILE *metadata_check_file = fopen(config.history_file, "r");
@@ -333,9 +409,7 @@ static int load_history_entries(void) {
         history_entry_t entry = entry_parse(line);
         if (entry.content == NULL) {
             msg(LOG_WARNING, "Invalid history entry format: '%s'", line);
-            if (entry.timestamp) free(entry.timestamp);
-            if (entry.source) free(entry.source);
-            if (entry.hash) free(entry.hash);
+            history_free_entry(&entry);
             continue;
         }
 
@@ -345,6 +419,14 @@ static int load_history_entries(void) {
     
     history_count = index;
     fclose(history_file);
+    build_ring_view();
+    
+    // the newest entries are the ones pasted, keep their content at hand
+    for (int i = 0; i < ring_count && i < CONTENT_CACHE_WARM_ENTRIES; i++) {
+        if (ring_entries[i] >= 0) {
+            prefetch_entry_content(&entries[ring_entries[i]]);
+        }
+    }
     
     msg(LOG_DEBUG, "Loaded %d history entries", history_count);
     return history_count;
@@ -369,20 +451,314 @@ static void write_history_metadata(FILE *file, const history_metadata_t *metadat
             METADATA_PREFIX, metadata->max_lines, metadata->max_line_length);
 }
 
-static char* extract_display_content(const char *raw_content) {
-    if (!raw_content) return NULL;
+// an entry line is "[timestamp] [source] [APP:name] [OVERFLOW:hash] [TARGETS:mime=hash,...] [IMAGE:WxH] content"
+// where all markers are optional, returns where the content starts
+static const char* parse_entry_markers(const char *content_start, history_entry_t *entry) {
+    const char *position = content_start;
+    
+    for (;;) {
+        const char *marker_end = strchr(position, ']');
+        if (!marker_end) break;
+        
+        if (strncmp(position, "[OVERFLOW:", 10) == 0 && !entry->hash) {
+            size_t hash_length = marker_end - (position + 10);
+            if (hash_length > 23) hash_length = 23;
+            entry->hash = strndup(position + 10, hash_length);
+        } else if (strncmp(position, "[TARGETS:", 9) == 0 && !entry->targets) {
+            parse_targets_marker(position + 9, marker_end, entry);
+        } else if (strncmp(position, "[APP:", 5) == 0 && !entry->application) {
+            entry->application = strndup(position + 5, marker_end - (position + 5));
+        } else if (strncmp(position, "[IMAGE:", 7) == 0 && entry->image_width == 0) {
+            if (sscanf(position + 7, "%dx%d]", &entry->image_width, &entry->image_height) != 2) {
+                entry->image_width = 0;
+                entry->image_height = 0;
+            }
+        } else {
+            break;
+        }
+        
+        position = marker_end + 1;
+        if (*position == ' ') position++;
+    }
+    
+    return position;
+}
+
+static void parse_targets_marker(const char *targets_start, const char *targets_end, history_entry_t *entry) {
+    int capacity = 1;
+    for (const char *character = targets_start; character < targets_end; character++) {
+        if (*character == ',') capacity++;
+    }
     
-    const char *overflow_marker = "[OVERFLOW:";
-    const char *overflow_start = strstr(raw_content, overflow_marker);
+    entry->targets = calloc(capacity, sizeof(history_target_t));
+    if (!entry->targets) return;
     
-    if (overflow_start) {
-        const char *content_start = strchr(overflow_start, ']');
-        if (content_start && content_start[1] == ' ') {
-            return strdup(content_start + 2);
+    const char *target_start = targets_start;
+    while (target_start < targets_end && entry->target_count < capacity) {
+        const char *target_end = memchr(target_start, ',', targets_end - target_start);
+        if (!target_end) target_end = targets_end;
+        
+        const char *separator = memchr(target_start, '=', target_end - target_start);
+        if (separator && separator > target_start && separator + 1 < target_end) {
+            history_target_t *target = &entry->targets[entry->target_count];
+            target->mime_type = strndup(target_start, separator - target_start);
+            target->hash = strndup(separator + 1, target_end - separator - 1);
+            if (target->mime_type && target->hash) {
+                entry->target_count++;
+            } else {
+                free(target->mime_type);
+                free(target->hash);
+            }
         }
+        
+        target_start = target_end + 1;
+    }
+}
+
+static char* format_targets_marker(const history_target_t *targets, int target_count) {
+    if (!targets || target_count < 1) return NULL;
+    
+    size_t marker_length = strlen("[TARGETS:]") + 1;
+    for (int i = 0; i < target_count; i++) {
+        marker_length += strlen(targets[i].mime_type) + strlen(targets[i].hash) + 2;
+    }
+    
+    char *marker = malloc(marker_length);
+    if (!marker) return NULL;
+    
+    char *write_position = marker + sprintf(marker, "[TARGETS:");
+    for (int i = 0; i < target_count; i++) {
+        write_position += sprintf(write_position, "%s%s=%s", i > 0 ? "," : "",
+                                  targets[i].mime_type, targets[i].hash);
     }
+    strcpy(write_position, "]");
     
-    return strdup(raw_content);
+    return marker;
+}
+
+// returns a copy of the marker that starts with prefix ("[TARGETS:", "[APP:", ...),
+// only the markers in front of the content are looked at
+static char* extract_marker(const char *line, const char *prefix) {
+    const char *source_end = strchr(line, ']');
+    if (source_end) source_end = strchr(source_end + 1, ']');
+    if (!source_end || !source_end[1]) return NULL;
+    
+    const char *markers_start = source_end + 2;
+    history_entry_t markers = {0};
+    const char *content_start = parse_entry_markers(markers_start, &markers);
+    history_free_entry(&markers);
+    
+    size_t prefix_length = strlen(prefix);
+    const char *position = markers_start;
+    while (position < content_start) {
+        const char *marker_end = strchr(position, ']');
+        if (!marker_end) break;
+        
+        if (strncmp(position, prefix, prefix_length) == 0) {
+            return strndup(position, marker_end - position + 1);
+        }
+        
+        position = marker_end + 1;
+        if (*position == ' ') position++;
+    }
+    return NULL;
+}
+
+// blobs are shared between entries with identical content
+static int is_blob_referenced(const char *hash, int ignored_index) {
+    for (int i = 0; i < history_count; i++) {
+        if (i == ignored_index) continue;
+        
+        if (entries[i].hash && strcmp(entries[i].hash, hash) == 0) return 1;
+        for (int j = 0; j < entries[i].target_count; j++) {
+            if (strcmp(entries[i].targets[j].hash, hash) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+static history_ring_t entry_ring(const char *source) {
+    return source && strcmp(source, "PRIMARY") == 0 ? HISTORY_RING_PRIMARY : HISTORY_RING_CLIPBOARD;
+}
+
+static void build_ring_view(void) {
+    free(ring_entries);
+    int capacity = history_count + sensitive_count;
+    ring_entries = capacity > 0 ? malloc(capacity * sizeof(int)) : NULL;
+    ring_count = 0;
+    
+    // sensitive entries are merged in by their timestamp
+    int file_position = history_count - 1;
+    int sensitive_position = sensitive_count - 1;
+    while (ring_entries && (file_position >= 0 || sensitive_position >= 0)) {
+        const history_entry_t *entry;
+        int ring_index;
+        
+        if (sensitive_position >= 0 && (file_position < 0 || !entries[file_position].timestamp ||
+            strcmp(sensitive_entries[sensitive_position].entry.timestamp, entries[file_position].timestamp) >= 0)) {
+            entry = &sensitive_entries[sensitive_position].entry;
+            ring_index = -(sensitive_position + 1);
+            sensitive_position--;
+        } else {
+            entry = &entries[file_position];
+            ring_index = file_position;
+            file_position--;
+        }
+        
+        if (entry_ring(entry->source) == current_ring) {
+            ring_entries[ring_count++] = ring_index;
+        }
+    }
+}
+
+static history_entry_t* ring_entry(int index) {
+    int ring_index = ring_entries[index];
+    return ring_index >= 0 ? &entries[ring_index] : &sensitive_entries[-ring_index - 1].entry;
+}
+
+static void free_sensitive_entry(sensitive_entry_t *sensitive_entry) {
+    if (sensitive_entry->text) {
+        explicit_bzero(sensitive_entry->text, sensitive_entry->text_length);
+        free(sensitive_entry->text);
+    }
+    history_free_entry(&sensitive_entry->entry);
+    memset(sensitive_entry, 0, sizeof(*sensitive_entry));
+}
+
+static void remove_sensitive_entry(int position) {
+    free_sensitive_entry(&sensitive_entries[position]);
+    memmove(&sensitive_entries[position], &sensitive_entries[position + 1],
+            (sensitive_count - position - 1) * sizeof(sensitive_entry_t));
+    sensitive_count--;
+    memset(&sensitive_entries[sensitive_count], 0, sizeof(sensitive_entry_t));
+}
+
+// entry->content is what the popup shows instead of the text
+int history_add_sensitive_entry(const history_entry_t *new_entry, const char *text, long long expires) {
+    pthread_mutex_lock(&history_mutex);
+    int result = add_sensitive_entry(new_entry, text, expires);
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+    return result;
+}
+
+static int add_sensitive_entry(const history_entry_t *new_entry, const char *text, long long expires) {
+    if (!new_entry->content || !text || !text[0]) return 0;
+    
+    // the same secret copied again only moves to the front
+    for (int i = 0; i < sensitive_count; i++) {
+        if (strcmp(sensitive_entries[i].text, text) == 0) {
+            remove_sensitive_entry(i);
+            break;
+        }
+    }
+    if (sensitive_count == MAX_SENSITIVE_ENTRIES) {
+        remove_sensitive_entry(0);
+    }
+    
+    char timestamp[32];
+    get_timestamp(timestamp, sizeof(timestamp));
+    
+    sensitive_entry_t *sensitive_entry = &sensitive_entries[sensitive_count];
+    sensitive_entry->entry.content = strdup(new_entry->content);
+    sensitive_entry->entry.timestamp = strdup(timestamp);
+    sensitive_entry->entry.source = strdup(new_entry->source);
+    sensitive_entry->entry.application = new_entry->application ? strdup(new_entry->application) : NULL;
+    sensitive_entry->entry.sensitive = 1;
+    sensitive_entry->text_length = strlen(text);
+    sensitive_entry->text = strdup(text);
+    sensitive_entry->expires = expires;
+    
+    if (!sensitive_entry->entry.content || !sensitive_entry->entry.timestamp ||
+        !sensitive_entry->entry.source || !sensitive_entry->text) {
+        free_sensitive_entry(sensitive_entry);
+        return 0;
+    }
+    sensitive_count++;
+    
+    if (history_count < 1) {
+        load_history_entries();
+    } else {
+        build_ring_view();
+    }
+    
+    msg(LOG_NOTICE, "Keeping sensitive %s entry in memory only", new_entry->source);
+    return 1;
+}
+
+// returns when the next sensitive entry expires
+long long history_expire_sensitive_entries(long long now) {
+    long long next_expiry = LLONG_MAX;
+    int expired_count = 0;
+    
+    // the main thread may be copying the text of an entry for a paste
+    pthread_mutex_lock(&history_mutex);
+    
+    for (int i = 0; i < sensitive_count; ) {
+        if (sensitive_entries[i].expires <= now) {
+            remove_sensitive_entry(i);
+            expired_count++;
+            continue;
+        }
+        if (sensitive_entries[i].expires < next_expiry) {
+            next_expiry = sensitive_entries[i].expires;
+        }
+        i++;
+    }
+    
+    if (expired_count > 0) {
+        msg(LOG_NOTICE, "Forgot %d sensitive %s", expired_count, expired_count == 1 ? "entry" : "entries");
+        build_ring_view();
+        if (current_index >= ring_count) {
+            current_index = -1;
+        }
+    }
+    pthread_mutex_unlock(&history_mutex);
+    
+    return next_expiry;
+}
+
+static int is_duplicate_entry(const history_entry_t *entry, const history_entry_t *new_entry) {
+    if (entry_ring(entry->source) != entry_ring(new_entry->source)) return 0;
+    
+    if (entry->image_width > 0 || new_entry->image_width > 0) {
+        // the description of two images can be the same
+        const char *image_hash = history_entry_image_hash(entry);
+        const char *new_image_hash = history_entry_image_hash(new_entry);
+        return image_hash && new_image_hash && strcmp(image_hash, new_image_hash) == 0;
+    }
+    if (entry->hash) {
+        return new_entry->hash && strcmp(entry->hash, new_entry->hash) == 0;
+    }
+    return !new_entry->hash && strcmp(entry->content, new_entry->content) == 0;
+}
+
+static void collect_entry_blobs(const history_entry_t *entry, char ***hashes, int *hash_count) {
+    int required = *hash_count + entry->target_count + 1;
+    char **grown = realloc(*hashes, required * sizeof(char*));
+    if (!grown) return;
+    *hashes = grown;
+    
+    if (entry->hash) {
+        grown[(*hash_count)++] = strdup(entry->hash);
+    }
+    for (int i = 0; i < entry->target_count; i++) {
+        grown[(*hash_count)++] = strdup(entry->targets[i].hash);
+    }
+}
+
+// called after the history was reloaded, with the hashes of entries that
+// were dropped from it
+static void delete_unreferenced_blobs(char **hashes, int hash_count) {
+    for (int i = 0; i < hash_count; i++) {
+        if (hashes[i] && !is_blob_referenced(hashes[i], -1)) {
+            overflow_delete_file(hashes[i]);
+            content_cache_remove(hashes[i]);
+            thumbnail_delete(hashes[i]);
+        }
+        free(hashes[i]);
+    }
+    free(hashes);
 }
 
 int history_add_entry(const char *content, const char *source) {
@@ -393,17 +769,66 @@ int history_add_entry(const char *content, const char *source) {
     char *storage_content = text_truncate_for_storage(content, &overflow_hash);
     if (!storage_content) return 0;
     
+    history_entry_t entry = { .content = storage_content, .source = (char *)source, .hash = overflow_hash };
+    int result = history_add_truncated_entry(&entry);
+    
+    free(storage_content);
+    if (overflow_hash) free(overflow_hash);
+    return result;
+}
+
+// new_entry->content is already truncated for storage, its full content saved as new_entry->hash
+int history_add_truncated_entry(const history_entry_t *new_entry) {
+    pthread_mutex_lock(&history_mutex);
+    int result = add_entry(new_entry, 0);
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+    return result;
+}
+
+// like history_add_truncated_entry, but the new entry takes the place of
+// the newest entry of its ring
+int history_replace_newest_entry(const history_entry_t *new_entry) {
+    pthread_mutex_lock(&history_mutex);
+    int result = add_entry(new_entry, 1);
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+    return result;
+}
+
+static int add_entry(const history_entry_t *new_entry, int replace_newest) {
+    const char *storage_content = new_entry->content;
+    const char *overflow_hash = new_entry->hash;
+    const char *source = new_entry->source;
+    
+    if (!storage_content || strlen(storage_content) == 0) return 0;
+    if (!config.history_file) return 0;
+    
     if (!text_contains_non_whitespace(storage_content)) {
-        free(storage_content);
-        if (overflow_hash) free(overflow_hash);
         return 0;
     }
     
+    // the PRIMARY ring is bounded, its oldest entries make room for the new one
+    if (history_count < 1) load_history_entries();
+    history_ring_t new_ring = entry_ring(source);
+    int ring_total = 0;
+    int ring_kept = 0;
+    int newest_is_duplicate = 0;
+    for (int i = 0; i < history_count; i++) {
+        if (entry_ring(entries[i].source) != new_ring) continue;
+        ring_total++;
+        newest_is_duplicate = is_duplicate_entry(&entries[i], new_entry);
+        if (!newest_is_duplicate) ring_kept++;
+    }
+    if (replace_newest && ring_total > 0 && !newest_is_duplicate) ring_kept--;
+    int ring_excess = new_ring == HISTORY_RING_PRIMARY ? ring_kept + 1 - config.primary_history_size : 0;
+    int ring_position = 0;
+    char **dropped_hashes = NULL;
+    int dropped_hash_count = 0;
+    
     char temporary_filename[] = ".history.tmp";
     FILE *temporary_file = fopen(temporary_filename, "w");
     if (!temporary_file) {
-        free(storage_content);
-        if (overflow_hash) free(overflow_hash);
         return 0;
     }
     
@@ -423,20 +848,23 @@ int history_add_entry(const char *content, const char *source) {
             
             history_entry_t entry = entry_parse(line);
             if (entry.content != NULL) {
-                int is_duplicate = 0;
+                int is_duplicate = is_duplicate_entry(&entry, new_entry);
+                int is_dropped = 0;
                 
-                char *entry_overflow_hash = extract_overflow_hash_from_line(line);
-                if (entry_overflow_hash) {
-                    if (overflow_hash && strcmp(entry_overflow_hash, overflow_hash) == 0) {
-                        is_duplicate = 1;
+                if (entry_ring(entry.source) == new_ring) {
+                    if (replace_newest && ring_position == ring_total - 1 && !is_duplicate) {
+                        is_dropped = 1;
+                    } else if (!is_duplicate && ring_excess > 0) {
+                        ring_excess--;
+                        is_dropped = 1;
                     }
-                    free(entry_overflow_hash);
-                } else {
-                    is_duplicate = (strcmp(entry.content, content) == 0);
+                    ring_position++;
                 }
                 
                 if (is_duplicate) {
                     duplicate_found = 1;
+                } else if (is_dropped) {
+                    collect_entry_blobs(&entry, &dropped_hashes, &dropped_hash_count);
                 } else {
                     if (line[strlen(line) - 1] != '\n') {
                         fprintf(temporary_file, "%s\n", line);
@@ -445,9 +873,7 @@ int history_add_entry(const char *content, const char *source) {
                     }
                 }
                 
-                free(entry.content);
-                free(entry.timestamp);
-                free(entry.source);
+                history_free_entry(&entry);
             } else {
                 if (line[strlen(line) - 1] != '\n') {
                     fprintf(temporary_file, "%s\n", line);
@@ -469,12 +895,23 @@ int history_add_entry(const char *content, const char *source) {
     
     char *escaped_content = transform_content_escaping(storage_content, 1);
     if (escaped_content) {
+        char *targets_marker = format_targets_marker(new_entry->targets, new_entry->target_count);
+        
+        fprintf(temporary_file, "[%s] [%s] ", timestamp, source);
+        if (new_entry->application && new_entry->application[0]) {
+            fprintf(temporary_file, "[APP:%s] ", new_entry->application);
+        }
         if (overflow_hash) {
-            fprintf(temporary_file, "[%s] [%s] [OVERFLOW:%s] %s\n", 
-                    timestamp, source, overflow_hash, escaped_content);
-        } else {
-            fprintf(temporary_file, "[%s] [%s] %s\n", timestamp, source, escaped_content);
+            fprintf(temporary_file, "[OVERFLOW:%s] ", overflow_hash);
+        }
+        if (targets_marker) {
+            fprintf(temporary_file, "%s ", targets_marker);
+            free(targets_marker);
+        }
+        if (new_entry->image_width > 0) {
+            fprintf(temporary_file, "[IMAGE:%dx%d] ", new_entry->image_width, new_entry->image_height);
         }
+        fprintf(temporary_file, "%s\n", escaped_content);
         free(escaped_content);
     }
     
@@ -482,8 +919,8 @@ cleanup:
     fclose(temporary_file);
     
     if (!replace_file_atomically(temporary_filename, config.history_file)) {
-        free(storage_content);
-        if (overflow_hash) free(overflow_hash);
+        for (int i = 0; i < dropped_hash_count; i++) free(dropped_hashes[i]);
+        free(dropped_hashes);
         return 0;
     }
       
@@ -497,14 +934,14 @@ cleanup:
             strlen(storage_content) > 50 ? "..." : "");
     }
 
-    free(storage_content);
-    if (overflow_hash) free(overflow_hash);
     load_history_entries();
+    delete_unreferenced_blobs(dropped_hashes, dropped_hash_count);
 
     return 1;
 }
 
 char* history_get_entry_truncated(int index) {
+    pthread_mutex_lock(&history_mutex);
     if (history_count < 1) {
         load_history_entries();
     }
@@ -513,17 +950,48 @@ char* history_get_entry_truncated(int index) {
         index = 0;  // Default to newest entry
     }
     
-    if (index < 0 || index >= history_count) {
-        return NULL;
+    char *content = index < ring_count ? strdup(ring_entry(index)->content) : NULL;
+    pthread_mutex_unlock(&history_mutex);
+    return content;
+}
+
+char* history_get_entry_full_content(int index) {
+    pthread_mutex_lock(&history_mutex);
+    if (history_count < 1) {
+        load_history_entries();
+    }
+    
+    if (index < 0) {
+        index = 0;
     }
     
-    // Reverse the index to get newest-first ordering
-    int actual_index = history_count - 1 - index;
+    char *content = NULL;
+    if (index >= ring_count) {
+        content = NULL;
+    } else if (ring_entries[index] < 0) {
+        content = strdup(sensitive_entries[-ring_entries[index] - 1].text);
+    } else {
+        const history_entry_t *entry = &entries[ring_entries[index]];
+        if (entry->hash) {
+            content = load_overflow_content_by_hash(entry->hash);
+        }
+        if (!content) {
+            content = strdup(entry->content);
+        }
+    }
     
-    return strdup(entries[actual_index].content);
+    pthread_mutex_unlock(&history_mutex);
+    return content;
 }
 
-char* history_get_entry_full_content(int index) {
+history_entry_t* history_copy_entry(int index) {
+    pthread_mutex_lock(&history_mutex);
+    history_entry_t *entry = copy_entry(index);
+    pthread_mutex_unlock(&history_mutex);
+    return entry;
+}
+
+static history_entry_t* copy_entry(int index) {
     if (history_count < 1) {
         load_history_entries();
     }
@@ -532,29 +1000,112 @@ char* history_get_entry_full_content(int index) {
         index = 0;
     }
     
-    if (index < 0 || index >= history_count) {
+    if (index >= ring_count) {
         return NULL;
     }
     
-    int actual_index = history_count - 1 - index;
+    return history_duplicate_entry(ring_entry(index));
+}
+
+history_entry_t* history_duplicate_entry(const history_entry_t *source_entry) {
+    history_entry_t *entry = calloc(1, sizeof(history_entry_t));
+    if (!entry) return NULL;
+    
+    entry->content = source_entry->content ? strdup(source_entry->content) : NULL;
+    entry->timestamp = source_entry->timestamp ? strdup(source_entry->timestamp) : NULL;
+    entry->source = source_entry->source ? strdup(source_entry->source) : NULL;
+    entry->application = source_entry->application ? strdup(source_entry->application) : NULL;
+    entry->hash = source_entry->hash ? strdup(source_entry->hash) : NULL;
+    entry->image_width = source_entry->image_width;
+    entry->image_height = source_entry->image_height;
+    entry->sensitive = source_entry->sensitive;
+    
+    if (source_entry->target_count > 0) {
+        entry->targets = calloc(source_entry->target_count, sizeof(history_target_t));
+        if (entry->targets) {
+            for (int i = 0; i < source_entry->target_count; i++) {
+                entry->targets[i].mime_type = strdup(source_entry->targets[i].mime_type);
+                entry->targets[i].hash = strdup(source_entry->targets[i].hash);
+                entry->target_count++;
+            }
+        }
+    }
     
-    if (entries[actual_index].hash) {
-        char* content = load_overflow_content_by_hash(entries[actual_index].hash);
-        if (content) {
-            return content;
+    return entry;
+}
+
+// returns the blob hash of the image of an image entry
+char* history_get_entry_image(int index) {
+    pthread_mutex_lock(&history_mutex);
+    if (history_count < 1) {
+        load_history_entries();
+    }
+    
+    if (index < 0) {
+        index = 0;
+    }
+    
+    const char *image_hash = index < ring_count ? history_entry_image_hash(ring_entry(index)) : NULL;
+    char *image = image_hash ? strdup(image_hash) : NULL;
+    pthread_mutex_unlock(&history_mutex);
+    return image;
+}
+
+const char* history_entry_image_hash(const history_entry_t *entry) {
+    if (!entry || entry->image_width <= 0) return NULL;
+    
+    for (int i = 0; i < entry->target_count; i++) {
+        if (strcmp(entry->targets[i].mime_type, "image/png") == 0) {
+            return entry->targets[i].hash;
         }
     }
+    return NULL;
+}
+
+// frees the members of an entry, not the entry itself
+void history_free_entry(history_entry_t *entry) {
+    if (!entry) return;
+    
+    free(entry->content);
+    free(entry->timestamp);
+    free(entry->source);
+    free(entry->hash);
+    free(entry->application);
+    
+    for (int i = 0; i < entry->target_count; i++) {
+        free(entry->targets[i].mime_type);
+        free(entry->targets[i].hash);
+    }
+    free(entry->targets);
     
-    return strdup(entries[actual_index].content);
+    memset(entry, 0, sizeof(*entry));
 }
 
 int history_delete_entry(int index) {
+    pthread_mutex_lock(&history_mutex);
+    int result = delete_entry(index);
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+    return result;
+}
+
+static int delete_entry(int index) {
     if (history_count < 1) load_history_entries();
-    if (history_count < 1 || index < 0 || index >= history_count) {
+    if (ring_count < 1 || index < 0 || index >= ring_count) {
         return 0;
     }
     
-    int actual_index = history_count - 1 - index;
+    if (ring_entries[index] < 0) {
+        remove_sensitive_entry(-ring_entries[index] - 1);
+        build_ring_view();
+        if (current_index >= ring_count) {
+            current_index = -1;
+        }
+        msg(LOG_NOTICE, "Deleted sensitive history entry %d", index + 1);
+        return 1;
+    }
+    
+    int actual_index = ring_entries[index];
     
     char temp_filename[] = ".history.tmp";
     FILE *temp_file = fopen(temp_filename, "w");
@@ -573,7 +1124,19 @@ int history_delete_entry(int index) {
     char line[8192];
     int current_line_index = 0;
     int deleted = 0;
-    char *overflow_hash_to_delete = entries[actual_index].hash ? strdup(entries[actual_index].hash) : NULL;
+    char *overflow_hash_to_delete = NULL;
+    if (entries[actual_index].hash && !is_blob_referenced(entries[actual_index].hash, actual_index)) {
+        overflow_hash_to_delete = strdup(entries[actual_index].hash);
+    }
+    
+    int target_count = entries[actual_index].target_count;
+    char **target_hashes_to_delete = target_count > 0 ? calloc(target_count, sizeof(char*)) : NULL;
+    for (int i = 0; target_hashes_to_delete && i < target_count; i++) {
+        const char *target_hash = entries[actual_index].targets[i].hash;
+        if (!is_blob_referenced(target_hash, actual_index)) {
+            target_hashes_to_delete[i] = strdup(target_hash);
+        }
+    }
     
     if (fgets(line, sizeof(line), history_file)) {
         fputs(line, temp_file);
@@ -599,22 +1162,21 @@ int history_delete_entry(int index) {
     fclose(temp_file);
     
     if (deleted) {
-        if (overflow_hash_to_delete && config.overflow_directory) {
-            char overflow_file_path[PATH_MAX];
-            snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s", 
-                    config.overflow_directory, overflow_hash_to_delete);
-            
-            if (unlink(overflow_file_path) == 0) {
-                msg(LOG_DEBUG, "Deleted overflow file: %s", overflow_file_path);
-            } else {
-                msg(LOG_WARNING, "Failed to delete overflow file: %s", overflow_file_path);
-            }
-        }
-        
         if (overflow_hash_to_delete) {
+            overflow_delete_file(overflow_hash_to_delete);
+            content_cache_remove(overflow_hash_to_delete);
             free(overflow_hash_to_delete);
         }
         
+        for (int i = 0; target_hashes_to_delete && i < target_count; i++) {
+            if (target_hashes_to_delete[i]) {
+                overflow_delete_file(target_hashes_to_delete[i]);
+                thumbnail_delete(target_hashes_to_delete[i]);
+                free(target_hashes_to_delete[i]);
+            }
+        }
+        free(target_hashes_to_delete);
+        
         if (!replace_file_atomically(temp_filename, config.history_file)) {
             msg(LOG_ERR, "Failed to replace history file after deletion");
             return 0;
@@ -622,7 +1184,7 @@ int history_delete_entry(int index) {
         
         load_history_entries();
         
-        if (current_index >= history_count) {
+        if (current_index >= ring_count) {
             current_index = -1;
         }
         
@@ -631,13 +1193,17 @@ int history_delete_entry(int index) {
         if (overflow_hash_to_delete) {
             free(overflow_hash_to_delete);
         }
+        for (int i = 0; target_hashes_to_delete && i < target_count; i++) {
+            free(target_hashes_to_delete[i]);
+        }
+        free(target_hashes_to_delete);
         unlink(temp_filename);
         return 0;
     }
 }
 
 static history_entry_t entry_parse(const char *line) {
-    history_entry_t entry = {NULL, NULL, NULL, NULL};
+    history_entry_t entry = {NULL, NULL, NULL, NULL, NULL, 0, 0, 0, NULL, 0};
     
     char *line_copy = strdup(line);
     if (!line_copy) return entry;
@@ -672,28 +1238,42 @@ static history_entry_t entry_parse(const char *line) {
     strncpy(entry.source, source_start + 1, source_length);
     entry.source[source_length] = '\0';
     
-    entry.hash = extract_overflow_hash_from_line(content_start);
-    
-    char *display_content = extract_display_content(content_start);
+    const char *display_content = parse_entry_markers(content_start, &entry);
     entry.content = transform_content_escaping(display_content, 0);
-    free(display_content);
     free(line_copy);
 
     return entry;
 }
 
 void history_cleanup(void) {
+    pthread_mutex_lock(&history_mutex);
+    if (prefetch_timer && g_reactor) {
+        reactor_cancel_timer(g_reactor, prefetch_timer);
+        prefetch_timer = 0;
+    }
+    
     if (entries) {
         for (int i = 0; i < history_count; i++) {
-            free(entries[i].content);
-            free(entries[i].timestamp);
-            free(entries[i].source);
-            free(entries[i].hash);
+            history_free_entry(&entries[i]);
         }
         free(entries);
         entries = NULL;
     }
     history_count = 0;
+    
+    free(ring_entries);
+    ring_entries = NULL;
+    ring_count = 0;
+    
+    while (sensitive_count > 0) {
+        remove_sensitive_entry(sensitive_count - 1);
+    }
+    
+    while (prefetch_count > 0) {
+        free(prefetch_hashes[--prefetch_count]);
+    }
+    content_cache_clear();
+    pthread_mutex_unlock(&history_mutex);
 }
 
 char* history_get_default_file_path(void) {
@@ -716,39 +1296,88 @@ char* history_get_default_file_path(void) {
 }
 
 int history_get_count(void) {
+    pthread_mutex_lock(&history_mutex);
     if (history_count < 1) {
         load_history_entries();
     }
-    return history_count;
+    int count = ring_count;
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+    return count;
 }
 
 
 void history_set_current_index(int index) {
-    if (index >= 0 && index < history_count) {
+    pthread_mutex_lock(&history_mutex);
+    if (index >= 0 && index < ring_count) {
         current_index = index;
         msg(LOG_DEBUG, "Set current history index to %d (entry %d/%d)", 
-            index, index + 1, history_count);
+            index, index + 1, ring_count);
+        
+        // an entry shown in the popup may be pasted when Control is released,
+        // read it once the user stops on it rather than on every step
+        if (ring_entries[index] >= 0 && g_reactor) {
+            if (prefetch_timer) reactor_cancel_timer(g_reactor, prefetch_timer);
+            prefetch_timer = reactor_add_timer(g_reactor, PREFETCH_DELAY_MS,
+                                               prefetch_current_entry, NULL);
+        }
     } else if (index == -1) {
         current_index = -1;
         msg(LOG_DEBUG, "Reset current history index to -1");
     } else {
         msg(LOG_WARNING, "Attempted to set invalid history index %d (count: %d)", 
-            index, history_count);
+            index, ring_count);
     }
+    pthread_mutex_unlock(&history_mutex);
 }
 
 int history_get_current_index(void) {
-    return current_index;
+    pthread_mutex_lock(&history_mutex);
+    int index = current_index;
+    pthread_mutex_unlock(&history_mutex);
+    return index;
 }
 
 void history_reset_navigation(void) {
+    pthread_mutex_lock(&history_mutex);
     current_index = -1;
+    int switch_ring = current_ring != HISTORY_RING_CLIPBOARD;
+    pthread_mutex_unlock(&history_mutex);
+    
+    if (switch_ring) {
+        history_set_ring(HISTORY_RING_CLIPBOARD);
+    }
+}
+
+// switches the ring the index based functions operate on
+void history_set_ring(history_ring_t ring) {
+    pthread_mutex_lock(&history_mutex);
+    current_ring = ring;
+    current_index = -1;
+    
+    if (history_count < 1) {
+        load_history_entries();
+    } else {
+        build_ring_view();
+    }
+    msg(LOG_DEBUG, "Browsing the %s ring (%d entries)",
+        ring == HISTORY_RING_PRIMARY ? "PRIMARY" : "CLIPBOARD", ring_count);
+    pthread_mutex_unlock(&history_mutex);
+    read_prefetched_content();
+}
+
+history_ring_t history_get_ring(void) {
+    pthread_mutex_lock(&history_mutex);
+    history_ring_t ring = current_ring;
+    pthread_mutex_unlock(&history_mutex);
+    return ring;
 }
 
 int history_initialize(void) {
     entries = NULL;
     history_count = 0;
     current_index = -1;
+    current_ring = HISTORY_RING_CLIPBOARD;
     
     return 1;
 }
@@ -6,13 +6,33 @@
 
 
 
+// additional representation of an entry (text/html, image/png, ...)
+// stored as a blob in the overflow directory
+typedef struct {
+    char *mime_type;
+    char *hash;
+} history_target_t;
+
 typedef struct {
     char *content;
     char *timestamp;
     char *source;
     char *hash;
+    history_target_t *targets;
+    int target_count;
+    int image_width;           // set for image entries, content is only a description then
+    int image_height;
+    char *application;         // WM_CLASS (or process name) of the owner it was captured from
+    int sensitive;             // marked by a password manager, only kept in memory
 } history_entry_t;
 
+// PRIMARY selections are kept in a ring of their own, the index based
+// functions below operate on the ring that is browsed
+typedef enum {
+    HISTORY_RING_CLIPBOARD = 0,
+    HISTORY_RING_PRIMARY
+} history_ring_t;
+
 typedef struct {
     int max_lines;
     int max_line_length;
@@ -24,8 +44,17 @@ void history_cleanup(void);
 
 // Entry operations
 int history_add_entry(const char *content, const char *source);
+int history_add_truncated_entry(const history_entry_t *entry);
+int history_replace_newest_entry(const history_entry_t *entry);
+int history_add_sensitive_entry(const history_entry_t *entry, const char *text, long long expires);
+long long history_expire_sensitive_entries(long long now);
 char* history_get_entry_truncated(int index);
 char* history_get_entry_full_content(int index);
+history_entry_t* history_copy_entry(int index);
+history_entry_t* history_duplicate_entry(const history_entry_t *entry);
+char* history_get_entry_image(int index);
+const char* history_entry_image_hash(const history_entry_t *entry);
+void history_free_entry(history_entry_t *entry);
 int history_delete_entry(int index);
 int history_get_count(void);
 
@@ -33,6 +62,8 @@ int history_get_count(void);
 void history_set_current_index(int index);
 int history_get_current_index(void);
 void history_reset_navigation(void);
+void history_set_ring(history_ring_t ring);
+history_ring_t history_get_ring(void);
 
 // File operations
 char* history_get_default_file_path(void);
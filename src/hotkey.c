@@ -10,10 +10,13 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/record.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/Xproto.h>
 #include <X11/XKBlib.h>
 #include <sys/syslog.h>
@@ -21,10 +24,49 @@
 #include "halen.h"
 #include "hotkey.h"
 #include "popup.h"
+#include "latency.h"
+
+// a replayed paste that isn't seen back within this time is given up
+// and Ctrl+V grabbed again
+#define PASTE_TIMEOUT_MS 500
+
+// the replayed Ctrl+V is sent in one go, XRecord reports the fake events
+// back once the server has delivered them. Ctrl+V is grabbed again when
+// the V release is seen, the paste is complete with the Control release
+typedef enum {
+    PASTE_IDLE = 0,
+    PASTE_AWAIT_V_RELEASE,
+    PASTE_AWAIT_CONTROL_RELEASE
+} paste_state_t;
+
+// what a key does while Control is held, the keys come from the config
+typedef enum {
+    KEY_ACTION_NONE = 0,
+    KEY_ACTION_PASTE,       // Ctrl+V, and next entry while the popup shows
+    KEY_ACTION_PREVIOUS,
+    KEY_ACTION_CUT,
+    KEY_ACTION_CANCEL,
+    KEY_ACTION_DELETE,
+    KEY_ACTION_RING,
+    KEY_ACTION_COUNT
+} key_action_t;
+
+#define GRAB_MODIFIER_COUNT 4
+
+// the work behind a key (history reads, redraws, setting the clipboard)
+// runs from the event loop once the keyboard is thawed, in the order the
+// keys came in. A job sees the popup action and direction of its key
+#define JOB_QUEUE_SIZE 32
+
+typedef struct {
+    const char *event_type;         // NULL hides the popup
+    long long queued_at;
+    PopupAction popup_action;
+    nav_direction_t nav_direction;
+} hotkey_job_t;
 
 static Display *record_display = NULL;
 static hotkey_callback_t main_callback = NULL;
-static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int is_monitoring = 0;
 static int monitoring_enabled = 1;
@@ -32,123 +74,243 @@ static pthread_t xrecord_thread;
 static PopupAction popup_action = POPUP_ACTION_NONE;
 static int ctrl_pressed = 0;
 static volatile int ctrl_v_count = 0;
-static volatile int replaying_paste = 0;  // Volatile flag for XRecord loop
+static volatile paste_state_t paste_state = PASTE_IDLE;
+static KeyCode paste_v_keycode = 0;
+static KeyCode paste_control_keycode = 0;
+static int paste_timer = 0;
+static long long control_released_at = 0;
+static unsigned long paste_count = 0;
+static unsigned long paste_timeouts = 0;
+static long long paste_latency_total = 0;
+static long long paste_latency_max = 0;
 static XRecordContext record_context = 0;
 static volatile int ctrl_v_blocked = 0;
 static volatile int pending_ctrl_v = 0;
 static nav_direction_t current_nav_direction = NAV_DIRECTION_NEXT;
 
+// built from the keyboard mapping, rebuilt when it or the group changes
+static key_action_t keycode_actions[256];
+static KeyCode action_keycodes[KEY_ACTION_COUNT];
+static KeyCode control_keycode = 0;
+static unsigned char control_keycodes[256 / 8];   // bitmap, every key that is Control
+static unsigned long key_events_filtered = 0;
+static unsigned long key_events_handled = 0;
+static unsigned int grab_modifiers[GRAB_MODIFIER_COUNT];
+static int xkb_event_base = -1;
+static int keyboard_group = 0;
+
+// with XInput2 raw events the Control key is tracked on g_display, there
+// is no XRecord connection or thread
+static int xi_opcode = -1;
+static int raw_key_events = 0;
+
+// the XRecord thread doesn't touch any state, it queues the key events
+// and the main loop handles them, so g_display is only used from the main
+// thread. One producer, one consumer, the eventfd wakes the loop up
+#define KEY_QUEUE_SIZE 256
+
+typedef struct {
+    unsigned char keycode;
+    unsigned char is_press;
+} queued_key_t;
+
+static queued_key_t key_queue[KEY_QUEUE_SIZE];
+static unsigned int key_queue_head = 0;    // written by the XRecord thread
+static unsigned int key_queue_tail = 0;    // written by the main thread
+static int key_queue_fd = -1;
+static unsigned long key_queue_overflows = 0;
+
+static hotkey_job_t job_queue[JOB_QUEUE_SIZE];
+static int job_queue_start = 0;
+static int job_queue_count = 0;
+static int job_timer = 0;
+static PopupAction job_popup_action = POPUP_ACTION_NONE;
+static nav_direction_t job_nav_direction = NAV_DIRECTION_NEXT;
+
 static void* xrecord_thread_func(void* arg);
 static void record_callback(XPointer closure, XRecordInterceptData *data);
+static int select_raw_key_events(void);
+static void queue_key_event(int is_press, KeyCode keycode);
+static void drain_key_queue(int fd, void *data);
+static void queue_job(const char *event_type);
+static void run_jobs(void *data);
+static void handle_key_event(int is_press, KeyCode keycode);
 static int setup_key_blocking(void);
 static void reset_state(void);
+static const char* action_key_name(key_action_t action);
+static KeyCode keycode_for_keysym(KeySym keysym);
+static unsigned int find_num_lock_mask(void);
+static void build_key_table(void);
+static void rebuild_key_table(void);
+static void grab_action_key(key_action_t action, int grab);
+static void grab_navigation_keys(void);
+static void ungrab_navigation_keys(void);
+static int handle_paste_event(int is_press, KeyCode keycode);
+static void finish_paste(int completed);
+static void expire_paste(void *data);
 
-static int setup_key_blocking(void) {
-    msg(LOG_NOTICE, "Setting up Ctrl+V key blocking");
+static const char* action_key_name(key_action_t action) {
+    switch (action) {
+        case KEY_ACTION_PASTE:    return config.key_paste;
+        case KEY_ACTION_PREVIOUS: return config.key_previous;
+        case KEY_ACTION_CUT:      return config.key_cut;
+        case KEY_ACTION_CANCEL:   return config.key_cancel;
+        case KEY_ACTION_DELETE:   return config.key_delete;
+        case KEY_ACTION_RING:     return config.key_ring;
+        default:                  return NULL;
+    }
+}
+
+// the key that produces the keysym in the active group, so bindings follow
+// the layout in use. Any key with the keysym if the group doesn't have it
+static KeyCode keycode_for_keysym(KeySym keysym) {
+    int minimum_keycode, maximum_keycode;
+    XDisplayKeycodes(g_display, &minimum_keycode, &maximum_keycode);
+    
+    KeySym lower_keysym, upper_keysym;
+    XConvertCase(keysym, &lower_keysym, &upper_keysym);
+    
+    for (int keycode = minimum_keycode; keycode <= maximum_keycode; keycode++) {
+        KeySym group_keysym = XkbKeycodeToKeysym(g_display, (KeyCode)keycode, keyboard_group, 0);
+        if (group_keysym != NoSymbol && (group_keysym == lower_keysym || group_keysym == upper_keysym)) {
+            return (KeyCode)keycode;
+        }
+    }
     
-    KeyCode v_keycode = XKeysymToKeycode(g_display, XK_v);
+    return XKeysymToKeycode(g_display, keysym);
+}
+
+// NumLock isn't Mod2 everywhere
+static unsigned int find_num_lock_mask(void) {
+    KeyCode num_lock_keycode = XKeysymToKeycode(g_display, XK_Num_Lock);
+    XModifierKeymap *modifier_map = XGetModifierMapping(g_display);
+    unsigned int mask = Mod2Mask;
+    
+    if (modifier_map && num_lock_keycode != 0) {
+        for (int modifier = 0; modifier < 8; modifier++) {
+            for (int i = 0; i < modifier_map->max_keypermod; i++) {
+                if (modifier_map->modifiermap[modifier * modifier_map->max_keypermod + i] == num_lock_keycode) {
+                    mask = 1U << modifier;
+                }
+            }
+        }
+    }
+    if (modifier_map) XFreeModifiermap(modifier_map);
     
-    if (v_keycode == 0) {
-        msg(LOG_ERR, "Failed to get V keycode");
-        return 0;
+    return mask;
+}
+
+static void build_key_table(void) {
+    memset(keycode_actions, 0, sizeof(keycode_actions));
+    memset(action_keycodes, 0, sizeof(action_keycodes));
+    
+    for (int action = KEY_ACTION_PASTE; action < KEY_ACTION_COUNT; action++) {
+        // the ring key is only bound when there is a PRIMARY history
+        if (action == KEY_ACTION_RING && !config.primary_history) continue;
+        
+        const char *name = action_key_name((key_action_t)action);
+        KeySym keysym = name ? XStringToKeysym(name) : NoSymbol;
+        KeyCode keycode = keysym != NoSymbol ? keycode_for_keysym(keysym) : 0;
+        if (keycode == 0) {
+            msg(LOG_WARNING, "No key for '%s' in the current keyboard mapping", name ? name : "");
+            continue;
+        }
+        if (keycode_actions[keycode] != KEY_ACTION_NONE) {
+            msg(LOG_WARNING, "Key '%s' is bound twice, ignoring the second binding", name);
+            continue;
+        }
+        
+        keycode_actions[keycode] = (key_action_t)action;
+        action_keycodes[action] = keycode;
     }
     
-    unsigned int modifier_combinations[] = {
-        ControlMask,
-        ControlMask | LockMask,
-        ControlMask | Mod2Mask,
-        ControlMask | LockMask | Mod2Mask
-    };
+    control_keycode = XKeysymToKeycode(g_display, XK_Control_L);
     
-    for (int i = 0; i < 4; i++) {
-        XGrabKey(g_display, v_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
+    // key events are only looked at further if the keycode is in here
+    memset(control_keycodes, 0, sizeof(control_keycodes));
+    int minimum_keycode, maximum_keycode;
+    XDisplayKeycodes(g_display, &minimum_keycode, &maximum_keycode);
+    for (int keycode = minimum_keycode; keycode <= maximum_keycode; keycode++) {
+        KeySym keysym = XkbKeycodeToKeysym(g_display, (KeyCode)keycode, 0, 0);
+        if (keysym == XK_Control_L || keysym == XK_Control_R) {
+            control_keycodes[keycode / 8] |= (unsigned char)(1 << (keycode % 8));
+        }
     }
     
-    XFlush(g_display);
-    msg(LOG_NOTICE, "Ctrl+V key combinations blocked successfully");
+    unsigned int num_lock_mask = find_num_lock_mask();
+    grab_modifiers[0] = ControlMask;
+    grab_modifiers[1] = ControlMask | LockMask;
+    grab_modifiers[2] = ControlMask | num_lock_mask;
+    grab_modifiers[3] = ControlMask | LockMask | num_lock_mask;
     
-    return 1;
+    msg(LOG_DEBUG, "Key table built for group %d: paste %d, previous %d, cut %d, cancel %d, delete %d, ring %d",
+        keyboard_group, action_keycodes[KEY_ACTION_PASTE], action_keycodes[KEY_ACTION_PREVIOUS],
+        action_keycodes[KEY_ACTION_CUT], action_keycodes[KEY_ACTION_CANCEL],
+        action_keycodes[KEY_ACTION_DELETE], action_keycodes[KEY_ACTION_RING]);
 }
 
-static void grab_navigation_keys(void) {
-    KeyCode c_keycode = XKeysymToKeycode(g_display, XK_c);
-    KeyCode x_keycode = XKeysymToKeycode(g_display, XK_x);
-    KeyCode z_keycode = XKeysymToKeycode(g_display, XK_z);
-    KeyCode d_keycode = XKeysymToKeycode(g_display, XK_d);
+// the grabs are on keycodes, they move with the table
+static void rebuild_key_table(void) {
+    int paste_grabbed = monitoring_enabled && paste_state == PASTE_IDLE;
+    int navigation_grabbed = monitoring_enabled && ctrl_v_count >= 2;
     
-    if (c_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get C keycode for grabbing");
-        return;
-    }
+    if (paste_grabbed) grab_action_key(KEY_ACTION_PASTE, 0);
+    if (navigation_grabbed) ungrab_navigation_keys();
     
-    if (x_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get X keycode for grabbing");
-        return;
-    }
+    build_key_table();
     
-    if (z_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get Z keycode for grabbing");
-        return;
+    if (paste_grabbed) grab_action_key(KEY_ACTION_PASTE, 1);
+    if (navigation_grabbed) grab_navigation_keys();
+    XFlush(g_display);
+}
+
+static void grab_action_key(key_action_t action, int grab) {
+    KeyCode keycode = action_keycodes[action];
+    if (keycode == 0) return;
+    
+    for (int i = 0; i < GRAB_MODIFIER_COUNT; i++) {
+        if (grab) {
+            XGrabKey(g_display, keycode, grab_modifiers[i], g_root_window,
+                     True, GrabModeSync, GrabModeAsync);
+        } else {
+            XUngrabKey(g_display, keycode, grab_modifiers[i], g_root_window);
+        }
     }
+}
+
+static int setup_key_blocking(void) {
+    msg(LOG_NOTICE, "Setting up Ctrl+%s key blocking", config.key_paste);
     
-    if (d_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get D keycode for grabbing");
-        return;
+    if (action_keycodes[KEY_ACTION_PASTE] == 0) {
+        msg(LOG_ERR, "Failed to get the paste keycode");
+        return 0;
     }
     
-    unsigned int modifier_combinations[] = {
-        ControlMask,
-        ControlMask | LockMask,
-        ControlMask | Mod2Mask,
-        ControlMask | LockMask | Mod2Mask
-    };
+    grab_action_key(KEY_ACTION_PASTE, 1);
+    
+    XFlush(g_display);
+    msg(LOG_NOTICE, "Ctrl+%s key combinations blocked successfully", config.key_paste);
     
-    for (int i = 0; i < 4; i++) {
-        XGrabKey(g_display, c_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
-        XGrabKey(g_display, x_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
-        XGrabKey(g_display, z_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
-        XGrabKey(g_display, d_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
+    return 1;
+}
+
+static void grab_navigation_keys(void) {
+    for (int action = KEY_ACTION_PREVIOUS; action < KEY_ACTION_COUNT; action++) {
+        grab_action_key((key_action_t)action, 1);
     }
     XFlush(g_display);
-    msg(LOG_DEBUG, "Ctrl+C, Ctrl+X, Ctrl+Z, and Ctrl+D grabbed for popup navigation");
+    msg(LOG_DEBUG, "Navigation keys grabbed for popup navigation");
 }
 
 static void ungrab_navigation_keys(void) {
-    KeyCode c_keycode = XKeysymToKeycode(g_display, XK_c);
-    KeyCode x_keycode = XKeysymToKeycode(g_display, XK_x);
-    KeyCode z_keycode = XKeysymToKeycode(g_display, XK_z);
-    KeyCode d_keycode = XKeysymToKeycode(g_display, XK_d);
-    
-    if (c_keycode == 0 || x_keycode == 0 || z_keycode == 0 || d_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get keycode for ungrabbing");
-        return;
-    }
-    
-    unsigned int modifier_combinations[] = {
-        ControlMask,
-        ControlMask | LockMask,
-        ControlMask | Mod2Mask,
-        ControlMask | LockMask | Mod2Mask
-    };
-    
-    for (int i = 0; i < 4; i++) {
-        XUngrabKey(g_display, c_keycode, modifier_combinations[i], g_root_window);
-        XUngrabKey(g_display, x_keycode, modifier_combinations[i], g_root_window);
-        XUngrabKey(g_display, z_keycode, modifier_combinations[i], g_root_window);
-        XUngrabKey(g_display, d_keycode, modifier_combinations[i], g_root_window);
+    for (int action = KEY_ACTION_PREVIOUS; action < KEY_ACTION_COUNT; action++) {
+        grab_action_key((key_action_t)action, 0);
     }
     XFlush(g_display);
-    msg(LOG_DEBUG, "Ctrl+C, Ctrl+X, Ctrl+Z, and Ctrl+D ungrabbed - normal keys restored");
+    msg(LOG_DEBUG, "Navigation keys ungrabbed - normal keys restored");
 }
 
 void hotkey_toggle_monitoring(void) {
-    pthread_mutex_lock(&state_mutex);
-    
     monitoring_enabled = !monitoring_enabled;
     
     if (monitoring_enabled) {
@@ -166,19 +328,7 @@ void hotkey_toggle_monitoring(void) {
         msg(LOG_NOTICE, "Disabling hotkey monitoring");
         
         // Ungrab all keys
-        KeyCode v_keycode = XKeysymToKeycode(g_display, XK_v);
-        if (v_keycode != 0) {
-            unsigned int modifier_combinations[] = {
-                ControlMask,
-                ControlMask | LockMask,
-                ControlMask | Mod2Mask,
-                ControlMask | LockMask | Mod2Mask
-            };
-            
-            for (int i = 0; i < 4; i++) {
-                XUngrabKey(g_display, v_keycode, modifier_combinations[i], g_root_window);
-            }
-        }
+        grab_action_key(KEY_ACTION_PASTE, 0);
         
         // Ungrab navigation keys if they were grabbed
         if (ctrl_v_count >= 2) {
@@ -189,8 +339,6 @@ void hotkey_toggle_monitoring(void) {
         reset_state();
         XFlush(g_display);
     }
-    
-    pthread_mutex_unlock(&state_mutex);
 }
 
 void hotkey_handle_xevent(XEvent *event) {
@@ -200,125 +348,161 @@ void hotkey_handle_xevent(XEvent *event) {
         return;
     }
     
-    if (replaying_paste) {
+    if (paste_state != PASTE_IDLE) {
         XAllowEvents(g_display, SyncKeyboard, event->xkey.time);
         XFlush(g_display);
         return;
     }
     
     if (event->type == KeyPress || event->type == KeyRelease) {
-        int is_press = (event->type == KeyPress);
-        KeySym keysym = XkbKeycodeToKeysym(g_display, event->xkey.keycode, 0, 0);
+        // the grab froze the keyboard, it is thawed before anything else
+        XAllowEvents(g_display, SyncKeyboard, event->xkey.time);
+        XFlush(g_display);
         
-        if (is_press && keysym == XK_v) {
-            pthread_mutex_lock(&state_mutex);
-            
-            ctrl_v_count++;
-            msg(LOG_NOTICE, "Blocked Ctrl+V (count: %d) - waiting for Control release", ctrl_v_count);
-            
-            if (ctrl_v_count == 1) {
-                pending_ctrl_v = 1;
-                ctrl_v_blocked = 1;
-                popup_action = POPUP_ACTION_NONE;
-                msg(LOG_DEBUG, "First Ctrl+V - will replay on Control release");
-            } else if (ctrl_v_count == 2) {
-                pending_ctrl_v = 0;
-                ctrl_v_blocked = 0;
-                popup_action = POPUP_ACTION_NEXT;
-                msg(LOG_DEBUG, "Second Ctrl+V - showing popup, action=NEXT");
-                
-                grab_navigation_keys();
+        key_action_t action = event->type == KeyPress ? keycode_actions[event->xkey.keycode] : KEY_ACTION_NONE;
+        
+        // everything but Ctrl+V only while the popup is showing
+        if (action != KEY_ACTION_PASTE && ctrl_v_count < 2) {
+            action = KEY_ACTION_NONE;
+        }
+        
+        switch (action) {
+            case KEY_ACTION_PASTE:
+                ctrl_v_count++;
+                msg(LOG_NOTICE, "Blocked Ctrl+%s (count: %d) - waiting for Control release", config.key_paste, ctrl_v_count);
                 
-                if (main_callback) {
-                    main_callback("double_paste");
+                if (ctrl_v_count == 1) {
+                    pending_ctrl_v = 1;
+                    ctrl_v_blocked = 1;
+                    popup_action = POPUP_ACTION_NONE;
+                    msg(LOG_DEBUG, "First Ctrl+%s - will replay on Control release", config.key_paste);
+                } else if (ctrl_v_count == 2) {
+                    pending_ctrl_v = 0;
+                    ctrl_v_blocked = 0;
+                    popup_action = POPUP_ACTION_NEXT;
+                    msg(LOG_DEBUG, "Second Ctrl+%s - showing popup, action=NEXT", config.key_paste);
+                    
+                    grab_navigation_keys();
+                    
+                    queue_job("double_paste");
+                } else {
+                    // v pressed while popup is showing
+                    popup_action = POPUP_ACTION_NEXT;
+                    msg(LOG_DEBUG, "Additional Ctrl+%s (count: %d) - action=NEXT", config.key_paste, ctrl_v_count);
+                    current_nav_direction = NAV_DIRECTION_NEXT;  // Explicitly set to NEXT
+                    queue_job("cb_clipboard_next");
                 }
-            } else if (ctrl_v_count >= 3) {
-                // v pressed while popup is showing
+                break;
+                
+            case KEY_ACTION_PREVIOUS:
+                popup_action = POPUP_ACTION_PREV;
+                current_nav_direction = NAV_DIRECTION_PREV;
+                msg(LOG_DEBUG, "Blocked Ctrl+%s - action=PREV", config.key_previous);
+                
+                queue_job("cb_clipboard_prev");
+                break;
+                
+            case KEY_ACTION_CUT:
+                popup_action = POPUP_ACTION_CUT;
+                msg(LOG_DEBUG, "Blocked Ctrl+%s - action=CUT", config.key_cut);
+                
+                queue_job("cb_clipboard_cut");
+                
+                ungrab_navigation_keys();
+                reset_state();
+                break;
+                
+            case KEY_ACTION_CANCEL:
+                msg(LOG_DEBUG, "Blocked Ctrl+%s - action=CANCEL (close popup and reset counter)", config.key_cancel);
+                popup_action = POPUP_ACTION_CANCEL;
+                queue_job("cb_clipboard_cancel");
+                
+                ungrab_navigation_keys();
+                reset_state();
+                break;
+                
+            case KEY_ACTION_DELETE:
+                msg(LOG_DEBUG, "Blocked Ctrl+%s - action=DELETE (delete current entry)", config.key_delete);
+                popup_action = POPUP_ACTION_DELETE;
+                
+                queue_job("cb_clipboard_delete");
+                break;
+                
+            case KEY_ACTION_RING:
+                // switch between the CLIPBOARD and PRIMARY history
                 popup_action = POPUP_ACTION_NEXT;
-                msg(LOG_DEBUG, "Additional Ctrl+V (count: %d) - action=NEXT", ctrl_v_count);
-                current_nav_direction = NAV_DIRECTION_NEXT;  // Explicitly set to NEXT
-                if (main_callback) {
-                    main_callback("cb_clipboard_next");
-                }
-            }
-            
-            pthread_mutex_unlock(&state_mutex);
-            
-        } else if (is_press && keysym == XK_c && ctrl_v_count >= 2) {
-            // This is a blocked Ctrl+C press (only happens when popup is showing)
-            pthread_mutex_lock(&state_mutex);
-            
-            popup_action = POPUP_ACTION_PREV;
-            current_nav_direction = NAV_DIRECTION_PREV;
-            msg(LOG_DEBUG, "Blocked Ctrl+C - action=PREV");
-            
-            if (main_callback) {
-                main_callback("cb_clipboard_prev");
-            }
-            
-            pthread_mutex_unlock(&state_mutex);
-            
-        } else if (is_press && keysym == XK_x && ctrl_v_count >= 2) {
+                current_nav_direction = NAV_DIRECTION_NEXT;
+                msg(LOG_DEBUG, "Blocked Ctrl+%s - switching history ring", config.key_ring);
+                
+                queue_job("cb_clipboard_ring");
+                break;
+                
+            default:
+                break;
+        }
+    }
+}
 
-            pthread_mutex_lock(&state_mutex);
-            popup_action = POPUP_ACTION_CUT;
-            msg(LOG_DEBUG, "Blocked Ctrl+X - action=CUT");
-            
-            if (main_callback) {
-                main_callback("cb_clipboard_cut");
-            }
+// this is only used to track the Control key state
+static void handle_key_event(int is_press, KeyCode keycode) {
+    if (paste_state != PASTE_IDLE) {
+        int consumed = handle_paste_event(is_press, keycode);
+        if (consumed) {
+            return;
+        }
+    }
+    
+    // ONLY track Control key state
+    if (!(control_keycodes[keycode / 8] & (1 << (keycode % 8)))) {
+        key_events_filtered++;
+        return;
+    }
+    key_events_handled++;
+    
+    if (is_press) {
+        // a popup may follow, where the pointer is gets asked for now
+        if (!ctrl_pressed && ctrl_v_count == 0) {
+            popup_prefetch_pointer();
+        }
+        ctrl_pressed = 1;
+        msg(LOG_DEBUG, "Control pressed");
+    } else {
+        ctrl_pressed = 0;
+        control_released_at = latency_now();
+        msg(LOG_DEBUG, "Control released");
+        
+        if (ctrl_v_count == 0) {
+            msg(LOG_DEBUG, "State already cleaned up - ignoring Control release");
             
-            ungrab_navigation_keys();
-            reset_state();
-            pthread_mutex_unlock(&state_mutex);
-        } else if (is_press && keysym == XK_z && ctrl_v_count >= 2) {
-            // This is a blocked Ctrl+Z press (only happens when popup is showing)
-            pthread_mutex_lock(&state_mutex);
-
-            msg(LOG_DEBUG, "Blocked Ctrl+Z - action=CANCEL (close popup and reset counter)");
-            popup_action = POPUP_ACTION_CANCEL;
-            if (main_callback) {
-                main_callback("cb_clipboard_cancel");
+            if (popup_action == POPUP_ACTION_CUT) {
+                queue_job("control_released");
+                popup_action = POPUP_ACTION_NONE;
             }
+            return;
+        }
+        
+        if (ctrl_v_count == 1 && pending_ctrl_v && ctrl_v_blocked) {
+            msg(LOG_NOTICE, "Control released after single Ctrl+%s - replay paste", config.key_paste);
+            hotkey_perform_paste();
             
-            // Immediately close popup and reset counter as per specification  
-            msg(LOG_DEBUG, "Closing popup and resetting counter for CANCEL action");
+            queue_job("single_paste");
             
+        } else if (ctrl_v_count >= 2) {
+            msg(LOG_NOTICE, "Control released on popup");
             ungrab_navigation_keys();
-            reset_state();
-            pthread_mutex_unlock(&state_mutex);
-
-        } else if (is_press && (keysym == XK_d || keysym == XK_D) && ctrl_v_count >= 2) {
-
-            pthread_mutex_lock(&state_mutex);
-            
-            msg(LOG_DEBUG, "Blocked Ctrl+D - action=DELETE (delete current entry)");
-            popup_action = POPUP_ACTION_DELETE;
-
-            if (main_callback) {
-                main_callback("cb_clipboard_delete");
-            }
-            
-            pthread_mutex_unlock(&state_mutex);
         }
         
-        XAllowEvents(g_display, SyncKeyboard, event->xkey.time);
-        XFlush(g_display);
+        // Call the control_released callback BEFORE resetting state
+        // This allows the callback to access popup_action before it's reset
+        queue_job("control_released");
+        
+        reset_state();
     }
 }
 
-// this is only used to track the Control key state
 static void record_callback(XPointer closure, XRecordInterceptData *data) {
     (void)closure;
     
-    if (!monitoring_enabled) {
-        goto end;
-    }
-    
-    if (replaying_paste) {
-        goto end;
-    }
-    
     if (!data || data->category != XRecordFromServer || data->data_len < 8) {
         goto end;
     }
@@ -331,68 +515,109 @@ static void record_callback(XPointer closure, XRecordInterceptData *data) {
     int event_type = event_data[0] & 0x7F;
     
     if (event_type == KeyPress || event_type == KeyRelease) {
-        int is_press = (event_type == KeyPress);
-        KeyCode keycode = event_data[1];
+        queue_key_event(event_type == KeyPress, event_data[1]);
+    }
+    
+end:
+    if (data) {
+        XRecordFreeData(data);
+    }
+}
+
+// runs on the XRecord thread. The queue only fills up if the main loop
+// is stuck, the event is dropped then
+static void queue_key_event(int is_press, KeyCode keycode) {
+    unsigned int head = __atomic_load_n(&key_queue_head, __ATOMIC_RELAXED);
+    unsigned int tail = __atomic_load_n(&key_queue_tail, __ATOMIC_ACQUIRE);
+    
+    if (head - tail >= KEY_QUEUE_SIZE) {
+        key_queue_overflows++;
+        return;
+    }
+    
+    key_queue[head % KEY_QUEUE_SIZE] = (queued_key_t){ keycode, (unsigned char)is_press };
+    __atomic_store_n(&key_queue_head, head + 1, __ATOMIC_RELEASE);
+    
+    uint64_t one = 1;
+    if (write(key_queue_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        msg(LOG_WARNING, "Failed to wake up the main loop: %s", strerror(errno));
+    }
+}
+
+// runs on the main thread, from the event loop
+static void drain_key_queue(int fd, void *data) {
+    (void)data;
+    
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        msg(LOG_WARNING, "Failed to read key queue wakeup: %s", strerror(errno));
+    }
+    
+    unsigned int tail = __atomic_load_n(&key_queue_tail, __ATOMIC_RELAXED);
+    unsigned int head = __atomic_load_n(&key_queue_head, __ATOMIC_ACQUIRE);
+    
+    while (tail != head) {
+        queued_key_t key = key_queue[tail % KEY_QUEUE_SIZE];
+        __atomic_store_n(&key_queue_tail, ++tail, __ATOMIC_RELEASE);
         
-        if (!g_display) {
-            goto end;
+        if (monitoring_enabled) {
+            handle_key_event(key.is_press, key.keycode);
         }
         
-        KeySym keysym = XkbKeycodeToKeysym(g_display, keycode, 0, 0);
-        
-        // ONLY track Control key state
-        if (keysym == XK_Control_L || keysym == XK_Control_R) {
-            pthread_mutex_lock(&state_mutex);
-            
-            if (is_press) {
-                ctrl_pressed = 1;
-                msg(LOG_DEBUG, "Control pressed");
-            } else {
-                ctrl_pressed = 0;
-                msg(LOG_DEBUG, "Control released");
-                
-                if (ctrl_v_count == 0) {
-                    msg(LOG_DEBUG, "State already cleaned up - ignoring Control release");
-                    
-                    if (popup_action == POPUP_ACTION_CUT && main_callback) {
-                        main_callback("control_released");
-                        popup_action = POPUP_ACTION_NONE;
-                    }
-                    
-                    pthread_mutex_unlock(&state_mutex);
-                    goto end;
-                }
-                
-                if (ctrl_v_count == 1 && pending_ctrl_v && ctrl_v_blocked) {
-                    msg(LOG_NOTICE, "Control released after single Ctrl+V - replay paste");
-                    hotkey_perform_paste();
-                    
-                    if (main_callback) {
-                        main_callback("single_paste");
-                    }
-
-                } else if (ctrl_v_count >= 2) {
-                    msg(LOG_NOTICE, "Control released on popup");
-                    ungrab_navigation_keys();
-                }
-                
-                // Call the control_released callback BEFORE resetting state
-                // This allows the callback to access popup_action before it's reset
-                if (main_callback) {
-                    main_callback("control_released");
-                }
-                
-                reset_state();
-            }
-            
-            pthread_mutex_unlock(&state_mutex);
+        if (tail == head) {
+            head = __atomic_load_n(&key_queue_head, __ATOMIC_ACQUIRE);
         }
     }
+}
+
+// raw events are delivered to every client that selects them, grabs or
+// not, that needs XInput 2.1
+static int select_raw_key_events(void) {
+    int event_base, error_base;
+    if (!XQueryExtension(g_display, "XInputExtension", &xi_opcode, &event_base, &error_base)) {
+        msg(LOG_NOTICE, "XInput extension not available");
+        xi_opcode = -1;
+        return 0;
+    }
     
-end:
-    if (data) {
-        XRecordFreeData(data);
+    int major = 2, minor = 1;
+    if (XIQueryVersion(g_display, &major, &minor) != Success || major < 2 || (major == 2 && minor < 1)) {
+        msg(LOG_NOTICE, "XInput 2.1 not available (server has %d.%d)", major, minor);
+        xi_opcode = -1;
+        return 0;
+    }
+    
+    unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    XISetMask(mask_bits, XI_RawKeyPress);
+    XISetMask(mask_bits, XI_RawKeyRelease);
+    
+    XIEventMask event_mask = {
+        .deviceid = XIAllMasterDevices,
+        .mask_len = sizeof(mask_bits),
+        .mask = mask_bits
+    };
+    XISelectEvents(g_display, g_root_window, &event_mask, 1);
+    XFlush(g_display);
+    
+    return 1;
+}
+
+// XInput2 raw key events, returns 1 if the event was one
+int hotkey_handle_generic_event(XEvent *event) {
+    XGenericEventCookie *cookie = &event->xcookie;
+    if (!raw_key_events || cookie->type != GenericEvent || cookie->extension != xi_opcode) {
+        return 0;
     }
+    
+    if (XGetEventData(g_display, cookie)) {
+        if (monitoring_enabled && (cookie->evtype == XI_RawKeyPress || cookie->evtype == XI_RawKeyRelease)) {
+            XIRawEvent *raw_event = (XIRawEvent *)cookie->data;
+            handle_key_event(cookie->evtype == XI_RawKeyPress, (KeyCode)raw_event->detail);
+        }
+        XFreeEventData(g_display, cookie);
+    }
+    
+    return 1;
 }
 
 static void reset_state(void) {
@@ -402,94 +627,213 @@ static void reset_state(void) {
     ctrl_v_blocked = 0;
     popup_action = POPUP_ACTION_NONE;
     
-    if (popup_is_showing()) {
-        popup_hide();
-    }
+    // after the jobs already queued, they may still need the popup
+    queue_job(NULL);
 }
 
-void hotkey_perform_paste(void) {
-    if (!g_display) {
-        msg(LOG_ERR, "hotkey_perform_paste: g_display is NULL");
+static void queue_job(const char *event_type) {
+    if (job_queue_count == JOB_QUEUE_SIZE) {
+        msg(LOG_WARNING, "Job queue full, dropping '%s'", event_type ? event_type : "hide popup");
         return;
     }
+    
+    hotkey_job_t *job = &job_queue[(job_queue_start + job_queue_count) % JOB_QUEUE_SIZE];
+    job->event_type = event_type;
+    job->queued_at = latency_now();
+    job->popup_action = popup_action;
+    job->nav_direction = current_nav_direction;
+    job_queue_count++;
+    
+    if (!job_timer) {
+        job_timer = reactor_add_timer(g_reactor, 0, run_jobs, NULL);
+    }
+}
+
+// runs on the main thread, from the event loop
+static void run_jobs(void *data) {
+    (void)data;
+    
+    job_timer = 0;
+    while (job_queue_count > 0) {
+        hotkey_job_t job = job_queue[job_queue_start];
+        job_queue_start = (job_queue_start + 1) % JOB_QUEUE_SIZE;
+        job_queue_count--;
+        
+        if (!job.event_type) {
+            if (popup_is_showing()) {
+                popup_hide();
+            }
+            continue;
+        }
+        
+        job_popup_action = job.popup_action;
+        job_nav_direction = job.nav_direction;
+        latency_begin(job.queued_at);
+        latency_mark(LATENCY_DISPATCH);
+        if (main_callback) {
+            main_callback(job.event_type);
+        }
+        latency_discard();
+    }
+}
 
-    replaying_paste = 1;
-    msg(LOG_NOTICE, "Replaying Ctrl+V for selected clipboard entry - ALL monitoring paused");
+// events of a replayed paste, returns 1 if the event belonged to it
+static int handle_paste_event(int is_press, KeyCode keycode) {
+    if (is_press) {
+        return keycode == paste_v_keycode || keycode == paste_control_keycode;
+    }
     
-    KeyCode v_keycode = XKeysymToKeycode(g_display, XK_v);
-    KeyCode ctrl_keycode = XKeysymToKeycode(g_display, XK_Control_L);
+    if (paste_state == PASTE_AWAIT_V_RELEASE && keycode == paste_v_keycode) {
+        // the fake V press has been delivered, the grab can't catch it anymore
+        msg(LOG_DEBUG, "Replayed %s released, re-grabbing Ctrl+%s", config.key_paste, config.key_paste);
+        grab_action_key(KEY_ACTION_PASTE, 1);
+        XFlush(g_display);
+        paste_state = PASTE_AWAIT_CONTROL_RELEASE;
+        return 1;
+    }
     
-    if (v_keycode == 0) {
-        msg(LOG_WARNING, "Failed to get V keycode");
-        replaying_paste = 0;
-        return;
+    if (paste_state == PASTE_AWAIT_CONTROL_RELEASE && keycode == paste_control_keycode) {
+        finish_paste(1);
+        return 1;
     }
     
-    // Temporarily ungrab Ctrl+V to allow our fake event through
-    unsigned int modifier_combinations[] = {
-        ControlMask,
-        ControlMask | LockMask,
-        ControlMask | Mod2Mask,
-        ControlMask | LockMask | Mod2Mask
-    };
+    return keycode == paste_v_keycode;
+}
+
+// runs on the main thread, from the event loop
+static void expire_paste(void *data) {
+    (void)data;
     
-    msg(LOG_DEBUG, "Ungrabbing Ctrl+V for replay");
-    for (int i = 0; i < 4; i++) {
-        XUngrabKey(g_display, v_keycode, modifier_combinations[i], g_root_window);
+    paste_timer = 0;
+    if (paste_state != PASTE_IDLE) {
+        msg(LOG_WARNING, "Replayed Ctrl+%s wasn't seen back, giving up on it", config.key_paste);
+        finish_paste(0);
+    }
+}
+
+static void finish_paste(int completed) {
+    if (paste_timer) {
+        reactor_cancel_timer(g_reactor, paste_timer);
+        paste_timer = 0;
     }
-    XFlush(g_display);
     
-    Window focus_window;
-    int revert_to;
-    XGetInputFocus(g_display, &focus_window, &revert_to);
+    if (paste_state == PASTE_AWAIT_V_RELEASE) {
+        grab_action_key(KEY_ACTION_PASTE, 1);
+        XFlush(g_display);
+    }
+    paste_state = PASTE_IDLE;
     
-    if (focus_window == None || focus_window == DefaultRootWindow(g_display)) {
-        focus_window = g_root_window;
+    if (!completed) {
+        paste_timeouts++;
+        return;
+    }
+    
+    // from the user releasing Control to the server delivering the paste
+    long long latency = latency_now() - control_released_at;
+    paste_count++;
+    paste_latency_total += latency;
+    latency_record(LATENCY_RELEASE_TO_PASTE, latency);
+    if (latency > paste_latency_max) {
+        paste_latency_max = latency;
+    }
+    msg(LOG_NOTICE, "Ctrl+%s replay completed %lld.%03lld ms after Control release - monitoring resumed",
+        config.key_paste, latency / 1000, latency % 1000);
+}
+
+// sends the fake Ctrl+V and returns, XRecord (or XInput2) reports the
+// events back and completes the paste. Called from the Control release
+// handling, on the main thread
+void hotkey_perform_paste(void) {
+    if (!g_display) {
+        msg(LOG_ERR, "hotkey_perform_paste: g_display is NULL");
+        return;
     }
     
-    msg(LOG_DEBUG, "Sending fake Ctrl+V to window: %lu", focus_window);
+    if (paste_state != PASTE_IDLE) {
+        msg(LOG_WARNING, "Previous Ctrl+%s replay still pending, completing it", config.key_paste);
+        finish_paste(0);
+    }
     
-    XTestFakeKeyEvent(g_display, ctrl_keycode, True, CurrentTime);
-    XSync(g_display, False);
+    KeyCode v_keycode = action_keycodes[KEY_ACTION_PASTE];
     
-    XTestFakeKeyEvent(g_display, v_keycode, True, CurrentTime);
-    XSync(g_display, False);
+    if (v_keycode == 0 || control_keycode == 0) {
+        msg(LOG_WARNING, "Failed to get V or Control keycode");
+        return;
+    }
     
-    XTestFakeKeyEvent(g_display, v_keycode, False, CurrentTime);
-    XSync(g_display, False);
+    msg(LOG_NOTICE, "Replaying Ctrl+%s for selected clipboard entry - ALL monitoring paused", config.key_paste);
     
-    XTestFakeKeyEvent(g_display, ctrl_keycode, False, CurrentTime);
-    XSync(g_display, False);
+    paste_v_keycode = v_keycode;
+    paste_control_keycode = control_keycode;
+    paste_timer = reactor_add_timer(g_reactor, PASTE_TIMEOUT_MS, expire_paste, NULL);
+    paste_state = PASTE_AWAIT_V_RELEASE;
     
-    usleep(100000); // 100ms
+    // Temporarily ungrab Ctrl+V to allow our fake event through
+    grab_action_key(KEY_ACTION_PASTE, 0);
     
-    msg(LOG_DEBUG, "Re-grabbing Ctrl+V");
-    for (int i = 0; i < 4; i++) {
-        XGrabKey(g_display, v_keycode, modifier_combinations[i], g_root_window,
-                 True, GrabModeSync, GrabModeAsync);
-    }
+    // requests are processed in order, the ungrab is in effect before the
+    // fake events arrive and the focused window gets them like typed keys
+    XTestFakeKeyEvent(g_display, control_keycode, True, CurrentTime);
+    XTestFakeKeyEvent(g_display, v_keycode, True, CurrentTime);
+    XTestFakeKeyEvent(g_display, v_keycode, False, CurrentTime);
+    XTestFakeKeyEvent(g_display, control_keycode, False, CurrentTime);
     XFlush(g_display);
     
-    replaying_paste = 0;
-    msg(LOG_NOTICE, "Ctrl+V replay completed for selected entry - monitoring resumed");
+    // without XRecord or raw events nothing reports the events back
+    if (!is_monitoring) {
+        XSync(g_display, False);
+        finish_paste(1);
+    }
 }
 
 int hotkey_init(hotkey_callback_t callback) {
     main_callback = callback;
     
-    pthread_mutex_init(&state_mutex, NULL);
-    
     ctrl_v_count = 0;
-    replaying_paste = 0;
+    paste_state = PASTE_IDLE;
     ctrl_pressed = 0;
     pending_ctrl_v = 0;
     ctrl_v_blocked = 0;
     
+    // group changes move the bindings to the keys of the new layout
+    int xkb_opcode, xkb_error_base;
+    int xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (XkbQueryExtension(g_display, &xkb_opcode, &xkb_event_base, &xkb_error_base, &xkb_major, &xkb_minor)) {
+        XkbStateRec xkb_state;
+        if (XkbGetState(g_display, XkbUseCoreKbd, &xkb_state) == Success) {
+            keyboard_group = xkb_state.group;
+        }
+        XkbSelectEventDetails(g_display, XkbUseCoreKbd, XkbStateNotify,
+                              XkbGroupStateMask, XkbGroupStateMask);
+    } else {
+        xkb_event_base = -1;
+    }
+    
+    build_key_table();
+    
     if (!setup_key_blocking()) {
         msg(LOG_ERR, "Failed to set up key blocking");
         return 0;
     }
+    
+    if (config.key_events == KEY_EVENTS_XINPUT2 && select_raw_key_events()) {
+        raw_key_events = 1;
+        is_monitoring = 1;
+        msg(LOG_NOTICE, "Hotkey system initialized with blocking + XInput2 raw events");
+        return 1;
+    }
 
+    key_queue_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (key_queue_fd == -1) {
+        msg(LOG_ERR, "Failed to create key queue eventfd: %s", strerror(errno));
+        return 0;
+    }
+    if (!reactor_add_fd(g_reactor, key_queue_fd, drain_key_queue, NULL)) {
+        close(key_queue_fd);
+        key_queue_fd = -1;
+        return 0;
+    }
+    
     if (pthread_create(&xrecord_thread, NULL, xrecord_thread_func, NULL) != 0) {
         msg(LOG_ERR, "Failed to create XRecord thread");
         return 0;
@@ -505,11 +849,6 @@ static void* xrecord_thread_func(void* arg) {
     
     msg(LOG_NOTICE, "XRecord thread started");
     
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-    
-    usleep(200000); // 200ms delay
-    
     record_display = XOpenDisplay(NULL);
     if (!record_display) {
         msg(LOG_ERR, "Cannot open display for XRecord");
@@ -552,8 +891,7 @@ static void* xrecord_thread_func(void* arg) {
     msg(LOG_NOTICE, "Starting XRecord monitoring...");
     is_monitoring = 1;
     
-    pthread_testcancel();
-    
+    // returns once the context is disabled from g_display
     if (!XRecordEnableContext(record_display, record_context, record_callback, NULL)) {
         msg(LOG_ERR, "XRecordEnableContext failed");
     }
@@ -570,29 +908,24 @@ static void* xrecord_thread_func(void* arg) {
     return NULL;
 }
 
+// disabling the context on the other connection ends XRecordEnableContext
+// on the record connection, the thread then cleans up and exits
 static void hotkey_stop_monitoring(void) {
     msg(LOG_NOTICE, "Stopping hotkey monitoring...");
     
-    if (is_monitoring) {
-        msg(LOG_DEBUG, "Canceling XRecord thread...");
-        
-        pthread_cancel(xrecord_thread);
-        usleep(100000); // 100ms
+    if (is_monitoring && record_context) {
+        msg(LOG_DEBUG, "Disabling XRecord context...");
+        XRecordDisableContext(g_display, record_context);
+        XSync(g_display, False);
         
-        // Force join with timeout
+        // a context that wasn't enabled yet can't be disabled
         struct timespec timeout_spec;
         clock_gettime(CLOCK_REALTIME, &timeout_spec);
-        timeout_spec.tv_sec += 1; // 1 second timeout
-        
-        void *result;
-        int join_result = pthread_timedjoin_np(xrecord_thread, &result, &timeout_spec);
+        timeout_spec.tv_sec += 1;
         
+        int join_result = pthread_timedjoin_np(xrecord_thread, NULL, &timeout_spec);
         if (join_result == 0) {
-            if (result == PTHREAD_CANCELED) {
-                msg(LOG_DEBUG, "XRecord thread was cancelled");
-            } else {
-                msg(LOG_DEBUG, "XRecord thread exited normally");
-            }
+            msg(LOG_DEBUG, "XRecord thread exited normally");
         } else if (join_result == ETIMEDOUT) {
             msg(LOG_WARNING, "XRecord thread join timed out - detaching");
             pthread_detach(xrecord_thread);
@@ -602,31 +935,81 @@ static void hotkey_stop_monitoring(void) {
     }
     
     is_monitoring = 0;
-    
-    if (record_display) {
-        record_display = NULL;
-    }
 }
 
 void hotkey_cleanup(void) {
     msg(LOG_DEBUG, "Cleaning up hotkey system...");
     
-    if (is_monitoring) {
+    if (paste_count > 0) {
+        msg(LOG_DEBUG, "Pastes: %lu, release to paste %lld us average, %lld us max, %lu timed out",
+            paste_count, paste_latency_total / (long long)paste_count, paste_latency_max, paste_timeouts);
+    }
+    
+    if (key_events_filtered + key_events_handled > 0) {
+        msg(LOG_DEBUG, "Key events: %lu handled, %lu filtered by keycode",
+            key_events_handled, key_events_filtered);
+    }
+    
+    if (raw_key_events) {
+        raw_key_events = 0;
+        is_monitoring = 0;
+    } else if (is_monitoring) {
         hotkey_stop_monitoring();
     }
     
-    pthread_mutex_destroy(&state_mutex);
+    if (job_timer) {
+        reactor_cancel_timer(g_reactor, job_timer);
+        job_timer = 0;
+    }
+    job_queue_count = 0;
+    
+    // the XRecord thread is gone, nothing writes to the queue anymore
+    if (key_queue_fd != -1) {
+        if (key_queue_overflows > 0) {
+            msg(LOG_WARNING, "Key queue overflowed, %lu key events dropped", key_queue_overflows);
+        }
+        reactor_remove_fd(g_reactor, key_queue_fd);
+        close(key_queue_fd);
+        key_queue_fd = -1;
+    }
+    
     msg(LOG_DEBUG, "Hotkey cleanup completed");
 }
 
+// MappingNotify and XKB group changes, returns 1 if the event was one
+int hotkey_handle_keymap_event(XEvent *event) {
+    if (event->type == MappingNotify) {
+        XRefreshKeyboardMapping(&event->xmapping);
+        if (event->xmapping.request == MappingKeyboard || event->xmapping.request == MappingModifier) {
+            msg(LOG_DEBUG, "Keyboard mapping changed, rebuilding key table");
+            rebuild_key_table();
+        }
+        return 1;
+    }
+    
+    if (xkb_event_base >= 0 && event->type == xkb_event_base) {
+        XkbEvent *xkb_event = (XkbEvent *)event;
+        if (xkb_event->any.xkb_type == XkbStateNotify && xkb_event->state.group != keyboard_group) {
+            keyboard_group = xkb_event->state.group;
+            msg(LOG_DEBUG, "Keyboard group changed to %d, rebuilding key table", keyboard_group);
+            rebuild_key_table();
+        }
+        return 1;
+    }
+    
+    return 0;
+}
+
+// as they were when the key behind the running callback came in
 PopupAction hotkey_get_popup_action(void) {
-    return popup_action;
+    return job_popup_action;
 }
 
 nav_direction_t hotkey_get_nav_direction(void) {
-    return current_nav_direction;
+    return job_nav_direction;
 }
 
 void hotkey_reset_nav_direction(void) {
     current_nav_direction = NAV_DIRECTION_NEXT;
+    job_nav_direction = NAV_DIRECTION_NEXT;
 }
@@ -14,6 +14,8 @@ typedef void (*hotkey_callback_t)(const char *event_type);
 int hotkey_init(hotkey_callback_t callback);
 void hotkey_cleanup(void);
 void hotkey_handle_xevent(XEvent *event);
+int hotkey_handle_keymap_event(XEvent *event);
+int hotkey_handle_generic_event(XEvent *event);
 PopupAction hotkey_get_popup_action(void);
 void hotkey_perform_paste(void);
 nav_direction_t hotkey_get_nav_direction(void);
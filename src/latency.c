@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "latency.h"
+#include "halen.h"
+
+#include <time.h>
+#include <sys/syslog.h>
+
+// log-linear buckets like HdrHistogram: exact below 32 us, above that 16
+// buckets per power of two, so any value is off by less than 1/16
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define LINEAR_LIMIT (2 * SUB_BUCKETS)
+#define MAX_EXPONENT 31                 // about 35 minutes in microseconds
+#define BUCKET_COUNT (LINEAR_LIMIT + (MAX_EXPONENT - SUB_BUCKET_BITS - 1) * SUB_BUCKETS)
+
+typedef struct {
+    unsigned long buckets[BUCKET_COUNT];
+    unsigned long count;
+    long long max;
+} histogram_t;
+
+static histogram_t histograms[LATENCY_STAGE_COUNT];
+static int tracing = 0;
+static long long trace_start = 0;
+static long long trace_mark = 0;
+
+static int bucket_index(long long value);
+static long long bucket_value(int index);
+static long long percentile(const histogram_t *histogram, double fraction);
+
+static const char *stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_DISPATCH]         = "dispatch",
+    [LATENCY_HISTORY]          = "history fetch",
+    [LATENCY_LAYOUT]           = "layout",
+    [LATENCY_DRAW]             = "draw",
+    [LATENCY_FLUSH]            = "flush",
+    [LATENCY_KEY_TO_POPUP]     = "key to popup",
+    [LATENCY_RELEASE_TO_PASTE] = "release to paste",
+};
+
+static int bucket_index(long long value) {
+    if (value < LINEAR_LIMIT) return value < 0 ? 0 : (int)value;
+    
+    int exponent = 63 - __builtin_clzll((unsigned long long)value);
+    if (exponent >= MAX_EXPONENT) return BUCKET_COUNT - 1;
+    
+    int shift = exponent - SUB_BUCKET_BITS;
+    int sub_bucket = (int)(value >> shift) - SUB_BUCKETS;
+    return LINEAR_LIMIT + (shift - 1) * SUB_BUCKETS + sub_bucket;
+}
+
+// the highest value that lands in the bucket
+static long long bucket_value(int index) {
+    if (index < LINEAR_LIMIT) return index;
+    
+    int shift = (index - LINEAR_LIMIT) / SUB_BUCKETS + 1;
+    long long sub_bucket = (index - LINEAR_LIMIT) % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static long long percentile(const histogram_t *histogram, double fraction) {
+    unsigned long wanted = (unsigned long)(fraction * histogram->count + 0.5);
+    if (wanted == 0) wanted = 1;
+    
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted) {
+            long long value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+long long latency_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void latency_begin(long long started_at) {
+    tracing = 1;
+    trace_start = started_at;
+    trace_mark = started_at;
+}
+
+void latency_mark(latency_stage_t stage) {
+    if (!tracing) return;
+    
+    long long now = latency_now();
+    latency_record(stage, now - trace_mark);
+    trace_mark = now;
+}
+
+void latency_end(void) {
+    if (!tracing) return;
+    
+    latency_record(LATENCY_KEY_TO_POPUP, latency_now() - trace_start);
+    tracing = 0;
+}
+
+// a trace that didn't end with a redraw
+void latency_discard(void) {
+    tracing = 0;
+}
+
+void latency_record(latency_stage_t stage, long long microseconds) {
+    histogram_t *histogram = &histograms[stage];
+    histogram->buckets[bucket_index(microseconds)]++;
+    histogram->count++;
+    if (microseconds > histogram->max) {
+        histogram->max = microseconds;
+    }
+}
+
+void latency_dump(void) {
+    int empty = 1;
+    
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        const histogram_t *histogram = &histograms[stage];
+        if (histogram->count == 0) continue;
+        empty = 0;
+        
+        long long p50 = percentile(histogram, 0.50);
+        long long p99 = percentile(histogram, 0.99);
+        msg(LOG_NOTICE, "Latency %-16s %6lu samples, p50 %lld.%03lld ms, p99 %lld.%03lld ms, max %lld.%03lld ms",
+            stage_names[stage], histogram->count,
+            p50 / 1000, p50 % 1000, p99 / 1000, p99 % 1000,
+            histogram->max / 1000, histogram->max % 1000);
+    }
+    
+    if (empty) {
+        msg(LOG_NOTICE, "No latency samples recorded yet");
+    }
+}
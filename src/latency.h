@@ -0,0 +1,28 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Where the time goes between a grabbed key and the popup on screen, and
+// between the Control release and the replayed paste. A trace starts at
+// the key (monotonic microseconds), every mark records the time since the
+// previous mark into the histogram of its stage. Marks without a trace
+// (exposes) are ignored. Main thread only.
+typedef enum {
+    LATENCY_DISPATCH = 0,       // grabbed key to its callback running
+    LATENCY_HISTORY,            // history fetch
+    LATENCY_LAYOUT,             // thumbnail, text extents, window geometry
+    LATENCY_DRAW,
+    LATENCY_FLUSH,              // the XFlush after popup_redraw
+    LATENCY_KEY_TO_POPUP,       // whole trace
+    LATENCY_RELEASE_TO_PASTE,   // Control release to the replay seen back
+    LATENCY_STAGE_COUNT
+} latency_stage_t;
+
+long long latency_now(void);
+void      latency_begin(long long started_at);
+void      latency_mark(latency_stage_t stage);
+void      latency_end(void);
+void      latency_discard(void);
+void      latency_record(latency_stage_t stage, long long microseconds);
+void      latency_dump(void);
+
+#endif // LATENCY_H
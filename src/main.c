@@ -13,7 +13,9 @@
 #include <getopt.h>
 #include <sys/syslog.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/signalfd.h>
 
 #include "config.h"
 
@@ -25,14 +27,16 @@
 #include "history.h"
 #include "xdg.h"
 #include "text.h"
+#include "reactor.h"
+#include "latency.h"
 
 Display *g_display = NULL;
 Window g_root_window;
 config_t config;
 volatile int g_running = 1;
 int g_verbose = 0;
-static int signal_pipe_write_fd = -1;
-static int signal_pipe_read_fd = -1;
+reactor_t *g_reactor = NULL;
+static int signal_fd = -1;
 
 static char *log_file = NULL;
 static char *config_file = NULL;
@@ -40,18 +44,28 @@ static char *pid_file_path = NULL;
 static FILE *log_fp = NULL;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static void process_received_signal(int signal_number);
+
+// the signals are blocked before any thread is created (threads inherit
+// the mask) and read from a signalfd in the event loop
 static void setup_signal_handling(void) {
-    int pipe_fds[2];
-    if (pipe(pipe_fds) == -1) {
-        msg(LOG_ERR, "Failed to create signal pipe: %s", strerror(errno));
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGUSR1);
+    sigaddset(&signal_mask, SIGUSR2);
+    
+    if (pthread_sigmask(SIG_BLOCK, &signal_mask, NULL) != 0) {
+        msg(LOG_ERR, "Failed to block signals");
         exit(EXIT_FAILURE);
     }
     
-    signal_pipe_read_fd = pipe_fds[0];
-    signal_pipe_write_fd = pipe_fds[1];
-    
-    int flags = fcntl(signal_pipe_write_fd, F_GETFL);
-    fcntl(signal_pipe_write_fd, F_SETFL, flags | O_NONBLOCK);
+    signal_fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        msg(LOG_ERR, "Failed to create signalfd: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
 static char* construct_pid_file_path(void) {
@@ -133,13 +147,13 @@ static void cleanup_resources(void) {
     history_cleanup();
     popup_cleanup();
     
-    if (signal_pipe_read_fd != -1) {
-        close(signal_pipe_read_fd);
-        signal_pipe_read_fd = -1;
+    if (g_reactor) {
+        reactor_destroy(g_reactor);
+        g_reactor = NULL;
     }
-    if (signal_pipe_write_fd != -1) {
-        close(signal_pipe_write_fd);
-        signal_pipe_write_fd = -1;
+    if (signal_fd != -1) {
+        close(signal_fd);
+        signal_fd = -1;
     }
     
     remove_pid_file();
@@ -167,10 +181,52 @@ static void cleanup_resources(void) {
     msg(LOG_NOTICE, "Cleanup completed");
 }
 
-void signal_handler(int signal_number) {
-    char signal_byte = (char)signal_number;
-    ssize_t result = write(signal_pipe_write_fd, &signal_byte, 1);
-    (void)result; // Suppress unused variable warning
+static void read_signals(int fd, void *data) {
+    (void)data;
+    
+    struct signalfd_siginfo signal_info;
+    while (read(fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {
+        process_received_signal((int)signal_info.ssi_signo);
+    }
+}
+
+static void dispatch_x_events(int fd, void *data) {
+    (void)fd;
+    (void)data;
+    
+    while (XPending(g_display)) {
+        XEvent event;
+        XNextEvent(g_display, &event);
+        
+        switch (event.type) {
+            case KeyPress:
+            case KeyRelease: {
+                hotkey_handle_xevent(&event);
+                break;
+            }
+            case Expose: {
+                popup_handle_expose(&event.xexpose);
+                break;
+            }
+            case GenericEvent: {
+                hotkey_handle_generic_event(&event);
+                break;
+            }
+            default: {
+                if (!hotkey_handle_keymap_event(&event)) {
+                    popup_handle_screen_event(&event);
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Xlib may have read events into its queue while handling others, they
+// have to be handled before waiting. XPending also flushes the requests
+static long long prepare_x_events(void *data) {
+    dispatch_x_events(ConnectionNumber(g_display), data);
+    return LLONG_MAX;
 }
 
 static void process_received_signal(int signal_number) {
@@ -186,6 +242,9 @@ static void process_received_signal(int signal_number) {
             msg(LOG_NOTICE, "USR1 signal received, toggling hotkey monitoring");
             hotkey_toggle_monitoring();
             break;
+        case SIGUSR2:
+            latency_dump();
+            break;
         default:
             msg(LOG_NOTICE, "Unknown signal %d received", signal_number);
             break;
@@ -196,9 +255,10 @@ void hotkey_event_callback(const char *event_type) {
     msg(LOG_NOTICE, "Hotkey callback: %s", event_type);
     
     if (strcmp(event_type, "double_paste") == 0) {
-        msg(LOG_NOTICE, "Ctrl+V+V: show popup");
+        msg(LOG_NOTICE, "Ctrl+%s+%s: show popup", config.key_paste, config.key_paste);
 
         char *latest_entry = history_get_entry_truncated(-1);
+        latency_mark(LATENCY_HISTORY);
         if (latest_entry) {
             history_set_current_index(0);  // Start at newest entry (index 0)
             if (!popup_show(latest_entry)) {
@@ -210,7 +270,7 @@ void hotkey_event_callback(const char *event_type) {
         }
         
     } else if (strcmp(event_type, "cb_clipboard_next") == 0) {
-        msg(LOG_NOTICE, "Ctrl+V+V+V: Navigate NEXT (older entries)");
+        msg(LOG_NOTICE, "Ctrl+%s: Navigate NEXT (older entries)", config.key_paste);
         
         int current_index = history_get_current_index();
         int history_count = history_get_count();
@@ -227,6 +287,7 @@ void hotkey_event_callback(const char *event_type) {
             }
             
             char *next_entry = history_get_entry_truncated(next_index);
+            latency_mark(LATENCY_HISTORY);
             if (next_entry) {
                 history_set_current_index(next_index);
                 if (popup_is_showing()) {
@@ -241,7 +302,7 @@ void hotkey_event_callback(const char *event_type) {
         }
         
     } else if (strcmp(event_type, "cb_clipboard_prev") == 0) {
-        msg(LOG_NOTICE, "Ctrl+V+V+C: PREV (newer entries)");
+        msg(LOG_NOTICE, "Ctrl+%s: PREV (newer entries)", config.key_previous);
         
         int current_index = history_get_current_index();
         int history_count = history_get_count();
@@ -258,6 +319,7 @@ void hotkey_event_callback(const char *event_type) {
             }
             
             char *prev_entry = history_get_entry_truncated(prev_index);
+            latency_mark(LATENCY_HISTORY);
             if (prev_entry) {
                 history_set_current_index(prev_index);
                 if (popup_is_showing()) {
@@ -271,22 +333,39 @@ void hotkey_event_callback(const char *event_type) {
             }
         }
         
+    } else if (strcmp(event_type, "cb_clipboard_ring") == 0) {
+        history_ring_t ring = history_get_ring() == HISTORY_RING_PRIMARY ?
+                              HISTORY_RING_CLIPBOARD : HISTORY_RING_PRIMARY;
+        msg(LOG_NOTICE, "Ctrl+%s: switch to %s history", config.key_ring, ring == HISTORY_RING_PRIMARY ? "PRIMARY" : "CLIPBOARD");
+        
+        history_set_ring(ring);
+        char *newest_entry = history_get_entry_truncated(0);
+        if (!newest_entry) {
+            msg(LOG_NOTICE, "%s history is empty", ring == HISTORY_RING_PRIMARY ? "PRIMARY" : "CLIPBOARD");
+            history_set_ring(ring == HISTORY_RING_PRIMARY ? HISTORY_RING_CLIPBOARD : HISTORY_RING_PRIMARY);
+            newest_entry = history_get_entry_truncated(0);
+        }
+        latency_mark(LATENCY_HISTORY);
+        
+        if (newest_entry) {
+            history_set_current_index(0);
+            if (popup_is_showing()) {
+                popup_update_text(newest_entry);
+            }
+            free(newest_entry);
+        }
+        
     } else if (strcmp(event_type, "single_paste") == 0) {
-        msg(LOG_NOTICE, "Single Ctrl+V completed");
+        msg(LOG_NOTICE, "Single Ctrl+%s completed", config.key_paste);
         
     } else if (strcmp(event_type, "cb_clipboard_cut") == 0) {
         msg(LOG_NOTICE, "Cut clipboard entry - selecting current entry but NOT pasting");
         
         int current_index = history_get_current_index();
         if (current_index >= 0) {
-            char *selected_entry = history_get_entry_full_content(current_index);
-            if (selected_entry) {
-                clipboard_set_content(selected_entry);
-                
+            if (clipboard_set_entry(current_index)) {
                 msg(LOG_NOTICE, "Cut complete: selected entry %d set as clipboard content (NO PASTE)", 
                     current_index + 1);
-                
-                free(selected_entry);
             }
         } else {
             msg(LOG_WARNING, "No current entry to cut");
@@ -295,7 +374,7 @@ void hotkey_event_callback(const char *event_type) {
         history_reset_navigation();
         
     } else if (strcmp(event_type, "cb_clipboard_delete") == 0) {
-        msg(LOG_NOTICE, "Ctrl+V+V+D: DELETE");
+        msg(LOG_NOTICE, "Ctrl+%s: DELETE", config.key_delete);
         
         int current_index = history_get_current_index();
         nav_direction_t nav_direction = hotkey_get_nav_direction();
@@ -328,6 +407,7 @@ void hotkey_event_callback(const char *event_type) {
                     }
                     
                     char *new_entry = history_get_entry_truncated(new_index);
+                    latency_mark(LATENCY_HISTORY);
                     if (new_entry) {
                         history_set_current_index(new_index);
                         msg(LOG_DEBUG, "DELETE: popup_is_showing=%d", popup_is_showing());
@@ -374,12 +454,9 @@ void hotkey_event_callback(const char *event_type) {
             && (action == POPUP_ACTION_NEXT || action == POPUP_ACTION_PREV)) {
             int current_index = history_get_current_index();
             if (current_index >= 0 && current_index < history_get_count()) {
-                char *selected_entry = history_get_entry_full_content(current_index);
-                if (selected_entry) {
-                    clipboard_set_content(selected_entry);
-                    usleep(50000);
+                // returns once the clipboard thread owns the CLIPBOARD
+                if (clipboard_set_entry(current_index)) {
                     hotkey_perform_paste();
-                    free(selected_entry);
                 } else {
                     msg(LOG_WARNING, "Failed to get selected entry content for paste");
                 }
@@ -389,11 +466,8 @@ void hotkey_event_callback(const char *event_type) {
         } else if (popup_is_showing() && action == POPUP_ACTION_CUT) {
             int current_index = history_get_current_index();
             if (current_index >= 0 && current_index < history_get_count()) {
-                char *selected_entry = history_get_entry_full_content(current_index);
-                if (selected_entry) {
-                    clipboard_set_content(selected_entry);
+                if (clipboard_set_entry(current_index)) {
                     msg(LOG_NOTICE, "Entry %d set to clipboard after deletion (no paste)", current_index + 1);
-                    free(selected_entry);
                 } else {
                     msg(LOG_WARNING, "Failed to get selected entry content for cut");
                 }
@@ -418,6 +492,7 @@ static void print_help(const char *program_name) {
     printf("  -V, --verbose         Enable verbose (debug) logging\n");
     printf("  -c, --config FILE     Use configuration file (default: %s)\n", config_file);
     printf("  -t, --toggle          Toggle monitoring in running instance\n");
+    printf("  -L, --latency         Log latency histograms of running instance\n");
     printf("  -h, --help            Show this help message\n");
     printf("      --version         Show version information\n");
     printf("\n");
@@ -434,7 +509,7 @@ static void print_help(const char *program_name) {
 static void print_version(void) {
     printf("clipopup version %s\n", VERSION);
     printf("Smart Ctrl+V clipboard manager\n");
-    printf("Built with X11, XFixes, XRecord, and XTest\n");
+    printf("Built with X11, XFixes, XInput2, XRandR, XRecord, and XTest\n");
 }
 
 void msg(int priority, const char* format, ...) {
@@ -471,7 +546,7 @@ void msg(int priority, const char* format, ...) {
     pthread_mutex_unlock(&log_mutex);
 }
 
-static int send_toggle_signal(void) {
+static int send_signal(int signal_number) {
     char *temp_pid_path = construct_pid_file_path();
     if (!temp_pid_path) {
         msg(LOG_ERR, "Failed to determine runtime directory");
@@ -495,8 +570,9 @@ static int send_toggle_signal(void) {
     fclose(existing_pid_file);
     free(temp_pid_path);
     
-    if (kill(target_process_id, SIGUSR1) == 0) {
-        msg(LOG_NOTICE, "Toggle signal sent to process %d", target_process_id);
+    if (kill(target_process_id, signal_number) == 0) {
+        msg(LOG_NOTICE, "%s signal sent to process %d",
+            signal_number == SIGUSR1 ? "Toggle" : "Latency dump", target_process_id);
         return 1;
     } else {
         msg(LOG_ERR, "Failed to send signal to process %d: %s", target_process_id, strerror(errno));
@@ -506,16 +582,13 @@ static int send_toggle_signal(void) {
 
 int main(int argc, char *argv[]) {
     setup_signal_handling();
-
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGUSR1, signal_handler);
     config_init(&config);
     
     static struct option long_options[] = {
         {"verbose",  no_argument,       0, 'V'},
         {"config",   required_argument, 0, 'c'},
         {"toggle",   no_argument,       0, 't'},
+        {"latency",  no_argument,       0, 'L'},
         {"help",     no_argument,       0, 'h'},
         {"version",  no_argument,       0, 'v'},
         {0, 0, 0, 0}
@@ -524,7 +597,7 @@ int main(int argc, char *argv[]) {
     int opt;
     int option_index = 0;
     
-    while ((opt = getopt_long(argc, argv, "Vc:thv", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "Vc:tLhv", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'V':
                 config.verbose = 1;
@@ -535,7 +608,14 @@ int main(int argc, char *argv[]) {
                 config_file = strdup(optarg);
                 break;
             case 't':
-                if (send_toggle_signal()) {
+                if (send_signal(SIGUSR1)) {
+                    return EXIT_SUCCESS;
+                } else {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                if (send_signal(SIGUSR2)) {
                     return EXIT_SUCCESS;
                 } else {
                     return EXIT_FAILURE;
@@ -619,6 +699,13 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
     
+    g_reactor = reactor_create();
+    if (!g_reactor) {
+        remove_pid_file();
+        config_free(&config);
+        return EXIT_FAILURE;
+    }
+    
     popup_init(g_display, g_root_window, screen_width, screen_height);
     hotkey_init(hotkey_event_callback);
     
@@ -628,56 +715,12 @@ int main(int argc, char *argv[]) {
         msg(LOG_WARNING, "Clipboard monitoring disabled");
     }
     
-    int x11_fd = ConnectionNumber(g_display);
-    int max_fd = (x11_fd > signal_pipe_read_fd) ? x11_fd : signal_pipe_read_fd;
+    reactor_add_fd(g_reactor, ConnectionNumber(g_display), dispatch_x_events, NULL);
+    reactor_add_fd(g_reactor, signal_fd, read_signals, NULL);
+    reactor_set_prepare(g_reactor, prepare_x_events, NULL);
     
-    while (g_running) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(x11_fd, &read_fds);
-        FD_SET(signal_pipe_read_fd, &read_fds);
-        
-        struct timeval timeout = {0, 100000};
-        
-        int select_result = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (select_result < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            msg(LOG_ERR, "select() failed: %s", strerror(errno));
-            break;
-        }
-        
-        if (select_result > 0 && FD_ISSET(signal_pipe_read_fd, &read_fds)) {
-            char signal_byte;
-            ssize_t bytes_read = read(signal_pipe_read_fd, &signal_byte, 1);
-            if (bytes_read > 0) {
-                process_received_signal((int)signal_byte);
-            }
-        }
-        
-        if (select_result > 0 && FD_ISSET(x11_fd, &read_fds)) {
-            while (XPending(g_display)) {
-                XEvent event;
-                XNextEvent(g_display, &event);
-                
-                switch (event.type) {
-                    case KeyPress:
-                    case KeyRelease: {
-                        hotkey_handle_xevent(&event);
-                        break;
-                    }
-                    case Expose: {
-                        popup_handle_expose(&event.xexpose);
-                        break;
-                    }
-                    default: {
-                        break;
-                    }
-                }
-            }
-        }
+    if (!reactor_run(g_reactor, &g_running)) {
+        msg(LOG_ERR, "Main event loop failed");
     }
     
     msg(LOG_NOTICE, "Main event loop finished");
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "overflow.h"
+#include "halen.h"
+#include "text.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syslog.h>
+
+static int  grow_buffer(char **buffer, size_t *capacity, size_t required_capacity);
+static int  open_temporary_file(overflow_writer_t *writer);
+static void accept_content(overflow_writer_t *writer, const char *data, size_t length);
+static int  accept_blob(overflow_writer_t *writer, const char *data, size_t length);
+static int  commit_overflow_file(overflow_writer_t *writer, char **overflow_hash);
+
+static int grow_buffer(char **buffer, size_t *capacity, size_t required_capacity) {
+    if (*buffer && *capacity >= required_capacity) {
+        return 1;
+    }
+    
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < required_capacity) {
+        new_capacity *= 2;
+    }
+    
+    char *new_buffer = realloc(*buffer, new_capacity);
+    if (!new_buffer) {
+        msg(LOG_ERR, "Failed to grow overflow writer buffer");
+        return 0;
+    }
+    
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static int open_temporary_file(overflow_writer_t *writer) {
+    if (!config.overflow_directory) return 0;
+    
+    snprintf(writer->temporary_path, sizeof(writer->temporary_path), "%s/.incoming-XXXXXX",
+             config.overflow_directory);
+    
+    int file_descriptor = mkstemp(writer->temporary_path);
+    if (file_descriptor == -1) {
+        msg(LOG_WARNING, "Failed to create overflow file: %s", strerror(errno));
+        writer->temporary_path[0] = '\0';
+        return 0;
+    }
+    
+    writer->file = fdopen(file_descriptor, "w");
+    if (!writer->file) {
+        msg(LOG_WARNING, "Failed to open overflow file");
+        close(file_descriptor);
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+        return 0;
+    }
+    
+    return 1;
+}
+
+// the same rules as text_truncate_for_storage, applied while the content
+// streams in. The prefix keeps the first max_lines lines (each cut just
+// after max_line_length) which is all text_format_for_display needs.
+static void accept_content(overflow_writer_t *writer, const char *data, size_t length) {
+    if (writer->exceeded_maximum) return;
+    
+    if (writer->length + length >= MAX_OVERFLOW_FILE_SIZE) {
+        length = MAX_OVERFLOW_FILE_SIZE - 1 - writer->length;
+        writer->exceeded_maximum = 1;
+        msg(LOG_NOTICE, "Clipboard content exceeds maximum size, ignoring the rest");
+    }
+    
+    size_t write_from = 0;
+    
+    for (size_t i = 0; i < length; i++) {
+        char character = data[i];
+        int starts_truncation = 0;
+        
+        if (character == '\n') {
+            writer->line_count++;
+            writer->line_length = 0;
+            starts_truncation = writer->line_count >= config.max_lines;
+        } else {
+            writer->line_length++;
+            starts_truncation = writer->line_length > config.max_line_length;
+        }
+        
+        if (starts_truncation && !writer->needs_truncation) {
+            writer->needs_truncation = 1;
+            
+            // everything received so far is in the prefix
+            if (open_temporary_file(writer)) {
+                fwrite(writer->prefix, 1, writer->prefix_length, writer->file);
+                write_from = i;
+            } else if (config.overflow_directory) {
+                msg(LOG_WARNING, "Falling back to truncation");
+            }
+        }
+        
+        if (writer->line_count < config.max_lines &&
+            writer->line_length <= config.max_line_length + 1) {
+            writer->prefix[writer->prefix_length++] = character;
+        }
+    }
+    
+    if (writer->file) {
+        fwrite(data + write_from, 1, length - write_from, writer->file);
+    }
+    
+    writer->hash = text_hash64_update(writer->hash, data, length);
+    writer->length += length;
+}
+
+static int accept_blob(overflow_writer_t *writer, const char *data, size_t length) {
+    if (writer->exceeded_maximum || !writer->file) return 0;
+    
+    if (writer->length + length > writer->maximum_length) {
+        writer->exceeded_maximum = 1;
+        msg(LOG_NOTICE, "Target exceeds max_target_size (%zu bytes), not storing it",
+            writer->maximum_length);
+        return 0;
+    }
+    
+    fwrite(data, 1, length, writer->file);
+    writer->blob_hash = text_hash64_update(writer->blob_hash, data, length);
+    writer->length += length;
+    return 1;
+}
+
+static int commit_overflow_file(overflow_writer_t *writer, char **overflow_hash) {
+    int write_failed = ferror(writer->file);
+    if (fclose(writer->file) != 0) {
+        write_failed = 1;
+    }
+    writer->file = NULL;
+    
+    if (write_failed) {
+        msg(LOG_WARNING, "Failed to write overflow file, falling back to truncation");
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+        return 0;
+    }
+    
+    char *hash = malloc(24);
+    if (!hash) {
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+        return 0;
+    }
+    // 64-bit names, an existing file of the same name is taken to have
+    // the same content
+    snprintf(hash, 24, "%016llx", (unsigned long long)(writer->is_blob ? writer->blob_hash : writer->hash));
+    
+    char overflow_file_path[PATH_MAX];
+    snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s",
+             config.overflow_directory, hash);
+    
+    if (access(overflow_file_path, F_OK) == 0) {
+        msg(LOG_DEBUG, "Overflow file %s already stored", hash);
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+        *overflow_hash = hash;
+        return 1;
+    }
+    
+    if (rename(writer->temporary_path, overflow_file_path) != 0) {
+        msg(LOG_WARNING, "Failed to store overflow file %s: %s", hash, strerror(errno));
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+        free(hash);
+        return 0;
+    }
+    writer->temporary_path[0] = '\0';
+    
+    msg(LOG_DEBUG, "Created overflow file: %s (content size: %zu bytes)",
+        hash, writer->length);
+    
+    *overflow_hash = hash;
+    return 1;
+}
+
+int overflow_writer_init(overflow_writer_t *writer) {
+    memset(writer, 0, sizeof(*writer));
+    writer->hash = TEXT_HASH64_SEED;
+    
+    writer->prefix_capacity = (size_t)config.max_lines * (config.max_line_length + 2) + 1;
+    writer->prefix = malloc(writer->prefix_capacity);
+    if (!writer->prefix) {
+        msg(LOG_ERR, "Failed to allocate overflow writer prefix");
+        writer->prefix_capacity = 0;
+        return 0;
+    }
+    writer->prefix[0] = '\0';
+    
+    return 1;
+}
+
+int overflow_writer_init_blob(overflow_writer_t *writer, size_t maximum_length) {
+    memset(writer, 0, sizeof(*writer));
+    writer->is_blob = 1;
+    writer->maximum_length = maximum_length;
+    writer->blob_hash = TEXT_HASH64_SEED;
+    
+    return open_temporary_file(writer);
+}
+
+int overflow_writer_append(overflow_writer_t *writer, const char *data, size_t length) {
+    if (writer->is_blob) {
+        return data ? accept_blob(writer, data, length) : 0;
+    }
+    
+    if (!writer->prefix || !data) return 0;
+    
+    // trailing newlines are trimmed from clipboard content, hold them back
+    // until we know they are not at the end
+    size_t content_end = length;
+    while (content_end > 0 && (data[content_end - 1] == '\n' || data[content_end - 1] == '\r')) {
+        content_end--;
+    }
+    
+    if (content_end > 0) {
+        if (writer->pending_length > 0) {
+            accept_content(writer, writer->pending, writer->pending_length);
+            writer->pending_length = 0;
+        }
+        accept_content(writer, data, content_end);
+    }
+    
+    size_t trailing_length = length - content_end;
+    if (trailing_length > 0) {
+        if (!grow_buffer(&writer->pending, &writer->pending_capacity,
+                         writer->pending_length + trailing_length)) {
+            return 0;
+        }
+        memcpy(writer->pending + writer->pending_length, data + content_end, trailing_length);
+        writer->pending_length += trailing_length;
+    }
+    
+    return 1;
+}
+
+// returns the content to store in the history file (same as
+// text_truncate_for_storage) and sets overflow_hash if the complete
+// content was saved to the overflow directory.
+char* overflow_writer_finish(overflow_writer_t *writer, char **overflow_hash) {
+    *overflow_hash = NULL;
+    
+    if (!writer->prefix || writer->length == 0) {
+        overflow_writer_discard(writer);
+        return NULL;
+    }
+    
+    writer->prefix[writer->prefix_length] = '\0';
+    
+    char *storage_content;
+    if (!writer->needs_truncation) {
+        storage_content = strdup(writer->prefix);
+    } else {
+        // the last accepted character is never a newline
+        storage_content = text_format_for_display_lines(writer->prefix, writer->line_count + 1);
+        if (storage_content && writer->file) {
+            commit_overflow_file(writer, overflow_hash);
+        }
+    }
+    
+    overflow_writer_discard(writer);
+    return storage_content;
+}
+
+// returns the name the blob is stored under, NULL if it was empty,
+// exceeded its maximum length or could not be written
+char* overflow_writer_finish_blob(overflow_writer_t *writer) {
+    char *hash = NULL;
+    
+    if (writer->file && writer->length > 0 && !writer->exceeded_maximum) {
+        commit_overflow_file(writer, &hash);
+    }
+    
+    overflow_writer_discard(writer);
+    return hash;
+}
+
+void overflow_writer_discard(overflow_writer_t *writer) {
+    if (writer->file) {
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+    if (writer->temporary_path[0]) {
+        unlink(writer->temporary_path);
+        writer->temporary_path[0] = '\0';
+    }
+    
+    free(writer->prefix);
+    writer->prefix = NULL;
+    writer->prefix_length = 0;
+    writer->prefix_capacity = 0;
+    
+    free(writer->pending);
+    writer->pending = NULL;
+    writer->pending_length = 0;
+    writer->pending_capacity = 0;
+}
+
+char* overflow_read_file(const char *hash, size_t *length) {
+    if (!config.overflow_directory || !hash) return NULL;
+    
+    char overflow_file_path[PATH_MAX];
+    snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s",
+             config.overflow_directory, hash);
+    
+    FILE *overflow_file = fopen(overflow_file_path, "r");
+    if (!overflow_file) {
+        msg(LOG_WARNING, "Failed to open overflow file: %s", overflow_file_path);
+        return NULL;
+    }
+    
+    struct stat file_status;
+    if (fstat(fileno(overflow_file), &file_status) != 0) {
+        fclose(overflow_file);
+        return NULL;
+    }
+    
+    size_t file_size = (size_t)file_status.st_size;
+    if (file_size >= MAX_OVERFLOW_FILE_SIZE) {
+        file_size = MAX_OVERFLOW_FILE_SIZE - 1;
+    }
+    
+    char *content = malloc(file_size + 1);
+    if (!content) {
+        fclose(overflow_file);
+        return NULL;
+    }
+    
+    size_t content_size = fread(content, 1, file_size, overflow_file);
+    content[content_size] = '\0';
+    fclose(overflow_file);
+    
+    if (length) *length = content_size;
+    return content;
+}
+
+// 0 when the file does not exist
+size_t overflow_file_size(const char *hash) {
+    if (!config.overflow_directory || !hash) return 0;
+    
+    char overflow_file_path[PATH_MAX];
+    snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s",
+             config.overflow_directory, hash);
+    
+    struct stat file_status;
+    if (stat(overflow_file_path, &file_status) != 0) return 0;
+    
+    return (size_t)file_status.st_size;
+}
+
+int overflow_delete_file(const char *hash) {
+    if (!config.overflow_directory || !hash) return 0;
+    
+    char overflow_file_path[PATH_MAX];
+    snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s",
+             config.overflow_directory, hash);
+    
+    if (unlink(overflow_file_path) == 0) {
+        msg(LOG_DEBUG, "Deleted overflow file: %s", overflow_file_path);
+        return 1;
+    }
+    
+    msg(LOG_WARNING, "Failed to delete overflow file: %s", overflow_file_path);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef OVERFLOW_H
+#define OVERFLOW_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+// Streams content into the overflow directory while it is received.
+// Only the part of the content that is needed for the display version
+// is kept in memory, everything else goes straight to a temporary file
+// that gets renamed to its hash once the content is complete.
+// Blob writers store non-text targets (text/html, image/png, ...) as is,
+// named by a 64-bit hash so identical blobs are only stored once.
+typedef struct {
+    int is_blob;
+    size_t maximum_length;
+    uint64_t blob_hash;
+    FILE *file;
+    char temporary_path[PATH_MAX];
+    char *prefix;
+    size_t prefix_length;
+    size_t prefix_capacity;
+    char *pending;             // trailing CR/LF, only written if more content follows
+    size_t pending_length;
+    size_t pending_capacity;
+    size_t length;
+    uint64_t hash;
+    int line_count;
+    int line_length;
+    int needs_truncation;
+    int exceeded_maximum;
+} overflow_writer_t;
+
+int   overflow_writer_init(overflow_writer_t *writer);
+int   overflow_writer_init_blob(overflow_writer_t *writer, size_t maximum_length);
+int   overflow_writer_append(overflow_writer_t *writer, const char *data, size_t length);
+char* overflow_writer_finish(overflow_writer_t *writer, char **overflow_hash);
+char* overflow_writer_finish_blob(overflow_writer_t *writer);
+void  overflow_writer_discard(overflow_writer_t *writer);
+
+char*  overflow_read_file(const char *hash, size_t *length);
+size_t overflow_file_size(const char *hash);
+int    overflow_delete_file(const char *hash);
+
+#endif // OVERFLOW_H
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "owner.h"
+#include "halen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <sys/syslog.h>
+
+#define OWNER_CACHE_SIZE 32
+// the owner window is at most a few levels below the window with WM_CLASS
+#define MAX_OWNER_ANCESTORS 8
+#define MAX_CAPTURE_RULES 16
+
+typedef struct {
+    char *names[MAX_CAPTURE_RULES];
+    int count;
+} capture_rules_t;
+
+static Display *owner_display = NULL;
+static Atom net_wm_pid_atom = None;
+static char local_hostname[HOST_NAME_MAX + 1];
+static owner_info_t owner_cache[OWNER_CACHE_SIZE];
+static unsigned long owner_lookups = 0;
+static unsigned long owner_cache_hits = 0;
+static capture_rules_t allow_rules;
+static capture_rules_t deny_rules;
+
+static void parse_capture_rules(const char *value, capture_rules_t *rules);
+static void free_capture_rules(capture_rules_t *rules);
+static int  matches_capture_rules(const owner_info_t *owner, const capture_rules_t *rules);
+static void copy_name(char *destination, const char *source);
+static int is_local_window(Window window);
+static pid_t read_window_pid(Window window);
+static void read_process_name(owner_info_t *owner);
+static void resolve_owner(owner_info_t *owner);
+
+static void parse_capture_rules(const char *value, capture_rules_t *rules) {
+    rules->count = 0;
+    if (!value) return;
+    
+    char *value_copy = strdup(value);
+    if (!value_copy) return;
+    
+    char *save_pointer = NULL;
+    for (char *name = strtok_r(value_copy, " \t,", &save_pointer);
+         name && rules->count < MAX_CAPTURE_RULES;
+         name = strtok_r(NULL, " \t,", &save_pointer)) {
+        rules->names[rules->count] = strdup(name);
+        if (!rules->names[rules->count]) break;
+        rules->count++;
+    }
+    
+    free(value_copy);
+}
+
+static void free_capture_rules(capture_rules_t *rules) {
+    for (int i = 0; i < rules->count; i++) {
+        free(rules->names[i]);
+    }
+    rules->count = 0;
+}
+
+// a rule names the WM_CLASS class or name, or the process, in any case
+static int matches_capture_rules(const owner_info_t *owner, const capture_rules_t *rules) {
+    for (int i = 0; i < rules->count; i++) {
+        if ((owner->application[0] && strcasecmp(rules->names[i], owner->application) == 0) ||
+            (owner->instance[0] && strcasecmp(rules->names[i], owner->instance) == 0) ||
+            (owner->process[0] && strcasecmp(rules->names[i], owner->process) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// names end up in the history file, only keep characters that are safe there
+static void copy_name(char *destination, const char *source) {
+    size_t length = 0;
+    for (; source && *source && length < OWNER_NAME_LENGTH - 1; source++) {
+        unsigned char character = (unsigned char)*source;
+        if (isalnum(character) || character == '.' || character == '-' || character == '_') {
+            destination[length++] = (char)character;
+        }
+    }
+    destination[length] = '\0';
+}
+
+// _NET_WM_PID is only meaningful together with a WM_CLIENT_MACHINE
+// that names this host
+static int is_local_window(Window window) {
+    if (!local_hostname[0]) return 0;
+    
+    XTextProperty client_machine;
+    if (!XGetWMClientMachine(owner_display, window, &client_machine)) return 0;
+    
+    int is_local = client_machine.value && client_machine.format == 8 &&
+                   client_machine.nitems < sizeof(local_hostname) &&
+                   strncmp((const char *)client_machine.value, local_hostname, client_machine.nitems) == 0 &&
+                   local_hostname[client_machine.nitems] == '\0';
+    if (client_machine.value) XFree(client_machine.value);
+    return is_local;
+}
+
+static pid_t read_window_pid(Window window) {
+    if (!is_local_window(window)) return 0;
+    
+    Atom type;
+    int format;
+    unsigned long item_count, bytes_after;
+    unsigned char *data = NULL;
+    pid_t pid = 0;
+    
+    if (XGetWindowProperty(owner_display, window, net_wm_pid_atom, 0, 1, False, XA_CARDINAL,
+                           &type, &format, &item_count, &bytes_after, &data) == Success) {
+        if (data && type == XA_CARDINAL && format == 32 && item_count == 1) {
+            pid = (pid_t)*(unsigned long *)data;
+        }
+        if (data) XFree(data);
+    }
+    
+    return pid;
+}
+
+static void read_process_name(owner_info_t *owner) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)owner->pid);
+    
+    FILE *comm_file = fopen(path, "r");
+    if (!comm_file) return;
+    
+    char name[OWNER_NAME_LENGTH];
+    if (fgets(name, sizeof(name), comm_file)) {
+        name[strcspn(name, "\n")] = '\0';
+        copy_name(owner->process, name);
+    }
+    fclose(comm_file);
+}
+
+static void resolve_owner(owner_info_t *owner) {
+    Window window = owner->window;
+    
+    for (int depth = 0; depth < MAX_OWNER_ANCESTORS && window != None; depth++) {
+        if (!owner->application[0]) {
+            XClassHint class_hint = { NULL, NULL };
+            if (XGetClassHint(owner_display, window, &class_hint)) {
+                copy_name(owner->application, class_hint.res_class);
+                copy_name(owner->instance, class_hint.res_name);
+                if (class_hint.res_class) XFree(class_hint.res_class);
+                if (class_hint.res_name) XFree(class_hint.res_name);
+            }
+        }
+        if (owner->pid == 0) {
+            owner->pid = read_window_pid(window);
+        }
+        if (owner->application[0] && owner->pid != 0) break;
+        
+        Window root, parent;
+        Window *children = NULL;
+        unsigned int child_count;
+        if (!XQueryTree(owner_display, window, &root, &parent, &children, &child_count)) break;
+        if (children) XFree(children);
+        if (parent == root) break;
+        window = parent;
+    }
+    
+    // only local processes, read_window_pid ignores remote clients
+    if (owner->pid > 0) {
+        read_process_name(owner);
+    }
+    
+    msg(LOG_DEBUG, "Selection owner 0x%lx: class '%s', name '%s', pid %d, process '%s'",
+        owner->window, owner->application, owner->instance, (int)owner->pid, owner->process);
+}
+
+void owner_init(Display *display) {
+    owner_display = display;
+    net_wm_pid_atom = XInternAtom(display, "_NET_WM_PID", False);
+    if (gethostname(local_hostname, sizeof(local_hostname)) != 0) {
+        local_hostname[0] = '\0';
+    }
+    local_hostname[sizeof(local_hostname) - 1] = '\0';
+    memset(owner_cache, 0, sizeof(owner_cache));
+    
+    parse_capture_rules(config.capture_allow, &allow_rules);
+    parse_capture_rules(config.capture_deny, &deny_rules);
+}
+
+void owner_cleanup(void) {
+    if (owner_lookups > 0) {
+        msg(LOG_DEBUG, "Selection owners: %lu lookups, %lu cached", owner_lookups, owner_cache_hits);
+    }
+    
+    free_capture_rules(&allow_rules);
+    free_capture_rules(&deny_rules);
+    owner_display = NULL;
+}
+
+// the returned owner stays valid until the next lookup
+const owner_info_t* owner_lookup(Window window) {
+    static owner_info_t unknown_owner;
+    
+    if (!owner_display || window == None) {
+        memset(&unknown_owner, 0, sizeof(unknown_owner));
+        return &unknown_owner;
+    }
+    
+    owner_lookups++;
+    owner_info_t *least_recent = &owner_cache[0];
+    for (int i = 0; i < OWNER_CACHE_SIZE; i++) {
+        if (owner_cache[i].window == window) {
+            owner_cache_hits++;
+            owner_cache[i].last_used = owner_lookups;
+            return &owner_cache[i];
+        }
+        if (owner_cache[i].last_used < least_recent->last_used) {
+            least_recent = &owner_cache[i];
+        }
+    }
+    
+    memset(least_recent, 0, sizeof(*least_recent));
+    least_recent->window = window;
+    least_recent->last_used = owner_lookups;
+    resolve_owner(least_recent);
+    
+    return least_recent;
+}
+
+// window ids are reused once the owner is gone
+void owner_forget(Window window) {
+    for (int i = 0; i < OWNER_CACHE_SIZE; i++) {
+        if (owner_cache[i].window == window) {
+            memset(&owner_cache[i], 0, sizeof(owner_cache[i]));
+        }
+    }
+}
+
+const char* owner_name(const owner_info_t *owner) {
+    if (owner->application[0]) return owner->application;
+    if (owner->process[0]) return owner->process;
+    return NULL;
+}
+
+// denied applications are never captured, with allow rules only the
+// listed applications are
+int owner_is_capture_allowed(const owner_info_t *owner) {
+    if (matches_capture_rules(owner, &deny_rules)) return 0;
+    if (allow_rules.count > 0) return matches_capture_rules(owner, &allow_rules);
+    return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef OWNER_H
+#define OWNER_H
+
+#include <sys/types.h>
+#include <X11/Xlib.h>
+
+#define OWNER_NAME_LENGTH 64
+
+// the application behind a selection owner window. The owner is often
+// an unmapped helper window, WM_CLASS and _NET_WM_PID are looked up on
+// it and its ancestors, the process name is used if there is no class.
+typedef struct {
+    Window window;
+    char application[OWNER_NAME_LENGTH];   // WM_CLASS class, empty if unknown
+    char instance[OWNER_NAME_LENGTH];      // WM_CLASS name
+    char process[OWNER_NAME_LENGTH];       // /proc/<pid>/comm
+    pid_t pid;
+    unsigned long last_used;
+} owner_info_t;
+
+void                owner_init(Display *display);
+void                owner_cleanup(void);
+const owner_info_t* owner_lookup(Window window);
+void                owner_forget(Window window);
+const char*         owner_name(const owner_info_t *owner);
+int                 owner_is_capture_allowed(const owner_info_t *owner);
+
+#endif // OWNER_H
@@ -11,6 +11,7 @@
 #include "halen.h"
 
 static int parse_color(const char *color_string, XftColor *xft_color, Display *display);
+static char** key_binding(config_t *config, const char *key);
 
 // Initialize config with defaults
 void config_init(config_t *config) {
@@ -32,6 +33,21 @@ void config_init(config_t *config) {
     config->anchor = ANCHOR_CENTER_CENTER;
     config->margin_vertical = 10;
     config->margin_horizontal = 10;
+    config->list_rows = 0;
+    config->capture_targets = strdup("text/html text/uri-list image/png");
+    config->max_target_size = 10240;
+    config->primary_history = 0;
+    config->primary_history_size = 50;
+    config->capture_allow = strdup("");
+    config->capture_deny = strdup("keepassxc");
+    config->sensitive_timeout = 0;
+    config->key_paste = strdup("v");
+    config->key_previous = strdup("c");
+    config->key_cut = strdup("x");
+    config->key_cancel = strdup("z");
+    config->key_delete = strdup("d");
+    config->key_ring = strdup("p");
+    config->key_events = KEY_EVENTS_XINPUT2;
     
     char *cache_directory = xdg_get_directory(XDG_CACHE_HOME);
     if (cache_directory) {
@@ -101,6 +117,17 @@ static int parse_color(const char *color_string, XftColor *xft_color, Display *d
     return 1;
 }
 
+// the config field of a key_* option, NULL for other keys
+static char** key_binding(config_t *config, const char *key) {
+    if (strcmp(key, "key_paste") == 0) return &config->key_paste;
+    if (strcmp(key, "key_previous") == 0) return &config->key_previous;
+    if (strcmp(key, "key_cut") == 0) return &config->key_cut;
+    if (strcmp(key, "key_cancel") == 0) return &config->key_cancel;
+    if (strcmp(key, "key_delete") == 0) return &config->key_delete;
+    if (strcmp(key, "key_ring") == 0) return &config->key_ring;
+    return NULL;
+}
+
 void free_color(XftColor *color, Display *display) {
     if (color && display) {
         XftColorFree(display, DefaultVisual(display, DefaultScreen(display)),
@@ -205,6 +232,16 @@ int config_parse_file(config_t *config, const char *filename) {
                 msg(LOG_WARNING, "Invalid max_lines value '%s' on line %d (must be 1-100)", value, line_number);
             }
             
+        } else if (strcmp(key, "list_rows") == 0) {
+            char *endptr;
+            long list_rows_value = strtol(value, &endptr, 10);
+            if (*endptr == '\0' && list_rows_value >= 0 && list_rows_value <= 30) {
+                config->list_rows = (int)list_rows_value;
+                msg(LOG_DEBUG, "Config: list_rows = %d", config->list_rows);
+            } else {
+                msg(LOG_WARNING, "Invalid list_rows value '%s' on line %d (must be 0-30)", value, line_number);
+            }
+            
         } else if (strcmp(key, "max_line_length") == 0) {
             char *endptr;
             long max_line_length_value = strtol(value, &endptr, 10);
@@ -334,6 +371,85 @@ int config_parse_file(config_t *config, const char *filename) {
                 }
             }
 
+        } else if (strcmp(key, "capture_targets") == 0) {
+            if (config->capture_targets) {
+                free(config->capture_targets);
+            }
+            config->capture_targets = strdup(value);
+            msg(LOG_DEBUG, "Config: capture_targets = %s", config->capture_targets);
+            
+        } else if (strcmp(key, "max_target_size") == 0) {
+            char *endptr;
+            long max_target_size_value = strtol(value, &endptr, 10);
+            if (*endptr == '\0' && max_target_size_value > 0 && max_target_size_value <= 51200) {
+                config->max_target_size = (int)max_target_size_value;
+                msg(LOG_DEBUG, "Config: max_target_size = %d KiB", config->max_target_size);
+            } else {
+                msg(LOG_WARNING, "Invalid max_target_size value '%s' on line %d (must be 1-51200)", value, line_number);
+            }
+            
+        } else if (strcmp(key, "capture_allow") == 0) {
+            if (config->capture_allow) {
+                free(config->capture_allow);
+            }
+            config->capture_allow = strdup(value);
+            msg(LOG_DEBUG, "Config: capture_allow = %s", config->capture_allow);
+            
+        } else if (strcmp(key, "capture_deny") == 0) {
+            if (config->capture_deny) {
+                free(config->capture_deny);
+            }
+            config->capture_deny = strdup(value);
+            msg(LOG_DEBUG, "Config: capture_deny = %s", config->capture_deny);
+            
+        } else if (strcmp(key, "sensitive_timeout") == 0) {
+            char *endptr;
+            long sensitive_timeout_value = strtol(value, &endptr, 10);
+            if (*endptr == '\0' && sensitive_timeout_value >= 0 && sensitive_timeout_value <= 3600) {
+                config->sensitive_timeout = (int)sensitive_timeout_value;
+                msg(LOG_DEBUG, "Config: sensitive_timeout = %d", config->sensitive_timeout);
+            } else {
+                msg(LOG_WARNING, "Invalid sensitive_timeout value '%s' on line %d (must be 0-3600)", value, line_number);
+            }
+            
+        } else if (strcmp(key, "key_events") == 0) {
+            if (strcasecmp(value, "xinput2") == 0) {
+                config->key_events = KEY_EVENTS_XINPUT2;
+                msg(LOG_DEBUG, "Config: key_events = XINPUT2");
+            } else if (strcasecmp(value, "xrecord") == 0) {
+                config->key_events = KEY_EVENTS_XRECORD;
+                msg(LOG_DEBUG, "Config: key_events = XRECORD");
+            } else {
+                msg(LOG_WARNING, "Invalid key_events value '%s' on line %d (must be xinput2 or xrecord)", value, line_number);
+            }
+            
+        } else if (key_binding(config, key)) {
+            char **binding = key_binding(config, key);
+            if (XStringToKeysym(value) != NoSymbol) {
+                free(*binding);
+                *binding = strdup(value);
+                msg(LOG_DEBUG, "Config: %s = %s", key, *binding);
+            } else {
+                msg(LOG_WARNING, "Invalid %s value '%s' on line %d (must be a keysym name)", key, value, line_number);
+            }
+            
+        } else if (strcmp(key, "primary_history") == 0) {
+            config->primary_history = (strcmp(value, "true") == 0 || 
+                                       strcmp(value, "1") == 0 || 
+                                       strcmp(value, "yes") == 0 ||
+                                       strcmp(value, "on") == 0);
+            msg(LOG_DEBUG, "Config: primary_history = %s", config->primary_history ? "true" : "false");
+            
+        } else if (strcmp(key, "primary_history_size") == 0) {
+            char *endptr;
+            long primary_history_size_value = strtol(value, &endptr, 10);
+            if (*endptr == '\0' && primary_history_size_value > 0 && primary_history_size_value <= 1000) {
+                config->primary_history_size = (int)primary_history_size_value;
+                msg(LOG_DEBUG, "Config: primary_history_size = %d", config->primary_history_size);
+            } else {
+                msg(LOG_WARNING, "Invalid primary_history_size value '%s' on line %d (must be 1-1000)", value, line_number);
+            }
+            
         } else {
             msg(LOG_WARNING, "Unknown config option '%s' on line %d", key, line_number);
         }
@@ -389,6 +505,24 @@ void config_free(config_t *config) {
         free(config->overflow_directory);
         config->overflow_directory = NULL;
     }
+    if (config->capture_targets) {
+        free(config->capture_targets);
+        config->capture_targets = NULL;
+    }
+    if (config->capture_allow) {
+        free(config->capture_allow);
+        config->capture_allow = NULL;
+    }
+    if (config->capture_deny) {
+        free(config->capture_deny);
+        config->capture_deny = NULL;
+    }
+    char **bindings[] = { &config->key_paste, &config->key_previous, &config->key_cut,
+                          &config->key_cancel, &config->key_delete, &config->key_ring };
+    for (size_t i = 0; i < sizeof(bindings) / sizeof(bindings[0]); i++) {
+        free(*bindings[i]);
+        *bindings[i] = NULL;
+    }
     if (config->background_color_string) {
         free(config->background_color_string);
         config->background_color_string = NULL;
@@ -443,4 +577,24 @@ void config_print(const config_t *config) {
     } else {
         msg(LOG_NOTICE, "  margin: %d %d pixels", config->margin_vertical, config->margin_horizontal);
     }
+    if (config->list_rows > 0) {
+        msg(LOG_NOTICE, "  list_rows: %d", config->list_rows);
+    } else {
+        msg(LOG_NOTICE, "  list_rows: 0 (one entry at a time)");
+    }
+    msg(LOG_NOTICE, "  capture_targets: %s", config->capture_targets ? config->capture_targets : "(none)");
+    msg(LOG_NOTICE, "  max_target_size: %d KiB", config->max_target_size);
+    msg(LOG_NOTICE, "  capture_allow: %s", config->capture_allow && config->capture_allow[0] ? config->capture_allow : "(all)");
+    msg(LOG_NOTICE, "  capture_deny: %s", config->capture_deny && config->capture_deny[0] ? config->capture_deny : "(none)");
+    if (config->sensitive_timeout > 0) {
+        msg(LOG_NOTICE, "  sensitive_timeout: %d seconds", config->sensitive_timeout);
+    } else {
+        msg(LOG_NOTICE, "  sensitive_timeout: 0 (sensitive entries are skipped)");
+    }
+    msg(LOG_NOTICE, "  primary_history: %s (%d entries)", config->primary_history ? "true" : "false",
+        config->primary_history_size);
+    msg(LOG_NOTICE, "  keys: paste %s, previous %s, cut %s, cancel %s, delete %s, ring %s",
+        config->key_paste, config->key_previous, config->key_cut,
+        config->key_cancel, config->key_delete, config->key_ring);
+    msg(LOG_NOTICE, "  key_events: %s", config->key_events == KEY_EVENTS_XINPUT2 ? "xinput2" : "xrecord");
 }
@@ -1,6 +1,11 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xrandr.h>
 #include <fontconfig/fontconfig.h>
 #include <string.h>
 #include <stdlib.h>
@@ -8,29 +13,122 @@
 #include <sys/syslog.h>
 #include <unistd.h>
 #include <time.h>
+#include <ctype.h>
 
 #include "popup.h"
 #include "halen.h"
 #include "text.h"
 #include "history.h"
+#include "thumbnail.h"
+#include "latency.h"
+
+#define THUMBNAIL_CACHE_SIZE 16
+#define LAYOUT_CACHE_SIZE 16
+#define MAX_MONITORS 16
+#define ROW_CACHE_SIZE 64
+#define ROW_PREVIEW_LENGTH 256
+#define ROW_MARGIN 10
+
+// thumbnails are uploaded once and kept as server side pictures,
+// redraws and navigation only composite them
+typedef struct {
+    char *image_hash;
+    Pixmap pixmap;
+    Picture picture;
+    int width;
+    int height;
+    unsigned long last_used;
+} thumbnail_picture_t;
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} monitor_t;
+
+// list mode: a row is rendered once into a pixmap of its own, keyed by
+// what it shows. Only the visible rows are looked at, scrolling copies
+// the rows that are already rendered
+typedef struct {
+    uint64_t key;
+    Pixmap pixmap;
+    unsigned long last_used;
+} row_picture_t;
+
+// where the lines of an entry go and how much room they need, keyed by a
+// hash of the text seeded with the font, so a redraw measures nothing
+typedef struct {
+    uint64_t key;
+    char *text;             // unescaped, every line NUL terminated
+    int *line_starts;
+    int line_count;
+    int width;
+    int height;
+    unsigned long last_used;
+} text_layout_t;
 
 static Display *display = NULL;
 static Window root_window = 0;
 static Window popup_window = 0;
 static GC popup_gc = 0;
+static GC background_gc = 0;
+static Pixmap back_buffer = 0;
+static int back_buffer_width = 0;
+static int back_buffer_height = 0;
 static XftDraw *xft_draw = NULL;
 static XftFont *xft_font = NULL;
 static XftFont *xft_font_small = NULL;
 static int screen_width = 0;
 static int screen_height = 0;
+
+// queried once and again when the screen layout changes, the popup stays
+// on the monitor it was opened on for the whole session
+static monitor_t monitors[MAX_MONITORS];
+static int monitor_count = 0;
+static int randr_event_base = -1;
+static monitor_t popup_monitor;
+static int pointer_x = 0;
+static int pointer_y = 0;
 static int showing_popup = 0;  
 static char *popup_text_buffer = NULL;
 static size_t popup_text_capacity = 0;
+static char statusbar_text[256];
 static int font_height = 14;
 static int font_ascent = 12;
 static int anchor_x = -1;
 static int anchor_y = -1;
 static int initial_resize_done = 0;
+static int has_render_extension = 0;
+static thumbnail_picture_t thumbnail_cache[THUMBNAIL_CACHE_SIZE];
+static unsigned long thumbnail_cache_clock = 0;
+static thumbnail_picture_t *current_thumbnail = NULL;
+static text_layout_t layout_cache[LAYOUT_CACHE_SIZE];
+static unsigned long layout_cache_clock = 0;
+static unsigned long layout_hits = 0;
+static unsigned long layout_misses = 0;
+static uint64_t layout_seed = TEXT_HASH64_SEED;
+static text_layout_t *current_layout = NULL;
+static int prefetch_timer = 0;
+static row_picture_t row_cache[ROW_CACHE_SIZE];
+static unsigned long row_cache_clock = 0;
+static XftDraw *row_draw = NULL;
+static int list_top = 0;
+static unsigned long rows_rendered = 0;
+static unsigned long rows_copied = 0;
+
+// the geometry is only ever set from here, nothing has to ask the server
+static int window_width = 600;
+static int window_height = 200;
+
+// the pointer position is asked for when Control goes down and picked up
+// when the popup is shown, by then the reply is in
+static xcb_query_pointer_cookie_t pointer_cookie;
+static int pointer_query_pending = 0;
+
+// requests in a popup session that wait for the server
+static unsigned long session_round_trips = 0;
+static unsigned long session_redraws = 0;
 
 static int ensure_popup_text_capacity(void) {
     size_t required_capacity = (config.max_lines * config.max_line_length) + 1024;
@@ -60,62 +158,465 @@ static int ensure_popup_text_capacity(void) {
     return 1;
 }
 
-static char *cached_unescaped_text = NULL;
-static size_t cached_unescaped_capacity = 0;
+void popup_redraw(void);
+static int create_popup_window(void);
+static void layout_popup(void);
+static void draw_popup(void);
+static void build_statusbar_text(void);
+static void ensure_back_buffer(int width, int height);
+static void present_back_buffer(void);
+static int build_text_layout(text_layout_t *layout, const char *text, size_t length);
+static void free_text_layout(text_layout_t *layout);
+static text_layout_t* get_text_layout(const char *text);
+static void prefetch_neighbor_layouts(void *data);
+static int row_preview(int index, char *preview, size_t size);
+static Pixmap get_row_pixmap(const char *preview, int highlighted, int width, int height);
+static void draw_list_rows(int top_y);
+static void get_mouse_position(int *mouse_x_coordinate, int *mouse_y_coordinate);
+static void refresh_monitors(void);
+static const monitor_t* monitor_at(int x, int y);
+static void choose_popup_monitor(void);
+static void calculate_position_from_anchor(int reference_x, int reference_y, int window_width, int window_height, int *final_x, int *final_y);
+static void resize_window(void);
+static thumbnail_picture_t* get_thumbnail_picture(const char *image_hash);
+static void free_thumbnail_picture(thumbnail_picture_t *thumbnail);
+static void update_current_thumbnail(void);
+void popup_redraw(void);
 
-static char* get_unescaped_text_cached(const char *escaped_text) {
-    size_t required_length = strlen(escaped_text) + 1;
-    
-    if (!cached_unescaped_text || cached_unescaped_capacity < required_length) {
-        char *new_buffer = realloc(cached_unescaped_text, required_length);
-        if (!new_buffer) {
-            return text_unescape_content(escaped_text);
-        }
-        cached_unescaped_text = new_buffer;
-        cached_unescaped_capacity = required_length;
-    }
+static int build_text_layout(text_layout_t *layout, const char *text, size_t length) {
+    char *unescaped_text = malloc(length + 1);
+    if (!unescaped_text) return 0;
     
-    const char *source = escaped_text;
-    char *destination = cached_unescaped_text;
+    const char *source = text;
+    const char *source_end = text + length;
+    char *destination = unescaped_text;
+    int newline_count = 0;
     
-    while (*source) {
-        if (*source == '\\' && *(source + 1)) {
+    while (source < source_end) {
+        if (*source == '\\' && source + 1 < source_end) {
             switch (*(source + 1)) {
-                case 'n': *destination++ = '\n'; source += 2; break;
+                case 'n': *destination++ = '\n'; source += 2; newline_count++; break;
                 case 'r': *destination++ = '\r'; source += 2; break;
                 case 't': *destination++ = '\t'; source += 2; break;
                 default: *destination++ = *source++; break;
             }
         } else {
+            if (*source == '\n') newline_count++;
             *destination++ = *source++;
         }
     }
     *destination = '\0';
     
-    return cached_unescaped_text;
+    int *line_starts = malloc(sizeof(int) * (newline_count + 1));
+    if (!line_starts) {
+        free(unescaped_text);
+        return 0;
+    }
+    
+    int max_width = 0;
+    int total_height = font_height + 20;
+    int line_count = 0;
+    char *line_start = unescaped_text;
+    
+    // every line that ends with a newline counts, the last one only if
+    // there is something on it
+    while (1) {
+        char *line_end = strchr(line_start, '\n');
+        if (!line_end && !*line_start) break;
+        if (line_end) *line_end = '\0';
+        
+        XGlyphInfo extents;
+        XftTextExtentsUtf8(display, xft_font, (FcChar8*)line_start, strlen(line_start), &extents);
+        if (extents.width > max_width) max_width = extents.width;
+        total_height += font_height + 2;
+        line_starts[line_count++] = (int)(line_start - unescaped_text);
+        
+        if (!line_end) break;
+        line_start = line_end + 1;
+    }
+    
+    total_height += font_height + 30;
+    
+    layout->text = unescaped_text;
+    layout->line_starts = line_starts;
+    layout->line_count = line_count;
+    layout->width = max_width + 40;
+    layout->height = total_height;
+    
+    return 1;
+}
+
+static void free_text_layout(text_layout_t *layout) {
+    free(layout->text);
+    free(layout->line_starts);
+    memset(layout, 0, sizeof(*layout));
+}
+
+// the text is laid out as the popup would hold it, cut at the buffer size
+static text_layout_t* get_text_layout(const char *text) {
+    if (!xft_font || !ensure_popup_text_capacity()) return NULL;
+    
+    size_t length = strnlen(text, popup_text_capacity - 1);
+    uint64_t key = text_hash64_update(layout_seed, text, length);
+    text_layout_t *least_recently_used = &layout_cache[0];
+    
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+        text_layout_t *layout = &layout_cache[i];
+        if (layout->text && layout->key == key) {
+            layout->last_used = ++layout_cache_clock;
+            layout_hits++;
+            return layout;
+        }
+        if (layout->last_used < least_recently_used->last_used) {
+            least_recently_used = layout;
+        }
+    }
+    
+    if (least_recently_used == current_layout) {
+        current_layout = NULL;
+    }
+    free_text_layout(least_recently_used);
+    if (!build_text_layout(least_recently_used, text, length)) {
+        return NULL;
+    }
+    
+    least_recently_used->key = key;
+    least_recently_used->last_used = ++layout_cache_clock;
+    layout_misses++;
+    return least_recently_used;
 }
 
-void popup_redraw(void);
-static int calculate_text_dimensions(const char *text, int *width, int *height);
-static void get_mouse_position(int *mouse_x_coordinate, int *mouse_y_coordinate);
-static void calculate_position_from_anchor(int reference_x, int reference_y, int window_width, int window_height, int *final_x, int *final_y);
-static void resize_window(void);
-void popup_redraw(void);
+// the entries next to the current one are laid out (and their thumbnails
+// uploaded) while the popup waits for the next key, stepping to them only
+// draws. Runs from the event loop after the redraw is on screen
+static void prefetch_neighbor_layouts(void *data) {
+    (void)data;
+    
+    prefetch_timer = 0;
+    if (!showing_popup || config.list_rows > 0) return;
+    
+    int history_count = history_get_count();
+    int current_index = history_get_current_index();
+    if (current_index < 0) current_index = 0;
+    if (history_count < 2) return;
+    
+    int neighbors[2] = {
+        (current_index + 1) % history_count,
+        (current_index - 1 + history_count) % history_count
+    };
+    
+    for (int i = 0; i < 2; i++) {
+        char *text = history_get_entry_truncated(neighbors[i]);
+        if (text) {
+            get_text_layout(text);
+            free(text);
+        }
+        
+        if (has_render_extension) {
+            char *image_hash = history_get_entry_image(neighbors[i]);
+            if (image_hash) {
+                get_thumbnail_picture(image_hash);
+                free(image_hash);
+            }
+        }
+    }
+}
+
+// the first line of an entry, as much of it as a row can show
+static int row_preview(int index, char *preview, size_t size) {
+    char *content = history_get_entry_truncated(index);
+    if (!content) return 0;
+    
+    const char *source = content;
+    size_t length = 0;
+    
+    while (*source && length < size - 1) {
+        if (*source == '\n' || (source[0] == '\\' && source[1] == 'n')) break;
+        if (source[0] == '\\' && (source[1] == 't' || source[1] == 'r')) {
+            preview[length++] = ' ';
+            source += 2;
+            continue;
+        }
+        preview[length++] = *source++;
+    }
+    
+    // not in the middle of a UTF-8 sequence
+    if (length == size - 1 && ((unsigned char)*source & 0xC0) == 0x80) {
+        while (length > 0 && ((unsigned char)preview[length - 1] & 0xC0) == 0x80) length--;
+        if (length > 0) length--;
+    }
+    preview[length] = '\0';
+    
+    free(content);
+    return 1;
+}
+
+static Pixmap get_row_pixmap(const char *preview, int highlighted, int width, int height) {
+    int row_state[3] = { highlighted, width, height };
+    uint64_t key = text_hash64_update(layout_seed, preview, strlen(preview));
+    key = text_hash64_update(key, (const char *)row_state, sizeof(row_state));
+    
+    row_picture_t *least_recently_used = &row_cache[0];
+    for (int i = 0; i < ROW_CACHE_SIZE; i++) {
+        row_picture_t *row = &row_cache[i];
+        if (row->pixmap && row->key == key) {
+            row->last_used = ++row_cache_clock;
+            rows_copied++;
+            return row->pixmap;
+        }
+        if (row->last_used < least_recently_used->last_used) {
+            least_recently_used = row;
+        }
+    }
+    
+    row_picture_t *row = least_recently_used;
+    if (row->pixmap) XFreePixmap(display, row->pixmap);
+    row->pixmap = XCreatePixmap(display, popup_window, width, height,
+                                DefaultDepth(display, DefaultScreen(display)));
+    
+    if (!row_draw) {
+        row_draw = XftDrawCreate(display, row->pixmap,
+                                 DefaultVisual(display, DefaultScreen(display)),
+                                 DefaultColormap(display, DefaultScreen(display)));
+        if (!row_draw) {
+            XFreePixmap(display, row->pixmap);
+            memset(row, 0, sizeof(*row));
+            return 0;
+        }
+    } else {
+        XftDrawChange(row_draw, row->pixmap);
+    }
+    
+    // the selected row is drawn inverted
+    XftDrawRect(row_draw, highlighted ? &config.foreground : &config.background, 0, 0, width, height);
+    XftDrawStringUtf8(row_draw, highlighted ? &config.background : &config.foreground, xft_font,
+                      5, (height - font_height) / 2 + font_ascent, (FcChar8*)preview, strlen(preview));
+    
+    row->key = key;
+    row->last_used = ++row_cache_clock;
+    rows_rendered++;
+    return row->pixmap;
+}
+
+static void draw_list_rows(int top_y) {
+    int history_count = history_get_count();
+    int current_index = history_get_current_index();
+    if (current_index < 0) current_index = 0;
+    
+    int row_height = font_height + 4;
+    int row_width = window_width - 2 * ROW_MARGIN;
+    if (row_width <= 0) return;
+    
+    // scrolls as little as it takes to keep the selected entry visible
+    if (current_index < list_top) list_top = current_index;
+    if (current_index >= list_top + config.list_rows) list_top = current_index - config.list_rows + 1;
+    if (list_top > history_count - config.list_rows) list_top = history_count - config.list_rows;
+    if (list_top < 0) list_top = 0;
+    
+    char preview[ROW_PREVIEW_LENGTH];
+    for (int row = 0; row < config.list_rows && list_top + row < history_count; row++) {
+        int index = list_top + row;
+        if (!row_preview(index, preview, sizeof(preview))) continue;
+        
+        Pixmap pixmap = get_row_pixmap(preview, index == current_index, row_width, row_height);
+        if (pixmap) {
+            XCopyArea(display, pixmap, back_buffer, popup_gc, 0, 0, row_width, row_height,
+                      ROW_MARGIN, top_y + row * row_height);
+        }
+    }
+}
+
+static void free_thumbnail_picture(thumbnail_picture_t *thumbnail) {
+    if (thumbnail->picture) XRenderFreePicture(display, thumbnail->picture);
+    if (thumbnail->pixmap) XFreePixmap(display, thumbnail->pixmap);
+    free(thumbnail->image_hash);
+    memset(thumbnail, 0, sizeof(*thumbnail));
+}
+
+static thumbnail_picture_t* get_thumbnail_picture(const char *image_hash) {
+    thumbnail_picture_t *least_recently_used = &thumbnail_cache[0];
+    
+    for (int i = 0; i < THUMBNAIL_CACHE_SIZE; i++) {
+        thumbnail_picture_t *thumbnail = &thumbnail_cache[i];
+        if (thumbnail->image_hash && strcmp(thumbnail->image_hash, image_hash) == 0) {
+            thumbnail->last_used = ++thumbnail_cache_clock;
+            return thumbnail;
+        }
+        if (thumbnail->last_used < least_recently_used->last_used) {
+            least_recently_used = thumbnail;
+        }
+    }
+    
+    int width, height, image_width, image_height;
+    uint32_t *pixels = thumbnail_load(image_hash, &width, &height);
+    if (!pixels && thumbnail_create(image_hash, &image_width, &image_height)) {
+        pixels = thumbnail_load(image_hash, &width, &height);
+    }
+    if (!pixels) return NULL;
+    
+    XImage *image = XCreateImage(display, DefaultVisual(display, DefaultScreen(display)), 32, ZPixmap, 0,
+                                 (char *)pixels, width, height, 32, 0);
+    if (!image) {
+        free(pixels);
+        return NULL;
+    }
+    
+    free_thumbnail_picture(least_recently_used);
+    thumbnail_picture_t *thumbnail = least_recently_used;
+    
+    thumbnail->pixmap = XCreatePixmap(display, root_window, width, height, 32);
+    GC pixmap_gc = XCreateGC(display, thumbnail->pixmap, 0, NULL);
+    XPutImage(display, thumbnail->pixmap, pixmap_gc, image, 0, 0, 0, 0, width, height);
+    XFreeGC(display, pixmap_gc);
+    XDestroyImage(image);
+    
+    thumbnail->picture = XRenderCreatePicture(display, thumbnail->pixmap,
+                                              XRenderFindStandardFormat(display, PictStandardARGB32), 0, NULL);
+    thumbnail->image_hash = strdup(image_hash);
+    thumbnail->width = width;
+    thumbnail->height = height;
+    thumbnail->last_used = ++thumbnail_cache_clock;
+    
+    msg(LOG_DEBUG, "Created %dx%d thumbnail picture for %s", width, height, image_hash);
+    return thumbnail;
+}
+
+static void update_current_thumbnail(void) {
+    current_thumbnail = NULL;
+    if (!has_render_extension) return;
+    
+    char *image_hash = history_get_entry_image(history_get_current_index());
+    if (image_hash) {
+        current_thumbnail = get_thumbnail_picture(image_hash);
+        free(image_hash);
+    }
+}
+
+// the window and what draws on it live as long as the popup system, a
+// show or hide only maps or unmaps it
+static int create_popup_window(void) {
+    XSetWindowAttributes window_attributes;
+    window_attributes.background_pixel = config.background.pixel;
+    window_attributes.border_pixel = config.foreground.pixel;
+    window_attributes.override_redirect = True;
+    
+    int popup_x = (screen_width - window_width) / 2;
+    int popup_y = (screen_height - window_height) / 2;
+    
+    popup_window = XCreateWindow(display, root_window,
+                                popup_x, popup_y, window_width, window_height,
+                                2, CopyFromParent, InputOutput, CopyFromParent,
+                                CWBackPixel | CWBorderPixel | CWOverrideRedirect,
+                                &window_attributes);
+    
+    if (!popup_window) return 0;
+    
+    xft_draw = XftDrawCreate(display, popup_window,
+                            DefaultVisual(display, DefaultScreen(display)),
+                            DefaultColormap(display, DefaultScreen(display)));
+    if (!xft_draw) {
+        XDestroyWindow(display, popup_window);
+        popup_window = 0;
+        return 0;
+    }
+    
+    // copies from the back buffer never leave anything uncovered
+    XGCValues gc_values;
+    gc_values.graphics_exposures = False;
+    popup_gc = XCreateGC(display, popup_window, GCGraphicsExposures, &gc_values);
+    gc_values.foreground = config.background.pixel;
+    background_gc = XCreateGC(display, popup_window, GCForeground | GCGraphicsExposures, &gc_values);
+    XSelectInput(display, popup_window, ExposureMask);
+    
+    return 1;
+}
+
+// the geometry follows the entry, an expose only needs the drawing
+static void layout_popup(void) {
+    if (config.list_rows > 0) {
+        // the rows are laid out when they are drawn
+        current_layout = NULL;
+        current_thumbnail = NULL;
+    } else {
+        current_layout = get_text_layout(popup_text_buffer);
+        update_current_thumbnail();
+    }
+    resize_window();
+    latency_mark(LATENCY_LAYOUT);
+}
 
 void popup_redraw(void) {
     if (!xft_draw || !xft_font || !popup_text_buffer) return;
+    
+    layout_popup();
+    draw_popup();
+}
 
-    XClearWindow(display, popup_window);
-    resize_window();
+// the popup is drawn into a pixmap the size of the window and copied
+// over in one request, so the window never shows a half drawn popup.
+// The pixmap is kept until the window changes size
+static void ensure_back_buffer(int width, int height) {
+    if (back_buffer && back_buffer_width == width && back_buffer_height == height) return;
+    
+    if (back_buffer) XFreePixmap(display, back_buffer);
+    back_buffer = XCreatePixmap(display, popup_window, width, height,
+                                DefaultDepth(display, DefaultScreen(display)));
+    back_buffer_width = width;
+    back_buffer_height = height;
+    XftDrawChange(xft_draw, back_buffer);
+}
+
+static void present_back_buffer(void) {
+    if (!back_buffer) return;
+    
+    XCopyArea(display, back_buffer, popup_window, popup_gc, 0, 0,
+              back_buffer_width, back_buffer_height, 0, 0);
+}
+
+// the key hints follow the configured key_* bindings
+static void build_statusbar_text(void) {
+    struct {
+        const char *key;
+        const char *action;
+        int shown;
+    } hints[] = {
+        { config.key_paste, "Next", 1 },
+        { config.key_previous, "Prev", 1 },
+        { config.key_cut, "Cut", 1 },
+        { config.key_delete, "Delete", 1 },
+        { config.key_ring, "Primary", config.primary_history },
+        { config.key_cancel, "Cancel", 1 }
+    };
+    
+    size_t length = 0;
+    statusbar_text[0] = '\0';
+    for (size_t i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+        if (!hints[i].shown || !hints[i].key) continue;
+        
+        const char *separator = length > 0 ? " | " : "";
+        int written = snprintf(statusbar_text + length, sizeof(statusbar_text) - length, "%s%s: %s",
+                               separator, hints[i].key, hints[i].action);
+        if (written < 0 || (size_t)written >= sizeof(statusbar_text) - length) break;
+        
+        // single letters are shown the way the keys are labelled
+        if (strlen(hints[i].key) == 1) {
+            char *letter = statusbar_text + length + strlen(separator);
+            *letter = toupper((unsigned char)*letter);
+        }
+        length += written;
+    }
+}
+
+static void draw_popup(void) {
+    if (!xft_draw || !xft_font || !popup_text_buffer) return;
     
-    const char *statusbar_text = "V: Next | C: Prev | X: Cut | D: Delete | Z: Cancel";
-     
     int current_y_position = font_ascent + 20;
     const int line_spacing = font_height + 2;
     int left_margin = 15;
 
-    XWindowAttributes window_attributes;
-    XGetWindowAttributes(display, popup_window, &window_attributes);
+    session_redraws++;
+    ensure_back_buffer(window_width, window_height);
+    XFillRectangle(display, back_buffer, background_gc, 0, 0, window_width, window_height);
 
     char index_count_text[32];
     int history_count = history_get_count();
@@ -123,7 +624,8 @@ void popup_redraw(void) {
     
     int display_index = (current_index == -1) ? 1 : current_index + 1;
     
-    snprintf(index_count_text, sizeof(index_count_text), "%d/%d", 
+    snprintf(index_count_text, sizeof(index_count_text), "%s%d/%d", 
+              history_get_ring() == HISTORY_RING_PRIMARY ? "PRIMARY " : "",
               display_index, history_count);
     
     XftFont *small_font = xft_font_small ? xft_font_small : xft_font;
@@ -131,60 +633,172 @@ void popup_redraw(void) {
     XftTextExtentsUtf8(display, small_font, (FcChar8*)index_count_text, 
                        strlen(index_count_text), &index_extents);
     
-    int index_x_position = window_attributes.width - index_extents.width - 2;
+    int index_x_position = window_width - index_extents.width - 2;
     int index_y_position = small_font->ascent + 2;
     
     XftDrawStringUtf8(xft_draw, &config.count_color, small_font, index_x_position, index_y_position,
                       (FcChar8*)index_count_text, strlen(index_count_text));
      
-    char *unescaped_text = get_unescaped_text_cached(popup_text_buffer);
-    if (unescaped_text) {
-        char *line_start = unescaped_text;
-        char *line_end;
-         
-        while ((line_end = strchr(line_start, '\n')) != NULL) {
-            *line_end = '\0';
+    if (config.list_rows > 0) {
+        draw_list_rows(20);
+    }
+    
+    if (current_thumbnail) {
+        XRenderComposite(display, PictOpOver, current_thumbnail->picture, None, XftDrawPicture(xft_draw),
+                         0, 0, 0, 0, left_margin, 20, current_thumbnail->width, current_thumbnail->height);
+        current_y_position += current_thumbnail->height + 5;
+    }
+    
+    if (current_layout) {
+        for (int i = 0; i < current_layout->line_count; i++) {
+            const char *line = current_layout->text + current_layout->line_starts[i];
             XftDrawStringUtf8(xft_draw, &config.foreground, xft_font, left_margin, current_y_position,
-                              (FcChar8*)line_start, strlen(line_start));
+                              (FcChar8*)line, strlen(line));
             current_y_position += line_spacing;
-            line_start = line_end + 1;
-        }
-         
-        if (*line_start) {
-            XftDrawStringUtf8(xft_draw, &config.foreground, xft_font, left_margin, current_y_position,
-                              (FcChar8*)line_start, strlen(line_start));
         }
     }
      
-    int statusbar_y = window_attributes.height - font_height - 2;
+    int statusbar_y = window_height - font_height - 2;
     int separator_y = statusbar_y - font_height / 2 + 5;
     left_margin = 5;
     
-    XDrawLine(display, popup_window, popup_gc, left_margin, separator_y, 
-              window_attributes.width - left_margin, separator_y);
+    XDrawLine(display, back_buffer, popup_gc, left_margin, separator_y, 
+              window_width - left_margin, separator_y);
 
     XftFont *statusbar_font = xft_font_small ? xft_font_small : xft_font;
     int statusbar_ascent = statusbar_font->ascent;
     
     XftDrawStringUtf8(xft_draw, &config.foreground, statusbar_font, left_margin, statusbar_y + statusbar_ascent,
                       (FcChar8*)statusbar_text, strlen(statusbar_text));
+    
+    present_back_buffer();
+    latency_mark(LATENCY_DRAW);
 
     XFlush(display);
+    latency_mark(LATENCY_FLUSH);
+    latency_end();
+    
+    if (!prefetch_timer) {
+        prefetch_timer = reactor_add_timer(g_reactor, 0, prefetch_neighbor_layouts, NULL);
+    }
+}
+
+// sends the query and returns, the popup picks the reply up when it is
+// shown. Called when Control goes down, on the main thread
+void popup_prefetch_pointer(void) {
+    if (!display || showing_popup || config.position == POPUP_POSITION_ABSOLUTE) return;
+    
+    xcb_connection_t *connection = XGetXCBConnection(display);
+    if (pointer_query_pending) {
+        xcb_discard_reply(connection, pointer_cookie.sequence);
+    }
+    pointer_cookie = xcb_query_pointer(connection, root_window);
+    pointer_query_pending = 1;
+    xcb_flush(connection);
 }
 
 static void get_mouse_position(int *mouse_x_coordinate, int *mouse_y_coordinate) {
+    if (pointer_query_pending) {
+        xcb_connection_t *connection = XGetXCBConnection(display);
+        xcb_query_pointer_reply_t *reply = NULL;
+        xcb_generic_error_t *error = NULL;
+        pointer_query_pending = 0;
+        
+        if (!xcb_poll_for_reply(connection, pointer_cookie.sequence, (void **)&reply, &error)) {
+            session_round_trips++;
+            reply = xcb_query_pointer_reply(connection, pointer_cookie, &error);
+        }
+        free(error);
+        
+        if (reply) {
+            *mouse_x_coordinate = reply->root_x;
+            *mouse_y_coordinate = reply->root_y;
+            free(reply);
+            return;
+        }
+    }
+    
     Window root_return, child_return;
     int root_x, root_y, window_x, window_y;
     unsigned int mask_return;
     
+    session_round_trips++;
     if (XQueryPointer(display, root_window, &root_return, &child_return,
                       &root_x, &root_y, &window_x, &window_y, &mask_return)) {
         *mouse_x_coordinate = root_x;
         *mouse_y_coordinate = root_y;
     } else {
-        *mouse_x_coordinate = screen_width / 2;
-        *mouse_y_coordinate = screen_height / 2;
+        *mouse_x_coordinate = monitors[0].x + monitors[0].width / 2;
+        *mouse_y_coordinate = monitors[0].y + monitors[0].height / 2;
+    }
+}
+
+// RandR 1.5 monitors, the primary one first. Without them the whole
+// screen is one monitor
+static void refresh_monitors(void) {
+    monitor_count = 0;
+    
+    if (randr_event_base >= 0) {
+        int count = 0;
+        XRRMonitorInfo *monitor_info = XRRGetMonitors(display, root_window, True, &count);
+        for (int i = 0; i < count && monitor_count < MAX_MONITORS; i++) {
+            monitor_t monitor = { monitor_info[i].x, monitor_info[i].y,
+                                  monitor_info[i].width, monitor_info[i].height };
+            if (monitor_info[i].primary && monitor_count > 0) {
+                monitors[monitor_count++] = monitors[0];
+                monitors[0] = monitor;
+            } else {
+                monitors[monitor_count++] = monitor;
+            }
+        }
+        if (monitor_info) XRRFreeMonitors(monitor_info);
+    }
+    
+    if (monitor_count == 0) {
+        monitors[0] = (monitor_t){ 0, 0, screen_width, screen_height };
+        monitor_count = 1;
+    }
+    
+    for (int i = 0; i < monitor_count; i++) {
+        msg(LOG_DEBUG, "Monitor %d: %dx%d+%d+%d", i, monitors[i].width, monitors[i].height,
+            monitors[i].x, monitors[i].y);
+    }
+}
+
+static const monitor_t* monitor_at(int x, int y) {
+    for (int i = 0; i < monitor_count; i++) {
+        if (x >= monitors[i].x && x < monitors[i].x + monitors[i].width &&
+            y >= monitors[i].y && y < monitors[i].y + monitors[i].height) {
+            return &monitors[i];
+        }
+    }
+    return &monitors[0];
+}
+
+// the monitor with the pointer, or the one with the configured position
+static void choose_popup_monitor(void) {
+    if (config.position == POPUP_POSITION_ABSOLUTE) {
+        popup_monitor = *monitor_at(config.position_x, config.position_y);
+        return;
+    }
+    
+    get_mouse_position(&pointer_x, &pointer_y);
+    popup_monitor = *monitor_at(pointer_x, pointer_y);
+}
+
+// RRScreenChangeNotify, returns 1 if the event was one
+int popup_handle_screen_event(XEvent *event) {
+    if (randr_event_base < 0 || event->type != randr_event_base + RRScreenChangeNotify) {
+        return 0;
     }
+    
+    XRRUpdateConfiguration(event);
+    screen_width = WidthOfScreen(DefaultScreenOfDisplay(display));
+    screen_height = HeightOfScreen(DefaultScreenOfDisplay(display));
+    msg(LOG_DEBUG, "Screen layout changed to %dx%d, refreshing monitors", screen_width, screen_height);
+    refresh_monitors();
+    
+    return 1;
 }
 
 static void calculate_position_from_anchor(int reference_x, int reference_y, int window_width, int window_height, int *final_x, int *final_y) {
@@ -231,13 +845,16 @@ static void calculate_position_from_anchor(int reference_x, int reference_y, int
             break;
     }
     
-    if (*final_x < config.margin_horizontal) *final_x = config.margin_horizontal;
-    if (*final_y < config.margin_vertical) *final_y = config.margin_vertical;
-    if (*final_x + window_width > screen_width - config.margin_horizontal) {
-        *final_x = screen_width - window_width - config.margin_horizontal;
+    int monitor_right = popup_monitor.x + popup_monitor.width;
+    int monitor_bottom = popup_monitor.y + popup_monitor.height;
+    
+    if (*final_x < popup_monitor.x + config.margin_horizontal) *final_x = popup_monitor.x + config.margin_horizontal;
+    if (*final_y < popup_monitor.y + config.margin_vertical) *final_y = popup_monitor.y + config.margin_vertical;
+    if (*final_x + window_width > monitor_right - config.margin_horizontal) {
+        *final_x = monitor_right - window_width - config.margin_horizontal;
     }
-    if (*final_y + window_height > screen_height - config.margin_vertical) {
-        *final_y = screen_height - window_height - config.margin_vertical;
+    if (*final_y + window_height > monitor_bottom - config.margin_vertical) {
+        *final_y = monitor_bottom - window_height - config.margin_vertical;
     }
 }
 
@@ -247,15 +864,32 @@ static void resize_window(void) {
     int calculated_width = 600;
     int calculated_height = 200;
     
-    calculate_text_dimensions(popup_text_buffer, &calculated_width, &calculated_height);
+    if (config.list_rows > 0) {
+        calculated_width = xft_font->max_advance_width * config.max_line_length + 40;
+        calculated_height = font_height + 20 + config.list_rows * (font_height + 4) + font_height + 30;
+    } else if (current_layout) {
+        calculated_width = current_layout->width;
+        calculated_height = current_layout->height;
+    }
+    
+    if (!initial_resize_done) {
+        choose_popup_monitor();
+    }
+    
+    if (current_thumbnail) {
+        if (current_thumbnail->width + 40 > calculated_width) {
+            calculated_width = current_thumbnail->width + 40;
+        }
+        calculated_height += current_thumbnail->height + 5;
+    }
     
     if (calculated_width < 400) calculated_width = 400;
-    if (calculated_width > screen_width - (config.margin_horizontal * 2)) {
-        calculated_width = screen_width - (config.margin_horizontal * 2);
+    if (calculated_width > popup_monitor.width - (config.margin_horizontal * 2)) {
+        calculated_width = popup_monitor.width - (config.margin_horizontal * 2);
     }
     if (calculated_height < 100) calculated_height = 100;
-    if (calculated_height > screen_height - (config.margin_vertical * 2)) {
-        calculated_height = screen_height - (config.margin_vertical * 2);
+    if (calculated_height > popup_monitor.height - (config.margin_vertical * 2)) {
+        calculated_height = popup_monitor.height - (config.margin_vertical * 2);
     }
     
     int window_x_coordinate, window_y_coordinate;
@@ -263,29 +897,26 @@ static void resize_window(void) {
     
     if (!initial_resize_done) {
         switch (config.position) {
-            case POPUP_POSITION_MOUSE: {
-                int mouse_x_coordinate, mouse_y_coordinate;
-                get_mouse_position(&mouse_x_coordinate, &mouse_y_coordinate);
-                reference_x = mouse_x_coordinate;
-                reference_y = mouse_y_coordinate;
+            case POPUP_POSITION_MOUSE:
+                reference_x = pointer_x;
+                reference_y = pointer_y;
                 break;
-            }
             case POPUP_POSITION_SCREEN:
                 switch (config.anchor) {
                     case ANCHOR_TOP_LEFT:
                     case ANCHOR_CENTER_LEFT:
                     case ANCHOR_BOTTOM_LEFT:
-                        reference_x = 0;
+                        reference_x = popup_monitor.x;
                         break;
                     case ANCHOR_TOP_CENTER:
                     case ANCHOR_CENTER_CENTER:
                     case ANCHOR_BOTTOM_CENTER:
-                        reference_x = screen_width / 2;
+                        reference_x = popup_monitor.x + popup_monitor.width / 2;
                         break;
                     case ANCHOR_TOP_RIGHT:
                     case ANCHOR_CENTER_RIGHT:
                     case ANCHOR_BOTTOM_RIGHT:
-                        reference_x = screen_width;
+                        reference_x = popup_monitor.x + popup_monitor.width;
                         break;
                 }
                 
@@ -293,17 +924,17 @@ static void resize_window(void) {
                     case ANCHOR_TOP_LEFT:
                     case ANCHOR_TOP_CENTER:
                     case ANCHOR_TOP_RIGHT:
-                        reference_y = 0;
+                        reference_y = popup_monitor.y;
                         break;
                     case ANCHOR_CENTER_LEFT:
                     case ANCHOR_CENTER_CENTER:
                     case ANCHOR_CENTER_RIGHT:
-                        reference_y = screen_height / 2;
+                        reference_y = popup_monitor.y + popup_monitor.height / 2;
                         break;
                     case ANCHOR_BOTTOM_LEFT:
                     case ANCHOR_BOTTOM_CENTER:
                     case ANCHOR_BOTTOM_RIGHT:
-                        reference_y = screen_height;
+                        reference_y = popup_monitor.y + popup_monitor.height;
                         break;
                 }
                 break;
@@ -312,8 +943,8 @@ static void resize_window(void) {
                 reference_y = config.position_y;
                 break;
             default:
-                reference_x = screen_width / 2;
-                reference_y = screen_height / 2;
+                reference_x = popup_monitor.x + popup_monitor.width / 2;
+                reference_y = popup_monitor.y + popup_monitor.height / 2;
                 break;
         }
         
@@ -400,57 +1031,30 @@ static void resize_window(void) {
         }
         
         if (config.position != POPUP_POSITION_SCREEN) {
-            if (window_x_coordinate < config.margin_horizontal) window_x_coordinate = config.margin_horizontal;
-            if (window_y_coordinate < config.margin_vertical) window_y_coordinate = config.margin_vertical;
-            if (window_x_coordinate + calculated_width > screen_width) {
-                window_x_coordinate = screen_width - calculated_width - config.margin_horizontal;
+            int monitor_right = popup_monitor.x + popup_monitor.width;
+            int monitor_bottom = popup_monitor.y + popup_monitor.height;
+            
+            if (window_x_coordinate < popup_monitor.x + config.margin_horizontal) {
+                window_x_coordinate = popup_monitor.x + config.margin_horizontal;
             }
-            if (window_y_coordinate + calculated_height > screen_height) {
-                window_y_coordinate = screen_height - calculated_height - config.margin_vertical;
+            if (window_y_coordinate < popup_monitor.y + config.margin_vertical) {
+                window_y_coordinate = popup_monitor.y + config.margin_vertical;
+            }
+            if (window_x_coordinate + calculated_width > monitor_right) {
+                window_x_coordinate = monitor_right - calculated_width - config.margin_horizontal;
+            }
+            if (window_y_coordinate + calculated_height > monitor_bottom) {
+                window_y_coordinate = monitor_bottom - calculated_height - config.margin_vertical;
             }
         }
     }
     
+    window_width = calculated_width;
+    window_height = calculated_height;
     XMoveResizeWindow(display, popup_window, window_x_coordinate, window_y_coordinate, 
                       calculated_width, calculated_height);
 }
 
-static int calculate_text_dimensions(const char *text, int *width, int *height) {
-    if (!xft_font || !text) return 0;
-    
-    int max_width = 0;
-    int total_height = font_height + 20;
-    
-    char *unescaped_text = get_unescaped_text_cached(text);
-    if (!unescaped_text) return 0;
-    
-    char *line_start = unescaped_text;
-    char *line_end;
-    
-    while ((line_end = strchr(line_start, '\n')) != NULL) {
-        *line_end = '\0';
-        XGlyphInfo extents;
-        XftTextExtentsUtf8(display, xft_font, (FcChar8*)line_start, strlen(line_start), &extents);
-        if (extents.width > max_width) max_width = extents.width;
-        total_height += font_height + 2;
-        line_start = line_end + 1;
-    }
-    
-    if (*line_start) {
-        XGlyphInfo extents;
-        XftTextExtentsUtf8(display, xft_font, (FcChar8*)line_start, strlen(line_start), &extents);
-        if (extents.width > max_width) max_width = extents.width;
-        total_height += font_height + 2;
-    }
-    
-    total_height += font_height + 30;
-    
-    *width = max_width + 40;
-    *height = total_height;
-    
-    return 1;
-}
-
 int popup_init(Display *display_connection, Window root_window_param, int screen_width_pixels, int screen_height_pixels) {
     display = display_connection;
     root_window = root_window_param;
@@ -459,6 +1063,7 @@ int popup_init(Display *display_connection, Window root_window_param, int screen
     
     popup_text_buffer = NULL;
     popup_text_capacity = 0;
+    build_statusbar_text();
     
     if (!FcInit()) {
         msg(LOG_ERR, "Failed to initialize fontconfig");
@@ -504,6 +1109,33 @@ int popup_init(Display *display_connection, Window root_window_param, int screen
     font_height = xft_font->height;
     font_ascent = xft_font->ascent;
     
+    // layouts are only valid for the font they were measured with
+    layout_seed = text_hash64_update(TEXT_HASH64_SEED, config.font, strlen(config.font));
+    layout_seed = text_hash64_update(layout_seed, (const char *)&config.font_size, sizeof(config.font_size));
+    
+    int render_event_base, render_error_base;
+    has_render_extension = XRenderQueryExtension(display, &render_event_base, &render_error_base);
+    if (!has_render_extension) {
+        msg(LOG_WARNING, "XRender not available, images are shown without thumbnails");
+    }
+    
+    int randr_error_base, randr_major = 0, randr_minor = 0;
+    if (XRRQueryExtension(display, &randr_event_base, &randr_error_base) &&
+        XRRQueryVersion(display, &randr_major, &randr_minor) &&
+        (randr_major > 1 || (randr_major == 1 && randr_minor >= 5))) {
+        XRRSelectInput(display, root_window, RRScreenChangeNotifyMask);
+    } else {
+        msg(LOG_NOTICE, "RandR 1.5 not available, the popup is placed on the whole screen");
+        randr_event_base = -1;
+    }
+    refresh_monitors();
+    popup_monitor = monitors[0];
+    
+    if (!create_popup_window()) {
+        msg(LOG_ERR, "Failed to create popup window");
+        return 0;
+    }
+    
     msg(LOG_NOTICE, "Popup system initialized: %dx%d", 
         screen_width_pixels, screen_height_pixels);
     return 1;
@@ -512,7 +1144,7 @@ int popup_init(Display *display_connection, Window root_window_param, int screen
 int popup_show(const char *text) {
     if (showing_popup) return 1;
     
-    if (!display || !root_window) return 0;
+    if (!display || !popup_window) return 0;
     
     if (!ensure_popup_text_capacity()) {
         return 0;
@@ -521,42 +1153,16 @@ int popup_show(const char *text) {
     strncpy(popup_text_buffer, text, popup_text_capacity - 1);
     popup_text_buffer[popup_text_capacity - 1] = '\0';
     
-    XSetWindowAttributes window_attributes;
-    window_attributes.background_pixel = config.background.pixel;
-    window_attributes.border_pixel = config.foreground.pixel;
-    window_attributes.override_redirect = True;
-    
-    int popup_width = 600;
-    int popup_height = 200;
-    int popup_x = (screen_width - popup_width) / 2;
-    int popup_y = (screen_height - popup_height) / 2;
-    
-    popup_window = XCreateWindow(display, root_window,
-                                popup_x, popup_y, popup_width, popup_height,
-                                2, CopyFromParent, InputOutput, CopyFromParent,
-                                CWBackPixel | CWBorderPixel | CWOverrideRedirect,
-                                &window_attributes);
-    
-    if (!popup_window) return 0;
-    
-    xft_draw = XftDrawCreate(display, popup_window,
-                            DefaultVisual(display, DefaultScreen(display)),
-                            DefaultColormap(display, DefaultScreen(display)));
-    if (!xft_draw) {
-        XDestroyWindow(display, popup_window);
-        popup_window = 0;
-        return 0;
-    }
-    
-    popup_gc = XCreateGC(display, popup_window, 0, NULL);
-    
-    XSelectInput(display, popup_window, ExposureMask);
-    XMapWindow(display, popup_window);
-    XRaiseWindow(display, popup_window);
-    
     showing_popup = 1;
+    list_top = 0;
+    session_round_trips = 0;
+    session_redraws = 0;
     
-    popup_redraw();
+    // moved into place before it is mapped, so it doesn't show up where
+    // it was the last time
+    layout_popup();
+    XMapRaised(display, popup_window);
+    draw_popup();
     
     return 1;
 }
@@ -567,30 +1173,8 @@ void popup_hide(void) {
         return;
     }
     
-    msg(LOG_DEBUG, "popup_hide: starting cleanup, window=%lu", popup_window);
-    
     if (popup_window) {
-        if (xft_draw) {
-            XftDrawDestroy(xft_draw);
-            xft_draw = NULL;
-            msg(LOG_DEBUG, "popup_hide: destroyed xft_draw");
-        }
-        if (popup_gc) {
-            XFreeGC(display, popup_gc);
-            popup_gc = 0;
-            msg(LOG_DEBUG, "popup_hide: freed popup_gc");
-        }
-        
-        // Force unmapping before destroying
         XUnmapWindow(display, popup_window);
-        XSync(display, False);
-        msg(LOG_DEBUG, "popup_hide: unmapped window");
-        
-        XDestroyWindow(display, popup_window);
-        XSync(display, False);
-        msg(LOG_DEBUG, "popup_hide: destroyed window");
-        
-        popup_window = 0;
     }
     
     showing_popup = 0;
@@ -598,14 +1182,49 @@ void popup_hide(void) {
     anchor_x = -1;
     anchor_y = -1;
     
-    // Force a final flush to ensure all X11 commands are processed
     XFlush(display);
-    msg(LOG_DEBUG, "popup_hide: cleanup completed");
+    
+    // anything but zero is a regression on the hot path
+    msg(session_round_trips > 0 ? LOG_NOTICE : LOG_DEBUG,
+        "Popup session: %lu redraws, %lu round trips to the server", session_redraws, session_round_trips);
 }
 
 void popup_cleanup(void) {
     popup_hide();
     
+    if (pointer_query_pending) {
+        xcb_discard_reply(XGetXCBConnection(display), pointer_cookie.sequence);
+        pointer_query_pending = 0;
+    }
+    
+    if (xft_draw) {
+        XftDrawDestroy(xft_draw);
+        xft_draw = NULL;
+    }
+    if (back_buffer) {
+        XFreePixmap(display, back_buffer);
+        back_buffer = 0;
+    }
+    if (popup_gc) {
+        XFreeGC(display, popup_gc);
+        popup_gc = 0;
+    }
+    if (background_gc) {
+        XFreeGC(display, background_gc);
+        background_gc = 0;
+    }
+    if (popup_window) {
+        XDestroyWindow(display, popup_window);
+        popup_window = 0;
+    }
+    
+    current_thumbnail = NULL;
+    for (int i = 0; i < THUMBNAIL_CACHE_SIZE; i++) {
+        if (thumbnail_cache[i].image_hash) {
+            free_thumbnail_picture(&thumbnail_cache[i]);
+        }
+    }
+    
     if (xft_font) {
         XftFontClose(display, xft_font);
         xft_font = NULL;
@@ -622,12 +1241,31 @@ void popup_cleanup(void) {
         popup_text_capacity = 0;
     }
     
-    if (cached_unescaped_text) {
-        free(cached_unescaped_text);
-        cached_unescaped_text = NULL;
-        cached_unescaped_capacity = 0;
+    if (prefetch_timer) {
+        reactor_cancel_timer(g_reactor, prefetch_timer);
+        prefetch_timer = 0;
     }
     
+    if (layout_hits + layout_misses > 0) {
+        msg(LOG_DEBUG, "Layout cache: %lu hits, %lu misses", layout_hits, layout_misses);
+    }
+    current_layout = NULL;
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+        free_text_layout(&layout_cache[i]);
+    }
+    
+    if (rows_rendered > 0) {
+        msg(LOG_DEBUG, "List rows: %lu rendered, %lu copied", rows_rendered, rows_copied);
+    }
+    if (row_draw) {
+        XftDrawDestroy(row_draw);
+        row_draw = NULL;
+    }
+    for (int i = 0; i < ROW_CACHE_SIZE; i++) {
+        if (row_cache[i].pixmap) XFreePixmap(display, row_cache[i].pixmap);
+    }
+    memset(row_cache, 0, sizeof(row_cache));
+    
     FcFini();
 }
 
@@ -635,10 +1273,13 @@ int popup_is_showing(void) {
     return showing_popup;
 }
 
+// the back buffer still has the popup as it was drawn last
 void popup_handle_expose(XExposeEvent *expose_event) {
-    (void)expose_event;
+    if (expose_event->count > 0) return;
+    
     if (showing_popup && popup_window) {
-        popup_redraw();
+        present_back_buffer();
+        XFlush(display);
     }
 }
 
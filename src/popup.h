@@ -10,5 +10,7 @@ void popup_cleanup(void);
 void popup_update_text(const char *new_text);
 int popup_is_showing(void);
 void popup_handle_expose(XExposeEvent *expose_event);
+void popup_prefetch_pointer(void);
+int popup_handle_screen_event(XEvent *event);
 
 #endif // POPUP_H
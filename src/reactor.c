@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "halen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syslog.h>
+
+#define REACTOR_MAX_FDS 8
+#define REACTOR_MAX_TIMERS 16
+#define REACTOR_MAX_EVENTS 8
+
+typedef struct {
+    int fd;
+    reactor_fd_callback_t callback;
+    void *data;
+} reactor_fd_t;
+
+typedef struct {
+    int id;
+    long long deadline;
+    reactor_timer_callback_t callback;
+    void *data;
+} reactor_timer_t;
+
+struct reactor {
+    int epoll_fd;
+    int timer_fd;
+    reactor_fd_t fds[REACTOR_MAX_FDS];
+    int fd_count;
+    reactor_prepare_t prepare;
+    void *prepare_data;
+    
+    // timers may be added from other threads
+    pthread_mutex_t timer_mutex;
+    reactor_timer_t timers[REACTOR_MAX_TIMERS];   // sorted by deadline
+    int timer_count;
+    int next_timer_id;
+    long long prepared_deadline;
+    long long armed_deadline;
+    unsigned long wakeups;
+};
+
+static void arm_timer(reactor_t *reactor);
+static void run_expired_timers(reactor_t *reactor);
+
+long long reactor_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// the timerfd always fires at the earliest deadline, called with the
+// timer mutex held
+static void arm_timer(reactor_t *reactor) {
+    long long deadline = reactor->prepared_deadline;
+    if (reactor->timer_count > 0 && reactor->timers[0].deadline < deadline) {
+        deadline = reactor->timers[0].deadline;
+    }
+    if (deadline == reactor->armed_deadline) return;
+    
+    struct itimerspec timer_value = { 0 };
+    if (deadline != LLONG_MAX) {
+        // a zero it_value would disarm the timer
+        long long expiry = deadline > 0 ? deadline : 1;
+        timer_value.it_value.tv_sec = expiry / 1000;
+        timer_value.it_value.tv_nsec = (expiry % 1000) * 1000000L;
+    }
+    
+    if (timerfd_settime(reactor->timer_fd, TFD_TIMER_ABSTIME, &timer_value, NULL) == -1) {
+        msg(LOG_WARNING, "Failed to arm reactor timer: %s", strerror(errno));
+        return;
+    }
+    reactor->armed_deadline = deadline;
+}
+
+static void run_expired_timers(reactor_t *reactor) {
+    uint64_t expirations;
+    if (read(reactor->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        msg(LOG_WARNING, "Failed to read reactor timer: %s", strerror(errno));
+    }
+    
+    pthread_mutex_lock(&reactor->timer_mutex);
+    // the timer fired, it has to be armed again whatever the deadline is
+    reactor->armed_deadline = LLONG_MIN;
+    
+    long long now = reactor_now();
+    while (reactor->timer_count > 0 && reactor->timers[0].deadline <= now) {
+        reactor_timer_t timer = reactor->timers[0];
+        reactor->timer_count--;
+        memmove(&reactor->timers[0], &reactor->timers[1], reactor->timer_count * sizeof(reactor_timer_t));
+        
+        // callbacks may add or cancel timers
+        pthread_mutex_unlock(&reactor->timer_mutex);
+        timer.callback(timer.data);
+        pthread_mutex_lock(&reactor->timer_mutex);
+    }
+    
+    pthread_mutex_unlock(&reactor->timer_mutex);
+}
+
+reactor_t* reactor_create(void) {
+    reactor_t *reactor = calloc(1, sizeof(reactor_t));
+    if (!reactor) return NULL;
+    
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reactor->epoll_fd == -1 || reactor->timer_fd == -1) {
+        msg(LOG_ERR, "Failed to create event loop: %s", strerror(errno));
+        if (reactor->epoll_fd != -1) close(reactor->epoll_fd);
+        if (reactor->timer_fd != -1) close(reactor->timer_fd);
+        free(reactor);
+        return NULL;
+    }
+    
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = reactor->timer_fd };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &event) == -1) {
+        msg(LOG_ERR, "Failed to watch reactor timer: %s", strerror(errno));
+        close(reactor->epoll_fd);
+        close(reactor->timer_fd);
+        free(reactor);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&reactor->timer_mutex, NULL);
+    reactor->next_timer_id = 1;
+    reactor->prepared_deadline = LLONG_MAX;
+    reactor->armed_deadline = LLONG_MAX;
+    
+    return reactor;
+}
+
+void reactor_destroy(reactor_t *reactor) {
+    if (!reactor) return;
+    
+    msg(LOG_DEBUG, "Event loop woke up %lu times", reactor->wakeups);
+    close(reactor->epoll_fd);
+    close(reactor->timer_fd);
+    pthread_mutex_destroy(&reactor->timer_mutex);
+    free(reactor);
+}
+
+int reactor_add_fd(reactor_t *reactor, int fd, reactor_fd_callback_t callback, void *data) {
+    if (reactor->fd_count >= REACTOR_MAX_FDS) {
+        msg(LOG_ERR, "Too many file descriptors in event loop");
+        return 0;
+    }
+    
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        msg(LOG_ERR, "Failed to watch file descriptor %d: %s", fd, strerror(errno));
+        return 0;
+    }
+    
+    reactor->fds[reactor->fd_count++] = (reactor_fd_t){ fd, callback, data };
+    return 1;
+}
+
+void reactor_remove_fd(reactor_t *reactor, int fd) {
+    for (int i = 0; i < reactor->fd_count; i++) {
+        if (reactor->fds[i].fd == fd) {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            reactor->fds[i] = reactor->fds[--reactor->fd_count];
+            return;
+        }
+    }
+}
+
+// returns the id of the timer, 0 if there is no room for it
+int reactor_add_timer(reactor_t *reactor, long long delay_ms, reactor_timer_callback_t callback, void *data) {
+    long long deadline = reactor_now() + (delay_ms > 0 ? delay_ms : 0);
+    
+    pthread_mutex_lock(&reactor->timer_mutex);
+    
+    if (reactor->timer_count >= REACTOR_MAX_TIMERS) {
+        pthread_mutex_unlock(&reactor->timer_mutex);
+        msg(LOG_ERR, "Too many timers in event loop");
+        return 0;
+    }
+    
+    int position = reactor->timer_count;
+    while (position > 0 && reactor->timers[position - 1].deadline > deadline) {
+        reactor->timers[position] = reactor->timers[position - 1];
+        position--;
+    }
+    
+    int timer_id = reactor->next_timer_id++;
+    if (reactor->next_timer_id <= 0) reactor->next_timer_id = 1;
+    reactor->timers[position] = (reactor_timer_t){ timer_id, deadline, callback, data };
+    reactor->timer_count++;
+    arm_timer(reactor);
+    
+    pthread_mutex_unlock(&reactor->timer_mutex);
+    return timer_id;
+}
+
+void reactor_cancel_timer(reactor_t *reactor, int timer_id) {
+    if (timer_id <= 0) return;
+    
+    pthread_mutex_lock(&reactor->timer_mutex);
+    for (int i = 0; i < reactor->timer_count; i++) {
+        if (reactor->timers[i].id == timer_id) {
+            reactor->timer_count--;
+            memmove(&reactor->timers[i], &reactor->timers[i + 1],
+                    (reactor->timer_count - i) * sizeof(reactor_timer_t));
+            arm_timer(reactor);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reactor->timer_mutex);
+}
+
+void reactor_set_prepare(reactor_t *reactor, reactor_prepare_t prepare, void *data) {
+    reactor->prepare = prepare;
+    reactor->prepare_data = data;
+}
+
+// runs until *running is cleared, returns 0 if waiting failed
+int reactor_run(reactor_t *reactor, volatile int *running) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    
+    while (*running) {
+        long long prepared_deadline = reactor->prepare ? reactor->prepare(reactor->prepare_data) : LLONG_MAX;
+        if (!*running) break;
+        
+        pthread_mutex_lock(&reactor->timer_mutex);
+        reactor->prepared_deadline = prepared_deadline;
+        arm_timer(reactor);
+        pthread_mutex_unlock(&reactor->timer_mutex);
+        
+        int event_count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (event_count < 0) {
+            if (errno == EINTR) continue;
+            msg(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+            return 0;
+        }
+        reactor->wakeups++;
+        
+        for (int i = 0; i < event_count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == reactor->timer_fd) {
+                run_expired_timers(reactor);
+                continue;
+            }
+            for (int j = 0; j < reactor->fd_count; j++) {
+                if (reactor->fds[j].fd == fd) {
+                    reactor->fds[j].callback(fd, reactor->fds[j].data);
+                    break;
+                }
+            }
+        }
+    }
+    
+    return 1;
+}
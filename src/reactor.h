@@ -0,0 +1,26 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// epoll event loop. File descriptors get a callback when they are
+// readable, timers are kept sorted by deadline behind a single timerfd,
+// so a loop with nothing to do doesn't wake up at all. The prepare
+// callback runs before every wait and may ask for a wakeup of its own
+// by returning a deadline (monotonic milliseconds, LLONG_MAX for none).
+// Timers can be added and cancelled from other threads.
+typedef struct reactor reactor_t;
+
+typedef void      (*reactor_fd_callback_t)(int fd, void *data);
+typedef void      (*reactor_timer_callback_t)(void *data);
+typedef long long (*reactor_prepare_t)(void *data);
+
+reactor_t* reactor_create(void);
+void       reactor_destroy(reactor_t *reactor);
+int        reactor_add_fd(reactor_t *reactor, int fd, reactor_fd_callback_t callback, void *data);
+void       reactor_remove_fd(reactor_t *reactor, int fd);
+int        reactor_add_timer(reactor_t *reactor, long long delay_ms, reactor_timer_callback_t callback, void *data);
+void       reactor_cancel_timer(reactor_t *reactor, int timer_id);
+void       reactor_set_prepare(reactor_t *reactor, reactor_prepare_t prepare, void *data);
+int        reactor_run(reactor_t *reactor, volatile int *running);
+long long  reactor_now(void);
+
+#endif // REACTOR_H
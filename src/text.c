@@ -93,13 +93,6 @@ char* text_unescape_content(const char* content) {
 char* text_format_for_display(const char* content) {
     if (!content) return NULL;
     
-    // size_t buffer_size = (max_lines * (max_line_length + 1)) + 100;
-    char *result = malloc(display_content_length);
-    if (!result) return strdup(content);
-    
-    char *write_position = result;
-    const char *line_start = content;
-    int displayed_lines = 0;
     int total_lines = 0;
     
     for (const char *character = content; *character; character++) {
@@ -109,6 +102,22 @@ char* text_format_for_display(const char* content) {
         total_lines++;
     }
     
+    return text_format_for_display_lines(content, total_lines);
+}
+
+// content only needs to hold the lines that get displayed, total_lines is
+// the line count of the complete content (used for the "(+N lines)" marker)
+char* text_format_for_display_lines(const char* content, int total_lines) {
+    if (!content) return NULL;
+    
+    // size_t buffer_size = (max_lines * (max_line_length + 1)) + 100;
+    char *result = malloc(display_content_length);
+    if (!result) return strdup(content);
+    
+    char *write_position = result;
+    const char *line_start = content;
+    int displayed_lines = 0;
+    
     while (*line_start && displayed_lines < config.max_lines) {
         const char *line_end = strchr(line_start, '\n');
         int line_length;
@@ -186,12 +195,12 @@ char* text_truncate_for_storage(const char* content, char** overflow_hash) {
         return text_format_for_display(content);
     }
     
-    uint32_t content_hash = text_calculate_hash(content);
-    *overflow_hash = malloc(16);
+    uint64_t content_hash = text_hash64_update(TEXT_HASH64_SEED, content, content_length);
+    *overflow_hash = malloc(24);
     if (!*overflow_hash) {
         return strdup(content);
     }
-    snprintf(*overflow_hash, 16, "%08x", content_hash);
+    snprintf(*overflow_hash, 24, "%016llx", (unsigned long long)content_hash);
     
     char overflow_file_path[PATH_MAX];
     snprintf(overflow_file_path, sizeof(overflow_file_path), "%s/%s", 
@@ -219,11 +228,28 @@ char* text_truncate_for_storage(const char* content, char** overflow_hash) {
 }
 
 uint32_t text_calculate_hash(const char* content) {
-    uint32_t hash_value = 2166136261u;
+    return text_hash_update(TEXT_HASH_SEED, content, strlen(content));
+}
+
+// incremental version of text_calculate_hash, feed chunks in order starting
+// from TEXT_HASH_SEED to get the same value as hashing the whole content
+uint32_t text_hash_update(uint32_t hash_value, const char* data, size_t length) {
     const uint32_t prime = 16777619u;
     
-    for (const char *character = content; *character; character++) {
-        hash_value ^= (uint32_t)*character;
+    for (size_t i = 0; i < length; i++) {
+        hash_value ^= (uint32_t)data[i];
+        hash_value *= prime;
+    }
+    
+    return hash_value;
+}
+
+// 64-bit FNV-1a, used where a 32-bit hash is too collision prone
+uint64_t text_hash64_update(uint64_t hash_value, const char* data, size_t length) {
+    const uint64_t prime = 1099511628211ull;
+    
+    for (size_t i = 0; i < length; i++) {
+        hash_value ^= (unsigned char)data[i];
         hash_value *= prime;
     }
     
@@ -4,11 +4,17 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define TEXT_HASH_SEED 2166136261u
+#define TEXT_HASH64_SEED 14695981039346656037ull
+
 char* text_escape_content(const char* content);
 char* text_unescape_content(const char* content);
 char* text_format_for_display(const char* content);
+char* text_format_for_display_lines(const char* content, int total_lines);
 char* text_truncate_for_storage(const char* content, char** overflow_hash);
 uint32_t text_calculate_hash(const char* content);
+uint32_t text_hash_update(uint32_t hash_value, const char* data, size_t length);
+uint64_t text_hash64_update(uint64_t hash_value, const char* data, size_t length);
 int text_contains_non_whitespace(const char* content);
 char* text_trim_trailing_whitespace(char* content);
 void text_set_memory_limit(void);
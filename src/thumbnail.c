@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "thumbnail.h"
+#include "halen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <png.h>
+#include <sys/syslog.h>
+#include <linux/limits.h>
+
+#define THUMBNAIL_MAGIC 0x4d485448u   // "HTHM"
+// larger images are not decoded at all
+#define THUMBNAIL_MAX_SOURCE_PIXELS (32 * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t image_width;
+    uint32_t image_height;
+} thumbnail_header_t;
+
+static void thumbnail_path(const char *image_hash, char *path, size_t path_size);
+static int  read_thumbnail_header(FILE *thumbnail_file, thumbnail_header_t *header);
+static uint32_t* scale_image(const uint8_t *pixels, int image_width, int image_height,
+                             int width, int height);
+static int  write_thumbnail(const char *image_hash, const thumbnail_header_t *header, const uint32_t *pixels);
+
+static void thumbnail_path(const char *image_hash, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s.thumb", config.overflow_directory, image_hash);
+}
+
+static int read_thumbnail_header(FILE *thumbnail_file, thumbnail_header_t *header) {
+    if (fread(header, sizeof(*header), 1, thumbnail_file) != 1) return 0;
+    
+    return header->magic == THUMBNAIL_MAGIC &&
+           header->width > 0 && header->width <= THUMBNAIL_MAX_WIDTH &&
+           header->height > 0 && header->height <= THUMBNAIL_MAX_HEIGHT;
+}
+
+// box filter, every thumbnail pixel is the average of the image pixels
+// it covers. The result is premultiplied as XRender expects it.
+static uint32_t* scale_image(const uint8_t *pixels, int image_width, int image_height,
+                             int width, int height) {
+    uint32_t *thumbnail = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!thumbnail) return NULL;
+    
+    for (int y = 0; y < height; y++) {
+        int source_top = (int)((long long)y * image_height / height);
+        int source_bottom = (int)((long long)(y + 1) * image_height / height);
+        if (source_bottom <= source_top) source_bottom = source_top + 1;
+        
+        for (int x = 0; x < width; x++) {
+            int source_left = (int)((long long)x * image_width / width);
+            int source_right = (int)((long long)(x + 1) * image_width / width);
+            if (source_right <= source_left) source_right = source_left + 1;
+            
+            uint64_t red = 0, green = 0, blue = 0, alpha = 0;
+            for (int source_y = source_top; source_y < source_bottom; source_y++) {
+                const uint8_t *pixel = pixels + ((size_t)source_y * image_width + source_left) * 4;
+                for (int source_x = source_left; source_x < source_right; source_x++, pixel += 4) {
+                    // PNG_FORMAT_RGBA, not premultiplied
+                    red += pixel[0] * pixel[3];
+                    green += pixel[1] * pixel[3];
+                    blue += pixel[2] * pixel[3];
+                    alpha += pixel[3];
+                }
+            }
+            
+            uint64_t count = (uint64_t)(source_bottom - source_top) * (source_right - source_left);
+            uint32_t average_alpha = alpha / count;
+            uint32_t average_red = red / (count * 255);
+            uint32_t average_green = green / (count * 255);
+            uint32_t average_blue = blue / (count * 255);
+            
+            thumbnail[(size_t)y * width + x] = (average_alpha << 24) | (average_red << 16) |
+                                               (average_green << 8) | average_blue;
+        }
+    }
+    
+    return thumbnail;
+}
+
+static int write_thumbnail(const char *image_hash, const thumbnail_header_t *header, const uint32_t *pixels) {
+    char thumbnail_file_path[PATH_MAX];
+    char temporary_path[PATH_MAX];
+    thumbnail_path(image_hash, thumbnail_file_path, sizeof(thumbnail_file_path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s/.incoming-XXXXXX", config.overflow_directory);
+    
+    int file_descriptor = mkstemp(temporary_path);
+    if (file_descriptor == -1) {
+        msg(LOG_WARNING, "Failed to create thumbnail file: %s", strerror(errno));
+        return 0;
+    }
+    
+    FILE *thumbnail_file = fdopen(file_descriptor, "w");
+    if (!thumbnail_file) {
+        close(file_descriptor);
+        unlink(temporary_path);
+        return 0;
+    }
+    
+    size_t pixel_count = (size_t)header->width * header->height;
+    int write_failed = fwrite(header, sizeof(*header), 1, thumbnail_file) != 1 ||
+                       fwrite(pixels, sizeof(uint32_t), pixel_count, thumbnail_file) != pixel_count;
+    if (fclose(thumbnail_file) != 0) {
+        write_failed = 1;
+    }
+    
+    if (write_failed || rename(temporary_path, thumbnail_file_path) != 0) {
+        msg(LOG_WARNING, "Failed to store thumbnail for %s", image_hash);
+        unlink(temporary_path);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// decodes the image/png blob and stores its thumbnail, does nothing but
+// report the image size if the thumbnail already exists
+int thumbnail_create(const char *image_hash, int *image_width, int *image_height) {
+    if (!config.overflow_directory || !image_hash) return 0;
+    
+    char path[PATH_MAX];
+    thumbnail_path(image_hash, path, sizeof(path));
+    
+    FILE *existing_file = fopen(path, "r");
+    if (existing_file) {
+        thumbnail_header_t header;
+        int valid = read_thumbnail_header(existing_file, &header);
+        fclose(existing_file);
+        if (valid) {
+            *image_width = (int)header.image_width;
+            *image_height = (int)header.image_height;
+            return 1;
+        }
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", config.overflow_directory, image_hash);
+    
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    
+    if (!png_image_begin_read_from_file(&image, path)) {
+        msg(LOG_WARNING, "Failed to read image %s: %s", image_hash, image.message);
+        return 0;
+    }
+    
+    if (image.width == 0 || image.height == 0 ||
+        (unsigned long long)image.width * image.height > THUMBNAIL_MAX_SOURCE_PIXELS) {
+        msg(LOG_NOTICE, "Image %s is too large for a thumbnail (%ux%u)", image_hash, image.width, image.height);
+        png_image_free(&image);
+        return 0;
+    }
+    
+    image.format = PNG_FORMAT_RGBA;
+    uint8_t *pixels = malloc(PNG_IMAGE_SIZE(image));
+    if (!pixels) {
+        png_image_free(&image);
+        return 0;
+    }
+    
+    if (!png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+        msg(LOG_WARNING, "Failed to decode image %s: %s", image_hash, image.message);
+        free(pixels);
+        return 0;
+    }
+    
+    // scale down to fit, keeping the aspect ratio, never scale up
+    int width = (int)image.width;
+    int height = (int)image.height;
+    if (width > THUMBNAIL_MAX_WIDTH) {
+        height = (int)((long long)height * THUMBNAIL_MAX_WIDTH / width);
+        width = THUMBNAIL_MAX_WIDTH;
+    }
+    if (height > THUMBNAIL_MAX_HEIGHT) {
+        width = (int)((long long)width * THUMBNAIL_MAX_HEIGHT / height);
+        height = THUMBNAIL_MAX_HEIGHT;
+    }
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+    
+    uint32_t *thumbnail = scale_image(pixels, (int)image.width, (int)image.height, width, height);
+    free(pixels);
+    if (!thumbnail) return 0;
+    
+    thumbnail_header_t header = { THUMBNAIL_MAGIC, (uint32_t)width, (uint32_t)height,
+                                  image.width, image.height };
+    int result = write_thumbnail(image_hash, &header, thumbnail);
+    free(thumbnail);
+    
+    if (result) {
+        msg(LOG_DEBUG, "Created %dx%d thumbnail for %ux%u image %s", width, height,
+            image.width, image.height, image_hash);
+        *image_width = (int)image.width;
+        *image_height = (int)image.height;
+    }
+    
+    return result;
+}
+
+uint32_t* thumbnail_load(const char *image_hash, int *width, int *height) {
+    if (!config.overflow_directory || !image_hash) return NULL;
+    
+    char path[PATH_MAX];
+    thumbnail_path(image_hash, path, sizeof(path));
+    
+    FILE *thumbnail_file = fopen(path, "r");
+    if (!thumbnail_file) return NULL;
+    
+    thumbnail_header_t header;
+    if (!read_thumbnail_header(thumbnail_file, &header)) {
+        msg(LOG_WARNING, "Invalid thumbnail file: %s", path);
+        fclose(thumbnail_file);
+        return NULL;
+    }
+    
+    size_t pixel_count = (size_t)header.width * header.height;
+    uint32_t *pixels = malloc(pixel_count * sizeof(uint32_t));
+    if (pixels && fread(pixels, sizeof(uint32_t), pixel_count, thumbnail_file) != pixel_count) {
+        msg(LOG_WARNING, "Truncated thumbnail file: %s", path);
+        free(pixels);
+        pixels = NULL;
+    }
+    fclose(thumbnail_file);
+    
+    if (pixels) {
+        *width = (int)header.width;
+        *height = (int)header.height;
+    }
+    return pixels;
+}
+
+void thumbnail_delete(const char *image_hash) {
+    if (!config.overflow_directory || !image_hash) return;
+    
+    char path[PATH_MAX];
+    thumbnail_path(image_hash, path, sizeof(path));
+    
+    if (unlink(path) == 0) {
+        msg(LOG_DEBUG, "Deleted thumbnail: %s", path);
+    }
+}
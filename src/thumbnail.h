@@ -0,0 +1,16 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+#include <stdint.h>
+
+#define THUMBNAIL_MAX_WIDTH 320
+#define THUMBNAIL_MAX_HEIGHT 200
+
+// Thumbnails of image/png blobs are created once, when the image is
+// captured, and stored as premultiplied ARGB32 next to the blob
+// (<hash>.thumb) so the popup never has to decode a PNG.
+int       thumbnail_create(const char *image_hash, int *image_width, int *image_height);
+uint32_t* thumbnail_load(const char *image_hash, int *width, int *height);
+void      thumbnail_delete(const char *image_hash);
+
+#endif // THUMBNAIL_H